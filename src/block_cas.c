@@ -0,0 +1,285 @@
+/*
+ * Content addressed disk image
+ * 
+ * Copyright (c) 2026 The TinyEMU contributors
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "cutils.h"
+#include "list.h"
+#include "virtio.h"
+#include "machine.h"
+#include "sha256.h"
+#include "block_cow.h"
+#include "block_cas.h"
+
+#define SECTOR_SIZE 512
+
+typedef struct {
+    struct list_head link;
+    int chunk_id; /* -1 if not used */
+    uint8_t *buf;
+} CASCacheEntry;
+
+typedef struct {
+    char *store_path;
+    int chunk_size;
+    int64_t nb_chunks;
+    int64_t nb_sectors;
+    /* identical chunks share the same ID so they are cached once */
+    int *chunk_id; /* -1 for a zero chunk */
+    int nb_ids;
+    uint8_t (*id_hash)[SHA256_DIGEST_LENGTH]; /* sorted */
+    CASCacheEntry **id_cache; /* NULL if the chunk is not in the cache */
+    struct list_head lru_list; /* most recently used entry first */
+    CASCacheEntry *cache_tab;
+    int cache_size;
+    /* the store is read-only: the writes are kept in memory */
+    BlockCOW *cow;
+} BlockDeviceCAS;
+
+BOOL block_cas_probe(FILE *f)
+{
+    uint8_t buf[8];
+    BOOL ret;
+
+    fseeko(f, 0, SEEK_SET);
+    ret = (fread(buf, 1, 8, f) == 8 && !memcmp(buf, BLOCK_CAS_MAGIC, 8));
+    fseeko(f, 0, SEEK_SET);
+    return ret;
+}
+
+static int cas_load_chunk(BlockDeviceCAS *s, int chunk_id, uint8_t *buf)
+{
+    uint8_t hash[SHA256_DIGEST_LENGTH];
+    char *fname;
+    FILE *f;
+    int ret;
+
+    fname = block_cas_get_chunk_path(s->store_path, s->id_hash[chunk_id]);
+    f = fopen(fname, "rb");
+    if (!f) {
+        perror(fname);
+        free(fname);
+        return -1;
+    }
+    ret = 0;
+    if (fread(buf, 1, s->chunk_size, f) != s->chunk_size) {
+        ret = -1;
+    } else {
+        /* check the chunk content */
+        SHA256(buf, s->chunk_size, hash);
+        if (memcmp(hash, s->id_hash[chunk_id], SHA256_DIGEST_LENGTH) != 0)
+            ret = -1;
+    }
+    if (ret < 0)
+        fprintf(stderr, "%s: invalid chunk\n", fname);
+    fclose(f);
+    free(fname);
+    return ret;
+}
+
+/* return the chunk data or NULL if error */
+static uint8_t *cas_get_chunk(BlockDeviceCAS *s, int chunk_id)
+{
+    CASCacheEntry *ce;
+
+    ce = s->id_cache[chunk_id];
+    if (!ce) {
+        /* reuse the least recently used entry */
+        ce = list_entry(s->lru_list.prev, CASCacheEntry, link);
+        if (ce->chunk_id >= 0)
+            s->id_cache[ce->chunk_id] = NULL;
+        ce->chunk_id = -1;
+        if (cas_load_chunk(s, chunk_id, ce->buf) < 0)
+            return NULL;
+        ce->chunk_id = chunk_id;
+        s->id_cache[chunk_id] = ce;
+    }
+    list_del(&ce->link);
+    list_add(&ce->link, &s->lru_list);
+    return ce->buf;
+}
+
+static int cas_read_image(void *opaque, uint64_t sector_num,
+                          uint8_t *buf, int n)
+{
+    BlockDeviceCAS *s = opaque;
+    uint64_t pos;
+    int64_t chunk_idx;
+    int offset, l, len, chunk_id;
+    uint8_t *ptr;
+
+    pos = sector_num * SECTOR_SIZE;
+    len = n * SECTOR_SIZE;
+    while (len > 0) {
+        chunk_idx = pos / s->chunk_size;
+        offset = pos % s->chunk_size;
+        l = min_int(len, s->chunk_size - offset);
+        chunk_id = s->chunk_id[chunk_idx];
+        if (chunk_id < 0) {
+            memset(buf, 0, l);
+        } else {
+            ptr = cas_get_chunk(s, chunk_id);
+            if (!ptr)
+                return -1;
+            memcpy(buf, ptr + offset, l);
+        }
+        pos += l;
+        buf += l;
+        len -= l;
+    }
+    return 0;
+}
+
+static int64_t cas_get_sector_count(BlockDevice *bs)
+{
+    BlockDeviceCAS *s = bs->opaque;
+    return s->nb_sectors;
+}
+
+static int cas_read_async(BlockDevice *bs,
+                          uint64_t sector_num, uint8_t *buf, int n,
+                          BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    BlockDeviceCAS *s = bs->opaque;
+    /* synchronous read */
+    return block_cow_read(s->cow, sector_num, buf, n);
+}
+
+static int cas_write_async(BlockDevice *bs,
+                           uint64_t sector_num, const uint8_t *buf, int n,
+                           BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    BlockDeviceCAS *s = bs->opaque;
+    return block_cow_write(s->cow, sector_num, buf, n);
+}
+
+static int hash_cmp(const void *a, const void *b)
+{
+    return memcmp(a, b, SHA256_DIGEST_LENGTH);
+}
+
+/* return NULL if error. 'cache_size' is the number of chunks kept in
+   memory. */
+BlockDevice *block_cas_init(const char *filename, int cache_size)
+{
+    static const uint8_t zero_hash[SHA256_DIGEST_LENGTH];
+    BlockDevice *bs;
+    BlockDeviceCAS *s;
+    FILE *f;
+    uint8_t header[BLOCK_CAS_HEADER_SIZE], (*hash_tab)[SHA256_DIGEST_LENGTH];
+    uint8_t (*p)[SHA256_DIGEST_LENGTH];
+    uint32_t chunk_size, nb_chunks, path_len;
+    uint64_t image_size;
+    char *path;
+    int64_t i;
+    int n;
+
+    f = fopen(filename, "rb");
+    if (!f) {
+        perror(filename);
+        return NULL;
+    }
+    path = NULL;
+    hash_tab = NULL;
+    if (fread(header, 1, sizeof(header), f) != sizeof(header) ||
+        memcmp(header, BLOCK_CAS_MAGIC, 8) != 0)
+        goto fail;
+    chunk_size = get_le32(header + 8);
+    nb_chunks = get_le32(header + 12);
+    image_size = get_le64(header + 16);
+    path_len = get_le32(header + 24);
+    if (chunk_size < SECTOR_SIZE || (chunk_size % SECTOR_SIZE) != 0 ||
+        chunk_size > (1 << 24) ||
+        image_size > (uint64_t)nb_chunks * chunk_size ||
+        nb_chunks > (INT32_MAX / SHA256_DIGEST_LENGTH) || path_len > 4096)
+        goto fail;
+    path = malloc(path_len + 1);
+    if (fread(path, 1, path_len, f) != path_len)
+        goto fail;
+    path[path_len] = '\0';
+    hash_tab = malloc(SHA256_DIGEST_LENGTH * max_int(nb_chunks, 1));
+    if (fread(hash_tab, SHA256_DIGEST_LENGTH, nb_chunks, f) != nb_chunks)
+        goto fail;
+    fclose(f);
+
+    s = mallocz(sizeof(*s));
+    s->store_path = get_file_path(filename, path);
+    free(path);
+    s->chunk_size = chunk_size;
+    s->nb_chunks = nb_chunks;
+    s->nb_sectors = image_size / SECTOR_SIZE;
+
+    /* build the sorted table of the distinct chunks */
+    s->id_hash = malloc(SHA256_DIGEST_LENGTH * max_int(nb_chunks, 1));
+    n = 0;
+    for(i = 0; i < nb_chunks; i++) {
+        if (memcmp(hash_tab[i], zero_hash, SHA256_DIGEST_LENGTH) != 0)
+            memcpy(s->id_hash[n++], hash_tab[i], SHA256_DIGEST_LENGTH);
+    }
+    qsort(s->id_hash, n, SHA256_DIGEST_LENGTH, hash_cmp);
+    s->nb_ids = 0;
+    for(i = 0; i < n; i++) {
+        if (s->nb_ids == 0 ||
+            memcmp(s->id_hash[s->nb_ids - 1], s->id_hash[i],
+                   SHA256_DIGEST_LENGTH) != 0) {
+            memcpy(s->id_hash[s->nb_ids++], s->id_hash[i],
+                   SHA256_DIGEST_LENGTH);
+        }
+    }
+    s->chunk_id = malloc(sizeof(s->chunk_id[0]) * max_int(nb_chunks, 1));
+    for(i = 0; i < nb_chunks; i++) {
+        p = bsearch(hash_tab[i], s->id_hash, s->nb_ids,
+                    SHA256_DIGEST_LENGTH, hash_cmp);
+        s->chunk_id[i] = p ? p - s->id_hash : -1;
+    }
+    free(hash_tab);
+
+    s->id_cache = mallocz(sizeof(s->id_cache[0]) * max_int(s->nb_ids, 1));
+    s->cache_size = max_int(cache_size, 1);
+    s->cache_tab = mallocz(sizeof(s->cache_tab[0]) * s->cache_size);
+    init_list_head(&s->lru_list);
+    for(i = 0; i < s->cache_size; i++) {
+        CASCacheEntry *ce = &s->cache_tab[i];
+        ce->chunk_id = -1;
+        ce->buf = malloc(chunk_size);
+        list_add_tail(&ce->link, &s->lru_list);
+    }
+    s->cow = block_cow_new(s->nb_sectors, cas_read_image, s);
+
+    bs = mallocz(sizeof(*bs));
+    bs->opaque = s;
+    bs->get_sector_count = cas_get_sector_count;
+    bs->read_async = cas_read_async;
+    bs->write_async = cas_write_async;
+    return bs;
+ fail:
+    fprintf(stderr, "%s: invalid manifest\n", filename);
+    free(path);
+    free(hash_tab);
+    fclose(f);
+    return NULL;
+}
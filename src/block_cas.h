@@ -0,0 +1,66 @@
+/*
+ * Content addressed disk image
+ * 
+ * Copyright (c) 2026 The TinyEMU contributors
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef BLOCK_CAS_H
+#define BLOCK_CAS_H
+
+/* The disk image is described by a manifest listing the SHA-256 of each
+   chunk of chunk_size bytes. The chunks are stored in a directory shared
+   by several images, in the file "xx/hash" where hash is the SHA-256 in
+   hexadecimal and xx its first two digits, so identical chunks are only
+   stored once. Manifest layout (little endian):
+
+   magic (8 bytes), chunk_size (u32), chunk count (u32), image size in
+   bytes (u64), length of the store path (u32), store path (relative to
+   the manifest directory if not absolute), SHA-256 of each chunk.
+
+   An all-zero hash denotes a chunk containing only zeros, which is not
+   stored. */
+
+#define BLOCK_CAS_MAGIC "TEMUCAS1"
+#define BLOCK_CAS_HEADER_SIZE 28
+#define BLOCK_CAS_DEFAULT_CHUNK_SIZE (64 * 1024)
+#define BLOCK_CAS_HASH_SIZE 32 /* SHA-256 */
+
+/* return the file name of the chunk of SHA-256 'hash' in the store */
+static inline char *block_cas_get_chunk_path(const char *store_path,
+                                             const uint8_t *hash)
+{
+    char *fname, *q;
+    int i, len;
+
+    len = strlen(store_path);
+    fname = malloc(len + 4 + BLOCK_CAS_HASH_SIZE * 2 + 1);
+    q = fname + len;
+    memcpy(fname, store_path, len);
+    q += snprintf(q, 5, "/%02x/", hash[0]);
+    for(i = 0; i < BLOCK_CAS_HASH_SIZE; i++)
+        q += snprintf(q, 3, "%02x", hash[i]);
+    return fname;
+}
+
+BOOL block_cas_probe(FILE *f);
+BlockDevice *block_cas_init(const char *filename, int cache_size);
+
+#endif /* BLOCK_CAS_H */
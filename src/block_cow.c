@@ -0,0 +1,314 @@
+/*
+ * Copy on write disk overlay
+ * 
+ * Copyright (c) 2026 The TinyEMU contributors
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "cutils.h"
+#include "block_cow.h"
+
+#define SECTOR_SIZE BLOCK_COW_SECTOR_SIZE
+#define CLUSTER_SIZE BLOCK_COW_CLUSTER_SIZE
+#define CLUSTER_SECTORS (CLUSTER_SIZE / SECTOR_SIZE)
+
+/* each L2 table covers 32 MB */
+#define L2_BITS 9
+#define L2_SIZE (1 << L2_BITS)
+
+/* number of clusters allocated at once */
+#define ARENA_CLUSTERS 16
+
+struct BlockCOW {
+    int64_t nb_sectors;
+    int64_t nb_clusters;
+    int l1_size;
+    uint8_t ***l1_table; /* NULL if no cluster of the L2 table is written */
+    BlockCOWReadFunc *read_func;
+    void *opaque;
+    /* cluster arena */
+    uint8_t *arena_ptr;
+    int arena_left; /* number of free clusters at arena_ptr */
+    uint8_t **arena_tab;
+    int arena_count;
+    int arena_size;
+};
+
+BlockCOW *block_cow_new(int64_t nb_sectors,
+                        BlockCOWReadFunc *read_func, void *opaque)
+{
+    BlockCOW *s;
+
+    s = mallocz(sizeof(*s));
+    s->nb_sectors = nb_sectors;
+    s->nb_clusters = (nb_sectors + CLUSTER_SECTORS - 1) / CLUSTER_SECTORS;
+    s->l1_size = (s->nb_clusters + L2_SIZE - 1) >> L2_BITS;
+    s->l1_table = mallocz(sizeof(s->l1_table[0]) * max_int(s->l1_size, 1));
+    s->read_func = read_func;
+    s->opaque = opaque;
+    return s;
+}
+
+void block_cow_free(BlockCOW *s)
+{
+    int i;
+
+    for(i = 0; i < s->l1_size; i++)
+        free(s->l1_table[i]);
+    free(s->l1_table);
+    for(i = 0; i < s->arena_count; i++)
+        free(s->arena_tab[i]);
+    free(s->arena_tab);
+    free(s);
+}
+
+static uint8_t *get_cluster(BlockCOW *s, uint64_t cluster)
+{
+    uint8_t **l2;
+    l2 = s->l1_table[cluster >> L2_BITS];
+    if (!l2)
+        return NULL;
+    return l2[cluster & (L2_SIZE - 1)];
+}
+
+/* the cluster is not mapped until set_cluster() is called */
+static uint8_t *alloc_cluster(BlockCOW *s)
+{
+    uint8_t *ptr;
+
+    if (s->arena_left == 0) {
+        if (s->arena_count >= s->arena_size) {
+            s->arena_size = max_int(s->arena_size * 3 / 2, 16);
+            s->arena_tab = realloc(s->arena_tab, sizeof(s->arena_tab[0]) *
+                                   s->arena_size);
+        }
+        s->arena_ptr = malloc(ARENA_CLUSTERS * CLUSTER_SIZE);
+        s->arena_tab[s->arena_count++] = s->arena_ptr;
+        s->arena_left = ARENA_CLUSTERS;
+    }
+    ptr = s->arena_ptr;
+    s->arena_ptr += CLUSTER_SIZE;
+    s->arena_left--;
+    return ptr;
+}
+
+/* free the last cluster returned by alloc_cluster() */
+static void free_last_cluster(BlockCOW *s)
+{
+    s->arena_ptr -= CLUSTER_SIZE;
+    s->arena_left++;
+}
+
+static void set_cluster(BlockCOW *s, uint64_t cluster, uint8_t *ptr)
+{
+    uint8_t **l2;
+
+    l2 = s->l1_table[cluster >> L2_BITS];
+    if (!l2) {
+        l2 = mallocz(sizeof(l2[0]) * L2_SIZE);
+        s->l1_table[cluster >> L2_BITS] = l2;
+    }
+    l2[cluster & (L2_SIZE - 1)] = ptr;
+}
+
+/* the last cluster may be partial */
+static int get_cluster_sectors(BlockCOW *s, uint64_t cluster)
+{
+    int64_t n;
+    n = s->nb_sectors - cluster * CLUSTER_SECTORS;
+    return min_int(n, CLUSTER_SECTORS);
+}
+
+int block_cow_read(BlockCOW *s, uint64_t sector_num, uint8_t *buf, int n)
+{
+    uint64_t cluster;
+    int offset, l;
+    uint8_t *ptr;
+
+    if ((sector_num + n) > s->nb_sectors)
+        return -1;
+    while (n > 0) {
+        cluster = sector_num / CLUSTER_SECTORS;
+        offset = sector_num % CLUSTER_SECTORS;
+        l = min_int(n, CLUSTER_SECTORS - offset);
+        ptr = get_cluster(s, cluster);
+        if (ptr) {
+            memcpy(buf, ptr + offset * SECTOR_SIZE, l * SECTOR_SIZE);
+        } else {
+            /* read the following unmodified clusters in one pass */
+            while (l < n && !get_cluster(s, ++cluster))
+                l = min_int(n, l + CLUSTER_SECTORS);
+            if (s->read_func(s->opaque, sector_num, buf, l) < 0)
+                return -1;
+        }
+        sector_num += l;
+        buf += l * SECTOR_SIZE;
+        n -= l;
+    }
+    return 0;
+}
+
+int block_cow_write(BlockCOW *s, uint64_t sector_num, const uint8_t *buf,
+                    int n)
+{
+    uint64_t cluster;
+    int offset, l;
+    uint8_t *ptr;
+
+    if ((sector_num + n) > s->nb_sectors)
+        return -1;
+    while (n > 0) {
+        cluster = sector_num / CLUSTER_SECTORS;
+        offset = sector_num % CLUSTER_SECTORS;
+        l = min_int(n, CLUSTER_SECTORS - offset);
+        ptr = get_cluster(s, cluster);
+        if (!ptr) {
+            ptr = alloc_cluster(s);
+            if (l < get_cluster_sectors(s, cluster)) {
+                /* copy the rest of the cluster from the disk image */
+                if (s->read_func(s->opaque, cluster * CLUSTER_SECTORS, ptr,
+                                 get_cluster_sectors(s, cluster)) < 0) {
+                    free_last_cluster(s);
+                    return -1;
+                }
+            }
+            set_cluster(s, cluster, ptr);
+        }
+        memcpy(ptr + offset * SECTOR_SIZE, buf, l * SECTOR_SIZE);
+        sector_num += l;
+        buf += l * SECTOR_SIZE;
+        n -= l;
+    }
+    return 0;
+}
+
+/* return TRUE if some of the 'n' sectors were written */
+BOOL block_cow_is_modified(BlockCOW *s, uint64_t sector_num, int n)
+{
+    uint64_t cluster, last_cluster;
+
+    if (n <= 0)
+        return FALSE;
+    last_cluster = (sector_num + n - 1) / CLUSTER_SECTORS;
+    for(cluster = sector_num / CLUSTER_SECTORS; cluster <= last_cluster;
+        cluster++) {
+        if (get_cluster(s, cluster))
+            return TRUE;
+    }
+    return FALSE;
+}
+
+int block_cow_load(BlockCOW *s, const char *filename)
+{
+    FILE *f;
+    uint8_t *bitmap, *ptr;
+    int bitmap_size, len;
+    int64_t cluster;
+    int ret;
+
+    f = fopen(filename, "rb");
+    if (!f)
+        return -1;
+    ret = -1;
+    bitmap_size = (s->nb_clusters + 7) / 8;
+    bitmap = malloc(bitmap_size);
+    fseeko(f, 0, SEEK_END);
+    if (ftello(f) != s->nb_sectors * SECTOR_SIZE + bitmap_size)
+        goto fail;
+    fseeko(f, s->nb_sectors * SECTOR_SIZE, SEEK_SET);
+    if (fread(bitmap, 1, bitmap_size, f) != bitmap_size)
+        goto fail;
+    for(cluster = 0; cluster < s->nb_clusters; cluster++) {
+        if (!(bitmap[cluster >> 3] & (1 << (cluster & 7))))
+            continue;
+        ptr = get_cluster(s, cluster);
+        if (!ptr) {
+            ptr = alloc_cluster(s);
+            set_cluster(s, cluster, ptr);
+        }
+        len = get_cluster_sectors(s, cluster) * SECTOR_SIZE;
+        fseeko(f, cluster * CLUSTER_SIZE, SEEK_SET);
+        if (fread(ptr, 1, len, f) != len)
+            goto fail;
+    }
+    ret = 0;
+ fail:
+    free(bitmap);
+    fclose(f);
+    return ret;
+}
+
+/* write the modified clusters with 'write_func' */
+int block_cow_commit(BlockCOW *s, BlockCOWWriteFunc *write_func, void *opaque)
+{
+    int64_t cluster;
+    uint8_t *ptr;
+
+    for(cluster = 0; cluster < s->nb_clusters; cluster++) {
+        ptr = get_cluster(s, cluster);
+        if (!ptr)
+            continue;
+        if (write_func(opaque, cluster * CLUSTER_SECTORS, ptr,
+                       get_cluster_sectors(s, cluster)) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+int block_cow_save(BlockCOW *s, const char *filename)
+{
+    FILE *f;
+    uint8_t *bitmap, *ptr;
+    int bitmap_size, len;
+    int64_t cluster;
+    int ret;
+
+    f = fopen(filename, "wb");
+    if (!f)
+        return -1;
+    ret = -1;
+    bitmap_size = (s->nb_clusters + 7) / 8;
+    bitmap = mallocz(bitmap_size);
+    for(cluster = 0; cluster < s->nb_clusters; cluster++) {
+        ptr = get_cluster(s, cluster);
+        if (!ptr)
+            continue;
+        bitmap[cluster >> 3] |= 1 << (cluster & 7);
+        /* the unwritten clusters are left as holes */
+        len = get_cluster_sectors(s, cluster) * SECTOR_SIZE;
+        fseeko(f, cluster * CLUSTER_SIZE, SEEK_SET);
+        if (fwrite(ptr, 1, len, f) != len)
+            goto fail;
+    }
+    fseeko(f, s->nb_sectors * SECTOR_SIZE, SEEK_SET);
+    if (fwrite(bitmap, 1, bitmap_size, f) != bitmap_size)
+        goto fail;
+    ret = 0;
+ fail:
+    free(bitmap);
+    if (fclose(f) != 0)
+        ret = -1;
+    return ret;
+}
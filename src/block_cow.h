@@ -0,0 +1,62 @@
+/*
+ * Copy on write disk overlay
+ * 
+ * Copyright (c) 2026 The TinyEMU contributors
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef BLOCK_COW_H
+#define BLOCK_COW_H
+
+/* The written data is kept by clusters of BLOCK_COW_CLUSTER_SIZE bytes
+   indexed by a two level table. A saved overlay is a sparse file with
+   the same layout as the disk image (only the written clusters are
+   allocated) followed by a bitmap of the written clusters. It is
+   committed to the image with block_cow_commit() (temu -commit) or
+   discarded by deleting it. */
+
+#define BLOCK_COW_SECTOR_SIZE 512
+#define BLOCK_COW_CLUSTER_BITS 16
+#define BLOCK_COW_CLUSTER_SIZE (1 << BLOCK_COW_CLUSTER_BITS)
+
+typedef struct BlockCOW BlockCOW;
+
+/* read 'n' sectors from the underlying disk image. Return < 0 if
+   error. */
+typedef int BlockCOWReadFunc(void *opaque, uint64_t sector_num,
+                             uint8_t *buf, int n);
+/* write 'n' sectors to the underlying disk image. Return < 0 if
+   error. */
+typedef int BlockCOWWriteFunc(void *opaque, uint64_t sector_num,
+                              const uint8_t *buf, int n);
+
+BlockCOW *block_cow_new(int64_t nb_sectors,
+                        BlockCOWReadFunc *read_func, void *opaque);
+void block_cow_free(BlockCOW *s);
+int block_cow_read(BlockCOW *s, uint64_t sector_num, uint8_t *buf, int n);
+int block_cow_write(BlockCOW *s, uint64_t sector_num, const uint8_t *buf,
+                    int n);
+BOOL block_cow_is_modified(BlockCOW *s, uint64_t sector_num, int n);
+int block_cow_commit(BlockCOW *s, BlockCOWWriteFunc *write_func,
+                     void *opaque);
+int block_cow_load(BlockCOW *s, const char *filename);
+int block_cow_save(BlockCOW *s, const char *filename);
+
+#endif /* BLOCK_COW_H */
@@ -0,0 +1,241 @@
+/*
+ * Compressed disk image
+ * 
+ * Copyright (c) 2026 The TinyEMU contributors
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "cutils.h"
+#include "list.h"
+#include "virtio.h"
+#include "block_cow.h"
+#include "lz.h"
+#include "block_lz.h"
+
+#define SECTOR_SIZE 512
+
+typedef struct {
+    struct list_head link;
+    int64_t chunk_idx; /* -1 if not used */
+    uint8_t *buf;
+} LZCacheEntry;
+
+typedef struct {
+    FILE *f;
+    int chunk_size;
+    int64_t nb_chunks;
+    int64_t nb_sectors;
+    uint64_t *chunk_offset; /* nb_chunks + 1 entries */
+    LZCacheEntry **chunk_cache; /* NULL if the chunk is not in the cache */
+    struct list_head lru_list; /* most recently used entry first */
+    LZCacheEntry *cache_tab;
+    int cache_size;
+    uint8_t *cbuf; /* compressed chunk */
+    /* the image is read-only: the writes are kept in memory */
+    BlockCOW *cow;
+} BlockDeviceLZ;
+
+BOOL block_lz_probe(FILE *f)
+{
+    uint8_t buf[8];
+    BOOL ret;
+
+    fseeko(f, 0, SEEK_SET);
+    ret = (fread(buf, 1, 8, f) == 8 && !memcmp(buf, BLOCK_LZ_MAGIC, 8));
+    fseeko(f, 0, SEEK_SET);
+    return ret;
+}
+
+static int lz_load_chunk(BlockDeviceLZ *s, int64_t chunk_idx, uint8_t *buf)
+{
+    uint64_t pos, len;
+
+    pos = s->chunk_offset[chunk_idx];
+    len = s->chunk_offset[chunk_idx + 1] - pos;
+    if (len == 0) {
+        memset(buf, 0, s->chunk_size);
+    } else if (len == s->chunk_size) {
+        fseeko(s->f, pos, SEEK_SET);
+        if (fread(buf, 1, len, s->f) != len)
+            return -1;
+    } else {
+        if (len > s->chunk_size)
+            return -1;
+        fseeko(s->f, pos, SEEK_SET);
+        if (fread(s->cbuf, 1, len, s->f) != len)
+            return -1;
+        if (lz_decompress(buf, s->chunk_size, s->cbuf, len) !=
+            s->chunk_size)
+            return -1;
+    }
+    return 0;
+}
+
+/* return the decompressed chunk or NULL if error */
+static uint8_t *lz_get_chunk(BlockDeviceLZ *s, int64_t chunk_idx)
+{
+    LZCacheEntry *ce;
+
+    ce = s->chunk_cache[chunk_idx];
+    if (!ce) {
+        /* reuse the least recently used entry */
+        ce = list_entry(s->lru_list.prev, LZCacheEntry, link);
+        if (ce->chunk_idx >= 0)
+            s->chunk_cache[ce->chunk_idx] = NULL;
+        ce->chunk_idx = -1;
+        if (lz_load_chunk(s, chunk_idx, ce->buf) < 0) {
+            fprintf(stderr, "block_lz: could not read chunk %" PRId64 "\n",
+                    chunk_idx);
+            return NULL;
+        }
+        ce->chunk_idx = chunk_idx;
+        s->chunk_cache[chunk_idx] = ce;
+    }
+    list_del(&ce->link);
+    list_add(&ce->link, &s->lru_list);
+    return ce->buf;
+}
+
+static int lz_read_image(void *opaque, uint64_t sector_num,
+                         uint8_t *buf, int n)
+{
+    BlockDeviceLZ *s = opaque;
+    uint64_t pos;
+    int64_t chunk_idx;
+    int offset, l, len;
+    uint8_t *ptr;
+
+    pos = sector_num * SECTOR_SIZE;
+    len = n * SECTOR_SIZE;
+    while (len > 0) {
+        chunk_idx = pos / s->chunk_size;
+        offset = pos % s->chunk_size;
+        l = min_int(len, s->chunk_size - offset);
+        ptr = lz_get_chunk(s, chunk_idx);
+        if (!ptr)
+            return -1;
+        memcpy(buf, ptr + offset, l);
+        pos += l;
+        buf += l;
+        len -= l;
+    }
+    return 0;
+}
+
+static int64_t lz_get_sector_count(BlockDevice *bs)
+{
+    BlockDeviceLZ *s = bs->opaque;
+    return s->nb_sectors;
+}
+
+static int lz_read_async(BlockDevice *bs,
+                         uint64_t sector_num, uint8_t *buf, int n,
+                         BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    BlockDeviceLZ *s = bs->opaque;
+    /* synchronous read */
+    return block_cow_read(s->cow, sector_num, buf, n);
+}
+
+static int lz_write_async(BlockDevice *bs,
+                          uint64_t sector_num, const uint8_t *buf, int n,
+                          BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    BlockDeviceLZ *s = bs->opaque;
+    return block_cow_write(s->cow, sector_num, buf, n);
+}
+
+/* return NULL if error. 'cache_size' is the number of decompressed
+   chunks kept in memory. */
+BlockDevice *block_lz_init(FILE *f, int cache_size)
+{
+    BlockDevice *bs;
+    BlockDeviceLZ *s;
+    uint8_t header[BLOCK_LZ_HEADER_SIZE], *index;
+    uint64_t image_size, file_size;
+    int64_t i;
+    uint32_t chunk_size, nb_chunks;
+    int index_size;
+
+    fseeko(f, 0, SEEK_END);
+    file_size = ftello(f);
+    fseeko(f, 0, SEEK_SET);
+    if (fread(header, 1, sizeof(header), f) != sizeof(header) ||
+        memcmp(header, BLOCK_LZ_MAGIC, 8) != 0)
+        return NULL;
+    chunk_size = get_le32(header + 8);
+    nb_chunks = get_le32(header + 12);
+    image_size = get_le64(header + 16);
+    if (chunk_size < SECTOR_SIZE || (chunk_size % SECTOR_SIZE) != 0 ||
+        chunk_size > (1 << 24) ||
+        image_size > (uint64_t)nb_chunks * chunk_size ||
+        (nb_chunks + 1) > (INT32_MAX / 8))
+        return NULL;
+    index_size = (nb_chunks + 1) * 8;
+    index = malloc(index_size);
+    if (fread(index, 1, index_size, f) != index_size) {
+        free(index);
+        return NULL;
+    }
+
+    s = mallocz(sizeof(*s));
+    s->f = f;
+    s->chunk_size = chunk_size;
+    s->nb_chunks = nb_chunks;
+    s->nb_sectors = image_size / SECTOR_SIZE;
+    s->chunk_offset = malloc(sizeof(s->chunk_offset[0]) * (nb_chunks + 1));
+    for(i = 0; i <= nb_chunks; i++) {
+        s->chunk_offset[i] = get_le64(index + i * 8);
+        if (s->chunk_offset[i] > file_size ||
+            (i > 0 && s->chunk_offset[i] < s->chunk_offset[i - 1])) {
+            free(index);
+            free(s->chunk_offset);
+            free(s);
+            return NULL;
+        }
+    }
+    free(index);
+
+    s->chunk_cache = mallocz(sizeof(s->chunk_cache[0]) *
+                             max_int(nb_chunks, 1));
+    s->cache_size = max_int(cache_size, 1);
+    s->cache_tab = mallocz(sizeof(s->cache_tab[0]) * s->cache_size);
+    init_list_head(&s->lru_list);
+    for(i = 0; i < s->cache_size; i++) {
+        LZCacheEntry *ce = &s->cache_tab[i];
+        ce->chunk_idx = -1;
+        ce->buf = malloc(chunk_size);
+        list_add_tail(&ce->link, &s->lru_list);
+    }
+    s->cbuf = malloc(chunk_size);
+    s->cow = block_cow_new(s->nb_sectors, lz_read_image, s);
+
+    bs = mallocz(sizeof(*bs));
+    bs->opaque = s;
+    bs->get_sector_count = lz_get_sector_count;
+    bs->read_async = lz_read_async;
+    bs->write_async = lz_write_async;
+    return bs;
+}
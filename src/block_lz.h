@@ -0,0 +1,45 @@
+/*
+ * Compressed disk image
+ * 
+ * Copyright (c) 2026 The TinyEMU contributors
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef BLOCK_LZ_H
+#define BLOCK_LZ_H
+
+/* The image is split in chunks of chunk_size bytes which are compressed
+   independently with lz_compress(). File layout (little endian):
+
+   header: magic (8 bytes), chunk_size (u32), chunk count (u32),
+           image size in bytes (u64)
+   index:  chunk count + 1 file offsets (u64): chunk i is stored between
+           offsets i and i + 1. An empty chunk contains only zeros and a
+           chunk of chunk_size bytes is not compressed.
+   chunk data */
+
+#define BLOCK_LZ_MAGIC "TEMULZI1"
+#define BLOCK_LZ_HEADER_SIZE 24
+#define BLOCK_LZ_DEFAULT_CHUNK_SIZE (64 * 1024)
+
+BOOL block_lz_probe(FILE *f);
+BlockDevice *block_lz_init(FILE *f, int cache_size);
+
+#endif /* BLOCK_LZ_H */
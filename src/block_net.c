@@ -38,17 +38,29 @@
 #include "list.h"
 #include "fbuf.h"
 #include "machine.h"
+#include "fs_utils.h"
+#include "lz.h"
 
 typedef enum {
     CBLOCK_LOADING,
     CBLOCK_LOADED,
+    CBLOCK_GHOST, /* evicted: only the block number is remembered */
 } CachedBlockStateEnum;
 
+/* The cache uses the 2Q replacement policy: a loaded block first goes
+   to the 'a1in' FIFO. When it leaves it, its number is remembered in
+   the 'a1out' ghost FIFO. A block which is loaded again while it is in
+   'a1out' goes to the 'am' LRU list. Hence the blocks read only once
+   (e.g. by a scan of the whole filesystem) do not evict the frequently
+   used ones. */
 typedef struct CachedBlock {
-    struct list_head link;
+    struct list_head link; /* in a1in_list, am_list or a1out_list */
+    struct list_head hash_link;
     struct BlockDeviceHTTP *bf;
     unsigned int block_num;
     CachedBlockStateEnum state;
+    BOOL in_am;
+    struct FetchRequest *fetch; /* request loading the block */
     FileBuffer fbuf;
 } CachedBlock;
 
@@ -56,12 +68,19 @@ typedef struct CachedBlock {
 #define GROUP_FMT "%sgrp%09u.bin"
 #define PREFETCH_GROUP_LEN_MAX 32
 
-typedef struct {
+/* default maximum number of simultaneous HTTP requests */
+#define MAX_FETCH_COUNT 4
+
+/* HTTP request loading a block or a prefetch group */
+typedef struct FetchRequest {
+    struct list_head link; /* in fetch_queue until it is started */
     struct BlockDeviceHTTP *bf;
-    int group_num;
+    int group_num; /* -1 if a single block is loaded */
+    BOOL started;
     int n_block_num;
+    /* NULL for the blocks of the group which are already loaded */
     CachedBlock *tab_block[PREFETCH_GROUP_LEN_MAX];
-} PrefetchGroupRequest;
+} FetchRequest;
 
 /* modified data is stored per cluster (smaller than cached blocks to
    avoid losing space) */
@@ -80,9 +99,21 @@ typedef struct BlockDeviceHTTP {
     int64_t nb_sectors;
     int block_size; /* in sectors, power of two */
     int nb_blocks;
-    struct list_head cached_blocks; /* list of CachedBlock */
-    int n_cached_blocks;
+    struct list_head a1in_list; /* most recently loaded first */
+    struct list_head am_list; /* most recently used first */
+    struct list_head a1out_list; /* most recently evicted first */
+    int n_a1in_blocks;
+    int n_a1in_blocks_max;
+    int n_a1out_blocks;
+    int n_a1out_blocks_max;
+    int n_cached_blocks; /* number of loaded or loading blocks */
     int n_cached_blocks_max;
+    struct list_head *hash_table; /* list of CachedBlock.hash_link */
+    int hash_size; /* power of two */
+
+    /* SHA256 of each block (see splitimg) or NULL. A zero hash means
+       that the block only contains zeros and is not stored. */
+    uint8_t (*block_hash)[SHA256_DIGEST_LENGTH];
 
     /* write support */
     int sectors_per_cluster; /* power of two */
@@ -94,6 +125,16 @@ typedef struct BlockDeviceHTTP {
     int64_t n_read_sectors;
     int64_t n_read_blocks;
     int64_t n_write_sectors;
+    int64_t n_cache_hits;
+    int64_t n_cache_misses;
+    int64_t n_ghost_hits; /* blocks loaded again after their eviction */
+    int64_t n_evicted_blocks;
+
+    /* the requests beyond 'max_fetch_count' wait in 'fetch_queue' so
+       that the guest requests can be moved before the prefetches */
+    int max_fetch_count;
+    int n_fetches; /* number of started requests */
+    struct list_head fetch_queue; /* list of FetchRequest */
 
     /* current read request */
     BOOL is_write;
@@ -109,60 +150,151 @@ typedef struct BlockDeviceHTTP {
 } BlockDeviceHTTP;
 
 static void bf_update_block(CachedBlock *b, const uint8_t *data);
-static void bf_read_onload(void *opaque, int err, void *data, size_t size);
 static void bf_init_onload(void *opaque, int err, void *data, size_t size);
-static void bf_prefetch_group_onload(void *opaque, int err, void *data,
-                                     size_t size);
+static void bf_fetch_onload(void *opaque, int err, void *data, size_t size);
 
-static CachedBlock *bf_find_block(BlockDeviceHTTP *bf, unsigned int block_num)
+static BOOL bf_is_zero_block(BlockDeviceHTTP *bf, unsigned int block_num)
+{
+    static const uint8_t zero_hash[SHA256_DIGEST_LENGTH];
+    return bf->block_hash &&
+        !memcmp(bf->block_hash[block_num], zero_hash, SHA256_DIGEST_LENGTH);
+}
+
+static struct list_head *bf_get_hash_head(BlockDeviceHTTP *bf,
+                                          unsigned int block_num)
+{
+    return &bf->hash_table[block_num & (bf->hash_size - 1)];
+}
+
+/* return the block, including the ghost blocks */
+static CachedBlock *bf_find_entry(BlockDeviceHTTP *bf, unsigned int block_num)
 {
     CachedBlock *b;
-    struct list_head *el;
+    struct list_head *el, *head;
 
-    list_for_each(el, &bf->cached_blocks) {
-        b = list_entry(el, CachedBlock, link);
-        if (b->block_num == block_num) {
-            /* move to front */
-            if (bf->cached_blocks.next != el) {
-                list_del(&b->link);
-                list_add(&b->link, &bf->cached_blocks);
-            }
+    head = bf_get_hash_head(bf, block_num);
+    list_for_each(el, head) {
+        b = list_entry(el, CachedBlock, hash_link);
+        if (b->block_num == block_num)
             return b;
-        }
     }
     return NULL;
 }
 
+/* return the block if it is loaded or loading */
+static CachedBlock *bf_find_block(BlockDeviceHTTP *bf, unsigned int block_num)
+{
+    CachedBlock *b;
+    b = bf_find_entry(bf, block_num);
+    if (b && b->state == CBLOCK_GHOST)
+        return NULL;
+    return b;
+}
+
+/* called when the guest accesses the block */
+static void bf_touch_block(BlockDeviceHTTP *bf, CachedBlock *b)
+{
+    if (b->in_am && bf->am_list.next != &b->link) {
+        list_del(&b->link);
+        list_add(&b->link, &bf->am_list);
+    }
+}
+
 static void bf_free_block(BlockDeviceHTTP *bf, CachedBlock *b)
 {
-    bf->n_cached_blocks--;
+    if (b->state == CBLOCK_GHOST) {
+        bf->n_a1out_blocks--;
+    } else {
+        if (!b->in_am)
+            bf->n_a1in_blocks--;
+        bf->n_cached_blocks--;
+    }
     file_buffer_reset(&b->fbuf);
     list_del(&b->link);
+    list_del(&b->hash_link);
     free(b);
 }
 
-static CachedBlock *bf_add_block(BlockDeviceHTTP *bf, unsigned int block_num)
+static void bf_evict_block(BlockDeviceHTTP *bf, CachedBlock *b)
 {
+    CachedBlock *b1;
+
+    bf->n_evicted_blocks++;
+    if (b->in_am) {
+        bf_free_block(bf, b);
+        return;
+    }
+    /* keep the block number in the ghost list */
+    bf->n_a1in_blocks--;
+    bf->n_cached_blocks--;
+    file_buffer_reset(&b->fbuf);
+    b->state = CBLOCK_GHOST;
+    list_del(&b->link);
+    list_add(&b->link, &bf->a1out_list);
+    bf->n_a1out_blocks++;
+    while (bf->n_a1out_blocks > bf->n_a1out_blocks_max) {
+        b1 = list_entry(bf->a1out_list.prev, CachedBlock, link);
+        bf_free_block(bf, b1);
+    }
+}
+
+/* evict the least recently used loaded block of the list. Return FALSE
+   if none. */
+static BOOL bf_evict_from_list(BlockDeviceHTTP *bf, struct list_head *head)
+{
+    struct list_head *el;
     CachedBlock *b;
-    if (bf->n_cached_blocks >= bf->n_cached_blocks_max) {
-        struct list_head *el, *el1;
-        /* start by looking at the least unused blocks */
-        list_for_each_prev_safe(el, el1, &bf->cached_blocks) {
-            b = list_entry(el, CachedBlock, link);
-            if (b->state == CBLOCK_LOADED) {
-                bf_free_block(bf, b);
-                if (bf->n_cached_blocks < bf->n_cached_blocks_max)
-                    break;
-            }
+
+    list_for_each_prev(el, head) {
+        b = list_entry(el, CachedBlock, link);
+        if (b->state == CBLOCK_LOADED) {
+            bf_evict_block(bf, b);
+            return TRUE;
         }
     }
+    return FALSE;
+}
+
+static CachedBlock *bf_add_block(BlockDeviceHTTP *bf, unsigned int block_num)
+{
+    CachedBlock *b;
+    BOOL in_am;
+
+    in_am = FALSE;
+    b = bf_find_entry(bf, block_num);
+    if (b) {
+        /* the block was recently evicted from a1in */
+        assert(b->state == CBLOCK_GHOST);
+        bf_free_block(bf, b);
+        bf->n_ghost_hits++;
+        in_am = TRUE;
+    }
+
+    while (bf->n_cached_blocks >= bf->n_cached_blocks_max) {
+        /* the loading blocks cannot be evicted, so the cache may
+           temporarily be larger than its maximum size */
+        if (bf->n_a1in_blocks > bf->n_a1in_blocks_max &&
+            bf_evict_from_list(bf, &bf->a1in_list))
+            continue;
+        if (!bf_evict_from_list(bf, &bf->am_list) &&
+            !bf_evict_from_list(bf, &bf->a1in_list))
+            break;
+    }
+
     b = mallocz(sizeof(CachedBlock));
     b->bf = bf;
     b->block_num = block_num;
     b->state = CBLOCK_LOADING;
+    b->in_am = in_am;
     file_buffer_init(&b->fbuf);
     file_buffer_resize(&b->fbuf, bf->block_size * 512);
-    list_add(&b->link, &bf->cached_blocks);
+    if (in_am) {
+        list_add(&b->link, &bf->am_list);
+    } else {
+        list_add(&b->link, &bf->a1in_list);
+        bf->n_a1in_blocks++;
+    }
+    list_add(&b->hash_link, bf_get_hash_head(bf, block_num));
     bf->n_cached_blocks++;
     return b;
 }
@@ -173,10 +305,56 @@ static int64_t bf_get_sector_count(BlockDevice *bs)
     return bf->nb_sectors;
 }
 
-static void bf_start_load_block(BlockDevice *bs, int block_num)
+static void bf_start_fetches(BlockDeviceHTTP *bf)
 {
-    BlockDeviceHTTP *bf = bs->opaque;
+    FetchRequest *req;
     char filename[1024];
+
+    while (bf->n_fetches < bf->max_fetch_count &&
+           !list_empty(&bf->fetch_queue)) {
+        req = list_entry(bf->fetch_queue.next, FetchRequest, link);
+        list_del(&req->link);
+        req->started = TRUE;
+        bf->n_fetches++;
+        if (req->group_num < 0) {
+            snprintf(filename, sizeof(filename), BLK_FMT, bf->url,
+                     req->tab_block[0]->block_num);
+        } else {
+            snprintf(filename, sizeof(filename), GROUP_FMT, bf->url,
+                     req->group_num);
+        }
+        printf("wget %s\n", filename);
+        fs_wget(filename, NULL, NULL, req, bf_fetch_onload, TRUE);
+    }
+}
+
+/* if 'is_urgent' is TRUE, the request is started before the queued
+   ones */
+static void bf_queue_fetch(BlockDeviceHTTP *bf, FetchRequest *req,
+                           BOOL is_urgent)
+{
+    if (is_urgent)
+        list_add(&req->link, &bf->fetch_queue);
+    else
+        list_add_tail(&req->link, &bf->fetch_queue);
+    bf_start_fetches(bf);
+}
+
+/* a guest request waits for the block: start it as soon as possible */
+static void bf_hurry_block(BlockDeviceHTTP *bf, CachedBlock *b)
+{
+    FetchRequest *req = b->fetch;
+    if (req && !req->started) {
+        list_del(&req->link);
+        bf_queue_fetch(bf, req, TRUE);
+    }
+}
+
+static void bf_start_load_block(BlockDevice *bs, int block_num,
+                                BOOL is_urgent)
+{
+    BlockDeviceHTTP *bf = bs->opaque;
+    FetchRequest *req;
     CachedBlock *b;
     b = bf_add_block(bf, block_num);
     bf->n_read_blocks++;
@@ -191,10 +369,19 @@ static void bf_start_load_block(BlockDevice *bs, int block_num)
            (int)(bf->n_read_blocks * bf->block_size / 2),
            (int)(bf->n_write_sectors / 2),
            (int)(bf->n_allocated_clusters * bf->sectors_per_cluster / 2));
+    printf("cache: hits=%" PRId64 " misses=%" PRId64 " ghost_hits=%" PRId64
+           " evicted=%" PRId64 " a1in=%d am=%d a1out=%d\n",
+           bf->n_cache_hits, bf->n_cache_misses, bf->n_ghost_hits,
+           bf->n_evicted_blocks, bf->n_a1in_blocks,
+           bf->n_cached_blocks - bf->n_a1in_blocks, bf->n_a1out_blocks);
 #endif
-    snprintf(filename, sizeof(filename), BLK_FMT, bf->url, block_num);
-    printf("wget %s\n", filename);
-    fs_wget(filename, NULL, NULL, b, bf_read_onload, TRUE);
+    req = mallocz(sizeof(*req));
+    req->bf = bf;
+    req->group_num = -1;
+    req->n_block_num = 1;
+    req->tab_block[0] = b;
+    b->fetch = req;
+    bf_queue_fetch(bf, req, is_urgent);
 }
 
 static void bf_start_load_prefetch_group(BlockDevice *bs, int group_num,
@@ -203,13 +390,12 @@ static void bf_start_load_prefetch_group(BlockDevice *bs, int group_num,
 {
     BlockDeviceHTTP *bf = bs->opaque;
     CachedBlock *b;
-    PrefetchGroupRequest *req;
-    char filename[1024];
+    FetchRequest *req;
     BOOL req_flag;
     int i;
 
     req_flag = FALSE;
-    req = malloc(sizeof(*req));
+    req = mallocz(sizeof(*req));
     req->bf = bf;
     req->group_num = group_num;
     req->n_block_num = n_block_num;
@@ -217,6 +403,7 @@ static void bf_start_load_prefetch_group(BlockDevice *bs, int group_num,
         b = bf_find_block(bf, tab_block_num[i]);
         if (!b) {
             b = bf_add_block(bf, tab_block_num[i]);
+            b->fetch = req;
             req_flag = TRUE;
         } else {
             /* no need to read the block if it is already loading or
@@ -227,36 +414,84 @@ static void bf_start_load_prefetch_group(BlockDevice *bs, int group_num,
     }
 
     if (req_flag) {
-        snprintf(filename, sizeof(filename), GROUP_FMT, bf->url, group_num);
-        printf("wget2 %s\n", filename);
-        fs_wget(filename, NULL, NULL, req, bf_prefetch_group_onload, TRUE);
         /* XXX: should add request in a list to free it for clean exit */
+        bf_queue_fetch(bf, req, FALSE);
     } else {
         free(req);
     }
 }
 
-static void bf_prefetch_group_onload(void *opaque, int err, void *data,
-                                     size_t size)
+static void bf_fetch_onload(void *opaque, int err, void *data, size_t size)
 {
-    PrefetchGroupRequest *req = opaque;
+    FetchRequest *req = opaque;
     BlockDeviceHTTP *bf = req->bf;
     CachedBlock *b;
+    uint8_t *buf;
     int block_bytes, i;
 
     if (err < 0) {
-        fprintf(stderr, "Could not load group %u\n", req->group_num);
+        if (req->group_num < 0) {
+            fprintf(stderr, "Could not load block %u\n",
+                    req->tab_block[0]->block_num);
+        } else {
+            fprintf(stderr, "Could not load group %u\n", req->group_num);
+        }
         exit(1);
     }
+    bf->n_fetches--;
     block_bytes = bf->block_size * 512;
+    buf = NULL;
+    if (req->group_num < 0 && size < block_bytes) {
+        /* compressed block */
+        buf = malloc(block_bytes);
+        if (lz_decompress(buf, block_bytes, data, size) != block_bytes) {
+            fprintf(stderr, "Could not decompress block %u\n",
+                    req->tab_block[0]->block_num);
+            exit(1);
+        }
+        data = buf;
+        size = block_bytes;
+    }
     assert(size == block_bytes * req->n_block_num);
     for(i = 0; i < req->n_block_num; i++) {
         b = req->tab_block[i];
         if (b) {
-            bf_update_block(b, (const uint8_t *)data + block_bytes * i);
+            const uint8_t *ptr = (const uint8_t *)data + block_bytes * i;
+            if (bf->block_hash && !bf_is_zero_block(bf, b->block_num)) {
+                uint8_t hash[SHA256_DIGEST_LENGTH];
+                SHA256(ptr, block_bytes, hash);
+                if (memcmp(hash, bf->block_hash[b->block_num],
+                           SHA256_DIGEST_LENGTH) != 0) {
+                    fprintf(stderr, "Invalid checksum for block %u\n",
+                            b->block_num);
+                    exit(1);
+                }
+            }
+            b->fetch = NULL;
+            bf_update_block(b, ptr);
         }
     }
+    free(buf);
     free(req);
+    bf_start_fetches(bf);
+}
+
+/* load 'block_num' and the other missing blocks of the current request
+   in parallel */
+static void bf_start_load_missing_blocks(BlockDevice *bs, int block_num)
+{
+    BlockDeviceHTTP *bf = bs->opaque;
+    int last_block_num, i;
+
+    last_block_num = (bf->sector_num + bf->sector_count -
+                      bf->sector_index - 1) / bf->block_size;
+    /* the urgent requests are queued first in reverse order so that
+       they are started in the block order */
+    for(i = last_block_num; i > block_num; i--) {
+        if (!bf_find_block(bf, i) && !bf_is_zero_block(bf, i))
+            bf_start_load_block(bs, i, TRUE);
+    }
+    bf_start_load_block(bs, block_num, TRUE);
 }
 
 static int bf_rw_async1(BlockDevice *bs, BOOL is_sync)
@@ -276,8 +511,10 @@ static int bf_rw_async1(BlockDevice *bs, BOOL is_sync)
             offset = bf->sector_num % bf->sectors_per_cluster;
             n = min_int(n, bf->sectors_per_cluster - offset);
             if (bf->is_write) {
-                file_buffer_write(&c->fbuf, offset * 512,
-                                  bf->io_buf + bf->sector_index * 512, n * 512);
+                if (file_buffer_write(&c->fbuf, offset * 512,
+                                      bf->io_buf + bf->sector_index * 512,
+                                      n * 512) < 0)
+                    goto fail;
             } else {
                 file_buffer_read(&c->fbuf, offset * 512,
                                  bf->io_buf + bf->sector_index * 512, n * 512);
@@ -288,31 +525,56 @@ static int bf_rw_async1(BlockDevice *bs, BOOL is_sync)
             block_num = bf->sector_num / bf->block_size;
             offset = bf->sector_num % bf->block_size;
             n = min_int(n, bf->block_size - offset);
-            bf->cur_block_num = block_num;
+            /* stop at the next modified cluster */
+            {
+                int l, cluster_num1;
+                l = bf->sectors_per_cluster -
+                    bf->sector_num % bf->sectors_per_cluster;
+                cluster_num1 = cluster_num + 1;
+                while (l < n && !bf->clusters[cluster_num1]) {
+                    l += bf->sectors_per_cluster;
+                    cluster_num1++;
+                }
+                n = min_int(n, l);
+            }
 
             b = bf_find_block(bf, block_num);
             if (b) {
+                /* a request waiting for the block is not counted again */
+                if (b->state == CBLOCK_LOADED &&
+                    bf->cur_block_num != block_num)
+                    bf->n_cache_hits++;
+                bf->cur_block_num = block_num;
+                bf_touch_block(bf, b);
                 if (b->state == CBLOCK_LOADING) {
                     /* wait until the block is loaded */
+                    bf_hurry_block(bf, b);
                     return 1;
                 } else {
                     if (bf->is_write) {
-                        int cluster_size, cluster_offset;
+                        int cluster_size, cluster_offset, ret;
                         uint8_t *buf;
                         /* allocate a new cluster */
                         c = mallocz(sizeof(Cluster));
                         cluster_size = bf->sectors_per_cluster * 512;
                         buf = malloc(cluster_size);
                         file_buffer_init(&c->fbuf);
-                        file_buffer_resize(&c->fbuf, cluster_size);
-                        bf->clusters[cluster_num] = c;
                         /* copy the cached block data to the cluster */
                         cluster_offset = (cluster_num * bf->sectors_per_cluster) &
                             (bf->block_size - 1);
                         file_buffer_read(&b->fbuf, cluster_offset * 512,
                                          buf, cluster_size);
-                        file_buffer_write(&c->fbuf, 0, buf, cluster_size);
+                        ret = file_buffer_resize(&c->fbuf, cluster_size);
+                        if (ret == 0)
+                            ret = file_buffer_write(&c->fbuf, 0, buf,
+                                                    cluster_size);
                         free(buf);
+                        if (ret < 0) {
+                            file_buffer_reset(&c->fbuf);
+                            free(c);
+                            goto fail;
+                        }
+                        bf->clusters[cluster_num] = c;
                         bf->n_allocated_clusters++;
                         continue; /* write to the allocated cluster */
                     } else {
@@ -322,8 +584,20 @@ static int bf_rw_async1(BlockDevice *bs, BOOL is_sync)
                     bf->sector_index += n;
                     bf->sector_num += n;
                 }
+            } else if (bf_is_zero_block(bf, block_num)) {
+                /* no need to load it */
+                b = bf_add_block(bf, block_num);
+                if (file_buffer_set(&b->fbuf, 0, 0,
+                                    bf->block_size * 512) < 0) {
+                    bf_free_block(bf, b);
+                    goto fail;
+                }
+                b->state = CBLOCK_LOADED;
+                continue;
             } else {
-                bf_start_load_block(bs, block_num);
+                bf->cur_block_num = block_num;
+                bf->n_cache_misses++;
+                bf_start_load_missing_blocks(bs, block_num);
                 return 1;
             }
             bf->cur_block_num = -1;
@@ -336,6 +610,12 @@ static int bf_rw_async1(BlockDevice *bs, BOOL is_sync)
         bf->cb(bf->opaque, 0);
     }
     return 0;
+ fail:
+    /* not enough memory */
+    bf->cur_block_num = -1;
+    if (!is_sync)
+        bf->cb(bf->opaque, -1);
+    return -1;
 }
 
 static void bf_update_block(CachedBlock *b, const uint8_t *data)
@@ -344,7 +624,10 @@ static void bf_update_block(CachedBlock *b, const uint8_t *data)
     BlockDevice *bs = bf->bs;
 
     assert(b->state == CBLOCK_LOADING);
-    file_buffer_write(&b->fbuf, 0, data, bf->block_size * 512);
+    if (file_buffer_write(&b->fbuf, 0, data, bf->block_size * 512) < 0) {
+        fprintf(stderr, "Could not store block %u\n", b->block_num);
+        exit(1);
+    }
     b->state = CBLOCK_LOADED;
 
     /* continue I/O read/write if necessary */
@@ -353,20 +636,6 @@ static void bf_update_block(CachedBlock *b, const uint8_t *data)
     }
 }
 
-static void bf_read_onload(void *opaque, int err, void *data, size_t size)
-{
-    CachedBlock *b = opaque;
-    BlockDeviceHTTP *bf = b->bf;
-
-    if (err < 0) {
-        fprintf(stderr, "Could not load block %u\n", b->block_num);
-        exit(1);
-    }
-
-    assert(size == bf->block_size * 512);
-    bf_update_block(b, data);
-}
-
 static int bf_read_async(BlockDevice *bs,
                          uint64_t sector_num, uint8_t *buf, int n,
                          BlockDeviceCompletionFunc *cb, void *opaque)
@@ -441,7 +710,10 @@ BlockDevice *block_device_init_http(const char *url,
         p++;
     *p = '\0';
 
-    init_list_head(&bf->cached_blocks);
+    init_list_head(&bf->a1in_list);
+    init_list_head(&bf->am_list);
+    init_list_head(&bf->a1out_list);
+    init_list_head(&bf->fetch_queue);
     bf->max_cache_size_kb = max_cache_size_kb;
     bf->start_cb = start_cb;
     bf->start_opaque = start_opaque;
@@ -498,6 +770,18 @@ static void bf_init_onload(void *opaque, int err, void *data, size_t size)
     printf("nb_sectors %" PRId64 "\n", bf->nb_sectors);
     bf->n_cached_blocks = 0;
     bf->n_cached_blocks_max = max_int(1, bf->max_cache_size_kb / block_size_kb);
+    bf->n_a1in_blocks_max = max_int(1, bf->n_cached_blocks_max / 4);
+    bf->n_a1out_blocks_max = max_int(1, bf->n_cached_blocks_max / 2);
+    {
+        int i;
+        bf->hash_size = 1;
+        while (bf->hash_size < bf->n_cached_blocks_max +
+               bf->n_a1out_blocks_max)
+            bf->hash_size *= 2;
+        bf->hash_table = malloc(sizeof(bf->hash_table[0]) * bf->hash_size);
+        for(i = 0; i < bf->hash_size; i++)
+            init_list_head(&bf->hash_table[i]);
+    }
     bf->cur_block_num = -1; /* no request in progress */
 
     bf->sectors_per_cluster = 8; /* 4 KB */
@@ -511,6 +795,43 @@ static void bf_init_onload(void *opaque, int err, void *data, size_t size)
         vm_error("prefetch_group_len is too large");
         goto config_error;
     }
+    if (vm_get_int_opt(cfg, "max_fetch_count",
+                       &bf->max_fetch_count, MAX_FETCH_COUNT) < 0)
+        goto config_error;
+    if (bf->max_fetch_count <= 0) {
+        vm_error("invalid max_fetch_count\n");
+        goto config_error;
+    }
+
+    array = json_object_get(cfg, "sha256");
+    if (!json_is_undefined(array)) {
+        JSONValue el;
+        const char *str;
+        int i;
+
+        if (array.type != JSON_ARRAY ||
+            array.u.array->len != bf->nb_blocks) {
+            vm_error("sha256: expecting an array of n_block elements\n");
+            goto config_error;
+        }
+        bf->block_hash = mallocz(SHA256_DIGEST_LENGTH * bf->nb_blocks);
+        for(i = 0; i < bf->nb_blocks; i++) {
+            el = json_array_get(array, i);
+            str = json_get_str(el);
+            if (!str) {
+                vm_error("sha256: expecting a string\n");
+                goto config_error;
+            }
+            /* an empty string means a zero block */
+            if (str[0] != '\0' &&
+                (strlen(str) != SHA256_DIGEST_LENGTH * 2 ||
+                 decode_hex(bf->block_hash[i], str,
+                            SHA256_DIGEST_LENGTH) < 0)) {
+                vm_error("sha256: invalid hash\n");
+                goto config_error;
+            }
+        }
+    }
 
     array = json_object_get(cfg, "prefetch");
     if (!json_is_undefined(array)) {
@@ -537,8 +858,9 @@ static void bf_init_onload(void *opaque, int err, void *data, size_t size)
             if (l == 1) {
                 block_num = tab_block_num[0];
                 printf("block_num %d\n", block_num);
-                if (!bf_find_block(bf, block_num)) {
-                    bf_start_load_block(bs, block_num);
+                if (!bf_find_block(bf, block_num) &&
+                    !bf_is_zero_block(bf, block_num)) {
+                    bf_start_load_block(bs, block_num, FALSE);
                 }
             } else {
                 bf_start_load_prefetch_group(bs, idx / bf->prefetch_group_len,
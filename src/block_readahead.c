@@ -0,0 +1,311 @@
+/*
+ * Block device read-ahead
+ * 
+ * Copyright (c) 2026 The TinyEMU contributors
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "cutils.h"
+#include "list.h"
+#include "virtio.h"
+#include "block_readahead.h"
+
+#define SECTOR_SIZE 512
+
+/* number of consecutive sequential reads before reading ahead */
+#define SEQ_COUNT_MIN 2
+
+struct BlockDeviceRA;
+
+typedef struct {
+    struct list_head link; /* most recently used window first */
+    uint64_t sector_num;
+    int n; /* number of sectors, 0 if the window is not used */
+    BOOL pending; /* TRUE if the read is in progress */
+    uint8_t *buf;
+    struct BlockDeviceRA *ra;
+} RAWindow;
+
+typedef struct BlockDeviceRA {
+    BlockDevice *bs;
+    int64_t nb_sectors;
+    int window_size;
+    uint64_t next_sector; /* sector following the last read */
+    int seq_count; /* number of consecutive sequential reads */
+    struct list_head window_list;
+    RAWindow *window_tab;
+    int window_count;
+    /* only one request is sent to the underlying device at a time */
+    BOOL dev_busy;
+    BlockDeviceCompletionFunc *cb;
+    void *opaque;
+    /* request waiting for the end of the read-ahead */
+    BOOL req_pending;
+    BOOL req_is_write;
+    uint64_t req_sector_num;
+    uint8_t *req_buf;
+    int req_n;
+    BlockDeviceCompletionFunc *req_cb;
+    void *req_opaque;
+    BlockReadaheadStats stats;
+} BlockDeviceRA;
+
+static int ra_rw(BlockDeviceRA *s, BOOL is_write, uint64_t sector_num,
+                 uint8_t *buf, int n, BlockDeviceCompletionFunc *cb,
+                 void *opaque);
+
+static RAWindow *ra_find_window(BlockDeviceRA *s, uint64_t sector_num)
+{
+    RAWindow *w;
+    int i;
+
+    for(i = 0; i < s->window_count; i++) {
+        w = &s->window_tab[i];
+        if (w->n != 0 && sector_num >= w->sector_num &&
+            sector_num < w->sector_num + w->n)
+            return w;
+    }
+    return NULL;
+}
+
+/* return TRUE if all the sectors are in the windows */
+static BOOL ra_read_windows(BlockDeviceRA *s, uint64_t sector_num,
+                            uint8_t *buf, int n)
+{
+    RAWindow *w;
+    int l;
+
+    while (n > 0) {
+        w = ra_find_window(s, sector_num);
+        if (!w || w->pending)
+            return FALSE;
+        l = min_int(n, w->sector_num + w->n - sector_num);
+        memcpy(buf, w->buf + (sector_num - w->sector_num) * SECTOR_SIZE,
+               l * SECTOR_SIZE);
+        list_del(&w->link);
+        list_add(&w->link, &s->window_list);
+        sector_num += l;
+        buf += l * SECTOR_SIZE;
+        n -= l;
+    }
+    return TRUE;
+}
+
+/* keep the windows consistent with the written data */
+static void ra_write_windows(BlockDeviceRA *s, uint64_t sector_num,
+                             const uint8_t *buf, int n)
+{
+    RAWindow *w;
+    uint64_t start, end;
+    int i;
+
+    for(i = 0; i < s->window_count; i++) {
+        w = &s->window_tab[i];
+        if (w->n == 0)
+            continue;
+        start = sector_num > w->sector_num ? sector_num : w->sector_num;
+        end = sector_num + n < w->sector_num + w->n ?
+            sector_num + n : w->sector_num + w->n;
+        if (start >= end)
+            continue;
+        memcpy(w->buf + (start - w->sector_num) * SECTOR_SIZE,
+               buf + (start - sector_num) * SECTOR_SIZE,
+               (end - start) * SECTOR_SIZE);
+    }
+}
+
+static void ra_prefetch_cb(void *opaque, int ret)
+{
+    RAWindow *w = opaque;
+    BlockDeviceRA *s = w->ra;
+
+    w->pending = FALSE;
+    if (ret < 0)
+        w->n = 0;
+    s->dev_busy = FALSE;
+    if (s->req_pending) {
+        s->req_pending = FALSE;
+        ret = ra_rw(s, s->req_is_write, s->req_sector_num, s->req_buf,
+                    s->req_n, s->req_cb, s->req_opaque);
+        if (ret <= 0)
+            s->req_cb(s->req_opaque, ret);
+    }
+}
+
+/* keep one window ahead of the sector 'sector_num' */
+static void ra_prefetch(BlockDeviceRA *s, uint64_t sector_num)
+{
+    RAWindow *w;
+    struct list_head *el;
+    uint64_t pos;
+    int ret;
+
+    if (s->dev_busy)
+        return;
+    pos = sector_num;
+    while ((w = ra_find_window(s, pos)) != NULL) {
+        pos = w->sector_num + w->n;
+        if (pos >= sector_num + s->window_size)
+            return;
+    }
+    if (pos >= s->nb_sectors)
+        return;
+
+    /* reuse the least recently used window */
+    el = s->window_list.prev;
+    w = list_entry(el, RAWindow, link);
+    list_del(&w->link);
+    list_add(&w->link, &s->window_list);
+    w->sector_num = pos;
+    w->n = min_int(s->window_size, s->nb_sectors - pos);
+    w->pending = TRUE;
+    s->stats.prefetch_count++;
+    s->dev_busy = TRUE;
+    ret = s->bs->read_async(s->bs, w->sector_num, w->buf, w->n,
+                            ra_prefetch_cb, w);
+    if (ret <= 0)
+        ra_prefetch_cb(w, ret);
+}
+
+static void ra_req_cb(void *opaque, int ret)
+{
+    BlockDeviceRA *s = opaque;
+
+    s->dev_busy = FALSE;
+    if (ret >= 0 && s->seq_count >= SEQ_COUNT_MIN)
+        ra_prefetch(s, s->next_sector);
+    s->cb(s->opaque, ret);
+}
+
+/* return 0 if the request is done, > 0 if 'cb' is called later or < 0
+   if error */
+static int ra_rw(BlockDeviceRA *s, BOOL is_write, uint64_t sector_num,
+                 uint8_t *buf, int n, BlockDeviceCompletionFunc *cb,
+                 void *opaque)
+{
+    int ret;
+
+    if (s->dev_busy) {
+        /* wait for the end of the read-ahead */
+        s->req_pending = TRUE;
+        s->req_is_write = is_write;
+        s->req_sector_num = sector_num;
+        s->req_buf = buf;
+        s->req_n = n;
+        s->req_cb = cb;
+        s->req_opaque = opaque;
+        return 1;
+    }
+
+    if (is_write) {
+        ra_write_windows(s, sector_num, buf, n);
+    } else if (ra_read_windows(s, sector_num, buf, n)) {
+        s->stats.hit_count++;
+        if (s->seq_count >= SEQ_COUNT_MIN)
+            ra_prefetch(s, s->next_sector);
+        return 0;
+    } else {
+        s->stats.miss_count++;
+    }
+
+    s->cb = cb;
+    s->opaque = opaque;
+    s->dev_busy = TRUE;
+    if (is_write)
+        ret = s->bs->write_async(s->bs, sector_num, buf, n, ra_req_cb, s);
+    else
+        ret = s->bs->read_async(s->bs, sector_num, buf, n, ra_req_cb, s);
+    if (ret <= 0) {
+        s->dev_busy = FALSE;
+        if (ret == 0 && !is_write && s->seq_count >= SEQ_COUNT_MIN)
+            ra_prefetch(s, s->next_sector);
+    }
+    return ret;
+}
+
+static int64_t ra_get_sector_count(BlockDevice *bs)
+{
+    BlockDeviceRA *s = bs->opaque;
+    return s->nb_sectors;
+}
+
+static int ra_read_async(BlockDevice *bs,
+                         uint64_t sector_num, uint8_t *buf, int n,
+                         BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    BlockDeviceRA *s = bs->opaque;
+
+    if (sector_num == s->next_sector)
+        s->seq_count++;
+    else
+        s->seq_count = 0;
+    s->next_sector = sector_num + n;
+    return ra_rw(s, FALSE, sector_num, buf, n, cb, opaque);
+}
+
+static int ra_write_async(BlockDevice *bs,
+                          uint64_t sector_num, const uint8_t *buf, int n,
+                          BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    BlockDeviceRA *s = bs->opaque;
+    return ra_rw(s, TRUE, sector_num, (uint8_t *)buf, n, cb, opaque);
+}
+
+BlockDevice *block_readahead_init(BlockDevice *bs, int window_size,
+                                  int window_count)
+{
+    BlockDevice *bs1;
+    BlockDeviceRA *s;
+    RAWindow *w;
+    int i;
+
+    s = mallocz(sizeof(*s));
+    s->bs = bs;
+    s->nb_sectors = bs->get_sector_count(bs);
+    s->window_size = window_size;
+    s->next_sector = -1;
+    s->window_count = max_int(window_count, 2);
+    s->window_tab = mallocz(sizeof(s->window_tab[0]) * s->window_count);
+    init_list_head(&s->window_list);
+    for(i = 0; i < s->window_count; i++) {
+        w = &s->window_tab[i];
+        w->buf = malloc(window_size * SECTOR_SIZE);
+        w->ra = s;
+        list_add_tail(&w->link, &s->window_list);
+    }
+
+    bs1 = mallocz(sizeof(*bs1));
+    bs1->opaque = s;
+    bs1->get_sector_count = ra_get_sector_count;
+    bs1->read_async = ra_read_async;
+    bs1->write_async = ra_write_async;
+    return bs1;
+}
+
+void block_readahead_get_stats(BlockDevice *bs, BlockReadaheadStats *st)
+{
+    BlockDeviceRA *s = bs->opaque;
+    *st = s->stats;
+}
@@ -0,0 +1,40 @@
+/*
+ * Block device read-ahead
+ * 
+ * Copyright (c) 2026 The TinyEMU contributors
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef BLOCK_READAHEAD_H
+#define BLOCK_READAHEAD_H
+
+typedef struct {
+    uint64_t hit_count; /* reads served from the read-ahead windows */
+    uint64_t miss_count; /* reads forwarded to the device */
+    uint64_t prefetch_count; /* windows read ahead */
+} BlockReadaheadStats;
+
+/* When sequential reads are detected, the next 'window_size' sectors are
+   read ahead from 'bs'. At most 'window_count' windows are kept. */
+BlockDevice *block_readahead_init(BlockDevice *bs, int window_size,
+                                  int window_count);
+void block_readahead_get_stats(BlockDevice *bs, BlockReadaheadStats *st);
+
+#endif /* BLOCK_READAHEAD_H */
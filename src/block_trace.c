@@ -0,0 +1,98 @@
+/*
+ * Block device access trace
+ * 
+ * Copyright (c) 2026 The TinyEMU contributors
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "cutils.h"
+#include "virtio.h"
+#include "block_trace.h"
+
+typedef struct {
+    BlockDevice *bs;
+    FILE *f;
+    int drive_index;
+    int64_t start_time; /* in ms */
+} BlockDeviceTrace;
+
+static int64_t get_time_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + (ts.tv_nsec / 1000000);
+}
+
+static void trace_log(BlockDeviceTrace *s, int type, uint64_t sector_num,
+                      int n)
+{
+    fprintf(s->f, "%" PRId64 " %d %c %" PRIu64 " %d\n",
+            get_time_ms() - s->start_time, s->drive_index, type,
+            sector_num, n);
+}
+
+static int64_t trace_get_sector_count(BlockDevice *bs)
+{
+    BlockDeviceTrace *s = bs->opaque;
+    return s->bs->get_sector_count(s->bs);
+}
+
+static int trace_read_async(BlockDevice *bs,
+                            uint64_t sector_num, uint8_t *buf, int n,
+                            BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    BlockDeviceTrace *s = bs->opaque;
+    trace_log(s, 'R', sector_num, n);
+    return s->bs->read_async(s->bs, sector_num, buf, n, cb, opaque);
+}
+
+static int trace_write_async(BlockDevice *bs,
+                             uint64_t sector_num, const uint8_t *buf, int n,
+                             BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    BlockDeviceTrace *s = bs->opaque;
+    trace_log(s, 'W', sector_num, n);
+    return s->bs->write_async(s->bs, sector_num, buf, n, cb, opaque);
+}
+
+BlockDevice *block_trace_init(BlockDevice *bs, FILE *f, int drive_index)
+{
+    BlockDevice *bs1;
+    BlockDeviceTrace *s;
+
+    s = mallocz(sizeof(*s));
+    s->bs = bs;
+    s->f = f;
+    s->drive_index = drive_index;
+    s->start_time = get_time_ms();
+
+    bs1 = mallocz(sizeof(*bs1));
+    bs1->opaque = s;
+    bs1->get_sector_count = trace_get_sector_count;
+    bs1->read_async = trace_read_async;
+    bs1->write_async = trace_write_async;
+    return bs1;
+}
@@ -34,9 +34,11 @@
 #include <dirent.h>
 #include <errno.h>
 #include <sys/sysmacros.h>
+#include <pthread.h>
 
 #include "cutils.h"
 #include "fs_utils.h"
+#include "sha256.h"
 
 void print_str(FILE *f, const char *str)
 {
@@ -94,14 +96,81 @@ static void copy_file(const char *src_filename, const char *dst_filename)
     }
     fclose(fo);
     fclose(fi);
+    free(buf);
 }
 
+/* directory of the file list */
+typedef struct FLEntry {
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t mtime_sec;
+    uint32_t mtime_nsec;
+    char *name;
+    char *link_name; /* symlink target */
+    uint64_t arg; /* size or device */
+    FSFileID file_id;
+    struct FLDir *dir;
+    /* regular files */
+    char *path; /* source path */
+    uint64_t ino;
+    BOOL has_hash;
+    BOOL is_new; /* the content must be copied to the file store */
+    uint8_t hash[SHA256_DIGEST_LENGTH];
+} FLEntry;
+
+typedef struct FLDir {
+    FLEntry *tab;
+    int count;
+    int size;
+    uint32_t offset;
+} FLDir;
+
+/* files of the previous build, indexed by path and by content */
+typedef struct FileCacheEntry {
+    struct FileCacheEntry *path_next;
+    struct FileCacheEntry *hash_next;
+    char *path; /* relative to the source path */
+    uint64_t size;
+    uint64_t ino;
+    uint32_t mtime_sec;
+    uint32_t mtime_nsec;
+    FSFileID file_id;
+    uint8_t hash[SHA256_DIGEST_LENGTH];
+} FileCacheEntry;
+
+#define FILE_CACHE_HASH_SIZE 65536 /* power of two */
+
+typedef struct {
+    FileCacheEntry *path_hash[FILE_CACHE_HASH_SIZE];
+    FileCacheEntry *content_hash[FILE_CACHE_HASH_SIZE];
+} FileCache;
+
+/* directory waiting to be scanned */
+typedef struct ScanDirItem {
+    struct ScanDirItem *next;
+    char *path;
+    FLDir *dir;
+} ScanDirItem;
+
 typedef struct {
     char *files_path;
+    int src_path_len;
     uint64_t next_inode_num;
     uint64_t fs_size;
     uint64_t fs_max_size;
+    uint64_t file_blocks; /* blocks used by the regular files */
     FILE *f;
+    FileCache *cache;
+    int thread_count;
+    /* directory scan */
+    pthread_mutex_t scan_lock;
+    pthread_cond_t scan_cond;
+    ScanDirItem *scan_queue;
+    int scan_pending; /* directories queued or being scanned */
+    /* statistics */
+    int hashed_count;
+    int copied_count;
 } ScanState;
 
 static void add_file_size(ScanState *s, uint64_t size)
@@ -113,15 +182,42 @@ static void add_file_size(ScanState *s, uint64_t size)
     }
 }
 
-void scan_dir(ScanState *s, const char *path)
+static FLEntry *fl_add_entry(FLDir *d)
+{
+    if (d->count >= d->size) {
+        d->size = max_int(d->size * 3 / 2, 16);
+        d->tab = realloc(d->tab, sizeof(d->tab[0]) * d->size);
+    }
+    return memset(&d->tab[d->count++], 0, sizeof(d->tab[0]));
+}
+
+/* 'path' belongs to scan_queue_add() */
+static void scan_queue_add(ScanState *s, char *path, FLDir *dir)
+{
+    ScanDirItem *item;
+
+    item = malloc(sizeof(*item));
+    item->path = path;
+    item->dir = dir;
+    pthread_mutex_lock(&s->scan_lock);
+    item->next = s->scan_queue;
+    s->scan_queue = item;
+    s->scan_pending++;
+    pthread_cond_signal(&s->scan_cond);
+    pthread_mutex_unlock(&s->scan_lock);
+}
+
+/* the subdirectories are added to the scan queue */
+static void scan_dir(ScanState *s, const char *path, FLDir *dir)
 {
-    FILE *f = s->f;
     DIR *dirp;
     struct dirent *de;
     const char *name;
     struct stat st;
     char *path1;
-    uint32_t mode, v;
+    char lname[1024];
+    uint32_t mode;
+    FLEntry *e;
 
     dirp = opendir(path);
     if (!dirp) {
@@ -142,21 +238,431 @@ void scan_dir(ScanState *s, const char *path)
         }
 
         mode = st.st_mode & 0xffff;
-        fprintf(f, "%06o %u %u", 
-                mode, 
-                (int)st.st_uid,
-                (int)st.st_gid);
+        e = fl_add_entry(dir);
+        e->mode = mode;
+        e->uid = st.st_uid;
+        e->gid = st.st_gid;
+        e->mtime_sec = st.st_mtim.tv_sec;
+        e->mtime_nsec = st.st_mtim.tv_nsec;
+        e->name = strdup(name);
         if (S_ISCHR(mode) || S_ISBLK(mode)) {
+            e->arg = ((uint64_t)major(st.st_rdev) << 32) |
+                minor(st.st_rdev);
+        } else if (S_ISREG(mode)) {
+            e->arg = st.st_size;
+            e->ino = st.st_ino;
+            if (st.st_size > 0) {
+                e->path = path1;
+                path1 = NULL;
+            }
+        } else if (S_ISLNK(mode)) {
+            int len;
+            len = readlink(path1, lname, sizeof(lname) - 1);
+            if (len < 0) {
+                perror("readlink");
+                exit(1);
+            }
+            lname[len] = '\0';
+            e->link_name = strdup(lname);
+        } else if (S_ISDIR(mode)) {
+            e->dir = mallocz(sizeof(FLDir));
+            scan_queue_add(s, path1, e->dir);
+            path1 = NULL;
+        }
+        free(path1);
+    }
+    closedir(dirp);
+}
+
+static void *scan_thread(void *opaque)
+{
+    ScanState *s = opaque;
+    ScanDirItem *item;
+
+    for(;;) {
+        pthread_mutex_lock(&s->scan_lock);
+        while (!s->scan_queue && s->scan_pending > 0)
+            pthread_cond_wait(&s->scan_cond, &s->scan_lock);
+        item = s->scan_queue;
+        if (item)
+            s->scan_queue = item->next;
+        pthread_mutex_unlock(&s->scan_lock);
+        if (!item)
+            break;
+        scan_dir(s, item->path, item->dir);
+        free(item->path);
+        free(item);
+        pthread_mutex_lock(&s->scan_lock);
+        if (--s->scan_pending == 0)
+            pthread_cond_broadcast(&s->scan_cond);
+        pthread_mutex_unlock(&s->scan_lock);
+    }
+    return NULL;
+}
+
+/* Scan the directories in parallel: the stat() calls dominate on large
+   trees. Each directory is filled by a single thread, so the entries
+   are in the same order as with a serial walk. */
+static void scan_tree(ScanState *s, const char *path, FLDir *root)
+{
+    pthread_t *thread_tab;
+    int j;
+
+    pthread_mutex_init(&s->scan_lock, NULL);
+    pthread_cond_init(&s->scan_cond, NULL);
+    s->scan_queue = NULL;
+    s->scan_pending = 0;
+    scan_queue_add(s, strdup(path), root);
+    if (s->thread_count > 1) {
+        thread_tab = malloc(sizeof(thread_tab[0]) * s->thread_count);
+        for(j = 0; j < s->thread_count; j++) {
+            if (pthread_create(&thread_tab[j], NULL, scan_thread, s) != 0) {
+                fprintf(stderr, "could not create thread\n");
+                exit(1);
+            }
+        }
+        for(j = 0; j < s->thread_count; j++)
+            pthread_join(thread_tab[j], NULL);
+        free(thread_tab);
+    } else {
+        scan_thread(s);
+    }
+    pthread_cond_destroy(&s->scan_cond);
+    pthread_mutex_destroy(&s->scan_lock);
+}
+
+/* list the regular files with a content in walk order */
+static void fl_get_files(FLEntry ***ptab, int *pcount, int *psize, FLDir *d)
+{
+    FLEntry *e;
+    int i;
+
+    for(i = 0; i < d->count; i++) {
+        e = &d->tab[i];
+        if (e->path) {
+            if (*pcount >= *psize) {
+                *psize = max_int(*psize * 3 / 2, 16);
+                *ptab = realloc(*ptab, sizeof((*ptab)[0]) * *psize);
+            }
+            (*ptab)[(*pcount)++] = e;
+        } else if (e->dir) {
+            fl_get_files(ptab, pcount, psize, e->dir);
+        }
+    }
+}
+
+static uint32_t str_hash(const char *str)
+{
+    uint32_t h;
+    h = 1;
+    while (*str != '\0')
+        h = h * 263 + (uint8_t)*str++;
+    return h;
+}
+
+static uint32_t content_hash(const uint8_t *hash)
+{
+    return hash[0] | (hash[1] << 8);
+}
+
+static void file_cache_add_content(FileCache *c, FileCacheEntry *ce)
+{
+    uint32_t h = content_hash(ce->hash) & (FILE_CACHE_HASH_SIZE - 1);
+    ce->hash_next = c->content_hash[h];
+    c->content_hash[h] = ce;
+}
+
+static FileCacheEntry *file_cache_find_path(FileCache *c, const char *path)
+{
+    FileCacheEntry *ce;
+    for(ce = c->path_hash[str_hash(path) & (FILE_CACHE_HASH_SIZE - 1)];
+        ce != NULL; ce = ce->path_next) {
+        if (!strcmp(ce->path, path))
+            return ce;
+    }
+    return NULL;
+}
+
+static FileCacheEntry *file_cache_find_content(FileCache *c,
+                                               const uint8_t *hash)
+{
+    FileCacheEntry *ce;
+    for(ce = c->content_hash[content_hash(hash) & (FILE_CACHE_HASH_SIZE - 1)];
+        ce != NULL; ce = ce->hash_next) {
+        if (!memcmp(ce->hash, hash, SHA256_DIGEST_LENGTH))
+            return ce;
+    }
+    return NULL;
+}
+
+/* return NULL if the file cannot be read */
+static char *load_file(const char *filename)
+{
+    FILE *f;
+    char *buf;
+    long size;
+
+    f = fopen(filename, "rb");
+    if (!f)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    buf = malloc(size + 1);
+    if (fread(buf, 1, size, f) != size) {
+        fclose(f);
+        free(buf);
+        return NULL;
+    }
+    buf[size] = '\0';
+    fclose(f);
+    return buf;
+}
+
+/* load the file cache of the previous build. Only the files still
+   present in the file store are kept. */
+static void file_cache_load(ScanState *s, const char *filename)
+{
+    FileCache *c = s->cache;
+    FileCacheEntry *ce;
+    char *buf, *fname;
+    char path[4096], hash_str[SHA256_DIGEST_LENGTH * 2 + 1];
+    char buf1[FILEID_SIZE_MAX];
+    const char *p;
+    uint32_t h;
+    struct stat st;
+
+    buf = load_file(filename);
+    if (!buf)
+        return;
+
+    if (parse_tag_version(buf) != 1)
+        goto done;
+    p = skip_header(buf);
+    if (!p)
+        goto done;
+    while (*p != '\0') {
+        ce = mallocz(sizeof(*ce));
+        if (parse_file_id(&ce->file_id, &p) < 0 ||
+            parse_fname(hash_str, sizeof(hash_str), &p) < 0 ||
+            strlen(hash_str) != SHA256_DIGEST_LENGTH * 2 ||
+            decode_hex(ce->hash, hash_str, SHA256_DIGEST_LENGTH) < 0 ||
+            parse_uint64(&ce->size, &p) < 0 ||
+            parse_uint64(&ce->ino, &p) < 0 ||
+            parse_uint32(&ce->mtime_sec, &p) < 0 ||
+            parse_uint32(&ce->mtime_nsec, &p) < 0 ||
+            parse_fname(path, sizeof(path), &p) < 0) {
+            fprintf(stderr, "%s: syntax error, ignoring the cache\n", filename);
+            free(ce);
+            goto done;
+        }
+        skip_line(&p);
+        file_id_to_filename(buf1, ce->file_id);
+        fname = compose_path(s->files_path, buf1);
+        if (stat(fname, &st) < 0 || st.st_size != ce->size) {
+            free(fname);
+            free(ce);
+            continue;
+        }
+        free(fname);
+        ce->path = strdup(path);
+        h = str_hash(ce->path) & (FILE_CACHE_HASH_SIZE - 1);
+        ce->path_next = c->path_hash[h];
+        c->path_hash[h] = ce;
+        file_cache_add_content(c, ce);
+    }
+ done:
+    free(buf);
+}
+
+static void file_cache_save(ScanState *s, const char *filename,
+                            FLEntry **tab, int count)
+{
+    FILE *f;
+    FLEntry *e;
+    char hash_str[SHA256_DIGEST_LENGTH * 2 + 1];
+    int i;
+
+    f = fopen(filename, "wb");
+    if (!f) {
+        perror(filename);
+        exit(1);
+    }
+    fprintf(f, "Version: 1\n");
+    fprintf(f, "\n");
+    for(i = 0; i < count; i++) {
+        e = tab[i];
+        encode_hex(hash_str, e->hash, SHA256_DIGEST_LENGTH);
+        fprintf(f, "%" PRIx64 " %s %" PRIu64 " %" PRIu64 " %u %u ",
+                e->file_id, hash_str, e->arg, e->ino,
+                e->mtime_sec, e->mtime_nsec);
+        print_str(f, e->path + s->src_path_len);
+        fprintf(f, "\n");
+    }
+    fclose(f);
+}
+
+static void hash_file(FLEntry *e, uint8_t *buf)
+{
+    SHA256_CTX ctx;
+    FILE *f;
+    int len;
+
+    f = fopen(e->path, "rb");
+    if (!f) {
+        perror(e->path);
+        exit(1);
+    }
+    SHA256_Init(&ctx);
+    for(;;) {
+        len = fread(buf, 1, COPY_BUF_LEN, f);
+        if (len == 0)
+            break;
+        SHA256_Update(&ctx, buf, len);
+    }
+    fclose(f);
+    SHA256_Final(e->hash, &ctx);
+    e->has_hash = TRUE;
+}
+
+typedef struct {
+    ScanState *s;
+    FLEntry **tab;
+    int count;
+    int thread_idx;
+    BOOL do_copy;
+} FileThread;
+
+/* hash or copy the files in parallel */
+static void *file_thread(void *opaque)
+{
+    FileThread *ft = opaque;
+    ScanState *s = ft->s;
+    FLEntry *e;
+    char buf1[FILEID_SIZE_MAX], *fname;
+    uint8_t *buf;
+    int i;
+
+    buf = malloc(COPY_BUF_LEN);
+    for(i = ft->thread_idx; i < ft->count; i += s->thread_count) {
+        e = ft->tab[i];
+        if (ft->do_copy) {
+            if (e->is_new) {
+                file_id_to_filename(buf1, e->file_id);
+                fname = compose_path(s->files_path, buf1);
+                copy_file(e->path, fname);
+                free(fname);
+            }
+        } else {
+            if (!e->has_hash)
+                hash_file(e, buf);
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+static void process_files(ScanState *s, FLEntry **tab, int count,
+                          BOOL do_copy)
+{
+    FileThread *ft_tab;
+    pthread_t *thread_tab;
+    int j;
+
+    ft_tab = mallocz(sizeof(ft_tab[0]) * s->thread_count);
+    thread_tab = malloc(sizeof(thread_tab[0]) * s->thread_count);
+    for(j = 0; j < s->thread_count; j++) {
+        FileThread *ft = &ft_tab[j];
+        ft->s = s;
+        ft->tab = tab;
+        ft->count = count;
+        ft->thread_idx = j;
+        ft->do_copy = do_copy;
+        if (s->thread_count > 1 &&
+            pthread_create(&thread_tab[j], NULL, file_thread, ft) != 0) {
+            fprintf(stderr, "could not create thread\n");
+            exit(1);
+        }
+    }
+    if (s->thread_count > 1) {
+        for(j = 0; j < s->thread_count; j++)
+            pthread_join(thread_tab[j], NULL);
+    } else {
+        file_thread(&ft_tab[0]);
+    }
+    free(thread_tab);
+    free(ft_tab);
+}
+
+/* Assign the file IDs. The unmodified files of the previous build are
+   not hashed again and a content already in the file store is not
+   copied. */
+static void build_files(ScanState *s, FLEntry **tab, int count)
+{
+    FileCache *c = s->cache;
+    FileCacheEntry *ce;
+    FLEntry *e;
+    int i;
+
+    for(i = 0; i < count; i++) {
+        e = tab[i];
+        ce = file_cache_find_path(c, e->path + s->src_path_len);
+        if (ce && ce->size == e->arg && ce->ino == e->ino &&
+            ce->mtime_sec == e->mtime_sec && ce->mtime_nsec == e->mtime_nsec) {
+            memcpy(e->hash, ce->hash, SHA256_DIGEST_LENGTH);
+            e->has_hash = TRUE;
+        } else {
+            s->hashed_count++;
+        }
+    }
+
+    process_files(s, tab, count, FALSE);
+
+    for(i = 0; i < count; i++) {
+        e = tab[i];
+        ce = file_cache_find_content(c, e->hash);
+        if (ce) {
+            e->file_id = ce->file_id;
+        } else {
+            e->file_id = s->next_inode_num++;
+            e->is_new = TRUE;
+            s->copied_count++;
+            /* identical files of this build share the same copy */
+            ce = mallocz(sizeof(*ce));
+            ce->file_id = e->file_id;
+            memcpy(ce->hash, e->hash, SHA256_DIGEST_LENGTH);
+            file_cache_add_content(c, ce);
+        }
+        add_file_size(s, e->arg);
+        s->file_blocks += block_align(e->arg, FS_BLOCK_SIZE) / FS_BLOCK_SIZE;
+    }
+
+    process_files(s, tab, count, TRUE);
+}
+
+static void fl_write_text(FILE *f, FLDir *d)
+{
+    FLEntry *e;
+    uint32_t v;
+    int i;
+
+    for(i = 0; i < d->count; i++) {
+        e = &d->tab[i];
+        fprintf(f, "%06o %u %u", 
+                e->mode, 
+                e->uid,
+                e->gid);
+        if (S_ISCHR(e->mode) || S_ISBLK(e->mode)) {
             fprintf(f, " %u %u",
-                    (int)major(st.st_rdev),
-                    (int)minor(st.st_rdev));
+                    (uint32_t)(e->arg >> 32),
+                    (uint32_t)e->arg);
         }
-        if (S_ISREG(mode)) {
-            fprintf(f, " %" PRIu64, st.st_size);
+        if (S_ISREG(e->mode)) {
+            fprintf(f, " %" PRIu64, e->arg);
         }
         /* modification time (at most ms resolution) */
-        fprintf(f, " %u", (int)st.st_mtim.tv_sec);
-        v = st.st_mtim.tv_nsec;
+        fprintf(f, " %u", e->mtime_sec);
+        v = e->mtime_nsec;
         if (v != 0) {
             fprintf(f, ".");
             while (v != 0) {
@@ -166,78 +672,189 @@ void scan_dir(ScanState *s, const char *path)
         }
         
         fprintf(f, " ");
-        print_str(f, name);
-        if (S_ISLNK(mode)) {
-            char buf[1024];
-            int len;
-            len = readlink(path1, buf, sizeof(buf) - 1);
-            if (len < 0) {
-                perror("readlink");
-                exit(1);
-            }
-            buf[len] = '\0';
+        print_str(f, e->name);
+        if (S_ISLNK(e->mode)) {
             fprintf(f, " ");
-            print_str(f, buf);
-        } else if (S_ISREG(mode) && st.st_size > 0) {
-            char buf1[FILEID_SIZE_MAX], *fname;
-            FSFileID file_id;
-            file_id = s->next_inode_num++;
-            fprintf(f, " %" PRIx64, file_id);
-            file_id_to_filename(buf1, file_id);
-            fname = compose_path(s->files_path, buf1);
-            copy_file(path1, fname);
-            add_file_size(s, st.st_size);
+            print_str(f, e->link_name);
+        } else if (S_ISREG(e->mode) && e->arg > 0) {
+            fprintf(f, " %" PRIx64, e->file_id);
         }
 
         fprintf(f, "\n");
-        if (S_ISDIR(mode)) {
-            scan_dir(s, path1);
+        if (e->dir) {
+            fl_write_text(f, e->dir);
         }
-        free(path1);
     }
-
-    closedir(dirp);
     fprintf(f, ".\n"); /* end of directory */
 }
 
+/* assign the directory offsets. Return the end offset. */
+static uint64_t fl_layout(FLDir *d, uint64_t pos)
+{
+    int i;
+
+    if (pos > UINT32_MAX) {
+        fprintf(stderr, "binary file list too large\n");
+        exit(1);
+    }
+    d->offset = pos;
+    pos += 4 + (uint64_t)d->count * FILELIST_ENTRY_SIZE;
+    for(i = 0; i < d->count; i++) {
+        if (d->tab[i].dir)
+            pos = fl_layout(d->tab[i].dir, pos);
+    }
+    return pos;
+}
+
+static uint32_t fl_add_str(uint64_t *pstr_pos, const char *str)
+{
+    uint64_t pos = *pstr_pos;
+    if (pos > UINT32_MAX) {
+        fprintf(stderr, "binary file list too large\n");
+        exit(1);
+    }
+    *pstr_pos += strlen(str) + 1;
+    return pos;
+}
+
+/* the strings are stored after the directories, in the same order */
+static void fl_write_dir(FILE *f, FLDir *d, uint64_t *pstr_pos)
+{
+    uint8_t buf[FILELIST_ENTRY_SIZE];
+    FLEntry *e;
+    uint64_t arg;
+    int i;
+
+    put_le32(buf, d->count);
+    fwrite(buf, 1, 4, f);
+    for(i = 0; i < d->count; i++) {
+        e = &d->tab[i];
+        put_le32(buf, e->mode);
+        put_le32(buf + 4, e->uid);
+        put_le32(buf + 8, e->gid);
+        put_le32(buf + 12, e->mtime_sec);
+        put_le32(buf + 16, e->mtime_nsec);
+        put_le32(buf + 20, fl_add_str(pstr_pos, e->name));
+        arg = e->arg;
+        if (e->dir)
+            arg = e->dir->offset;
+        else if (e->link_name)
+            arg = fl_add_str(pstr_pos, e->link_name);
+        put_le64(buf + 24, arg);
+        put_le64(buf + 32, e->file_id);
+        fwrite(buf, 1, FILELIST_ENTRY_SIZE, f);
+    }
+    for(i = 0; i < d->count; i++) {
+        if (d->tab[i].dir)
+            fl_write_dir(f, d->tab[i].dir, pstr_pos);
+    }
+}
+
+static void fl_write_str(FILE *f, FLDir *d)
+{
+    FLEntry *e;
+    int i;
+
+    for(i = 0; i < d->count; i++) {
+        e = &d->tab[i];
+        fwrite(e->name, 1, strlen(e->name) + 1, f);
+        if (e->link_name)
+            fwrite(e->link_name, 1, strlen(e->link_name) + 1, f);
+    }
+    for(i = 0; i < d->count; i++) {
+        if (d->tab[i].dir)
+            fl_write_str(f, d->tab[i].dir);
+    }
+}
+
+static void fl_free(FLDir *d)
+{
+    FLEntry *e;
+    int i;
+
+    for(i = 0; i < d->count; i++) {
+        e = &d->tab[i];
+        free(e->name);
+        free(e->link_name);
+        free(e->path);
+        if (e->dir)
+            fl_free(e->dir);
+    }
+    free(d->tab);
+    free(d);
+}
+
+static void write_binary_filelist(ScanState *s, FLDir *root)
+{
+    uint8_t buf[FILELIST_HEADER_SIZE];
+    uint64_t str_pos;
+
+    str_pos = fl_layout(root, FILELIST_HEADER_SIZE);
+    put_le32(buf, FILELIST_MAGIC);
+    put_le32(buf + 4, root->offset);
+    put_le64(buf + 8, s->file_blocks);
+    fwrite(buf, 1, FILELIST_HEADER_SIZE, s->f);
+    fl_write_dir(s->f, root, &str_pos);
+    fl_write_str(s->f, root);
+}
+
 void help(void)
 {
     printf("usage: build_filelist [options] source_path dest_path\n"
            "\n"
            "Options:\n"
-           "-m size_mb  set the max filesystem size in MiB\n");
+           "-m size_mb  set the max filesystem size in MiB\n"
+           "-b          output a binary file list\n"
+           "-j threads  number of threads used to scan, hash and copy the files\n"
+           "            (default = number of CPUs)\n"
+           "\n"
+           "The files of a previous build in dest_path are reused when their\n"
+           "content is unchanged.\n");
     exit(1);
 }
 
 #define LOCK_FILENAME "lock"
+#define CACHE_FILENAME "cache"
 
 int main(int argc, char **argv)
 {
     const char *dst_path, *src_path;
     ScanState s_s, *s = &s_s;
     FILE *f;
-    char *filename;
+    char *filename, *filename1;
     FSFileID root_id;
     char fname[FILEID_SIZE_MAX];
     struct stat st;
     uint64_t first_inode, fs_max_size;
-    int c;
+    int c, thread_count, file_count, file_size;
+    BOOL binary;
+    FLDir *root;
+    FLEntry **file_tab;
+    char *buf;
     
     first_inode = 1;
     fs_max_size = (uint64_t)1 << 30;
+    binary = FALSE;
+    thread_count = sysconf(_SC_NPROCESSORS_ONLN);
     for(;;) {
-        c = getopt(argc, argv, "hi:m:");
+        c = getopt(argc, argv, "hi:m:bj:");
         if (c == -1)
             break;
         switch(c) {
         case 'h':
             help();
+        case 'b':
+            binary = TRUE;
+            break;
         case 'i':
             first_inode = strtoul(optarg, NULL, 0);
             break;
         case 'm':
             fs_max_size = (uint64_t)strtoul(optarg, NULL, 0) << 20;
             break;
+        case 'j':
+            thread_count = strtoul(optarg, NULL, 0);
+            break;
         default:
             exit(1);
         }
@@ -254,9 +871,30 @@ int main(int argc, char **argv)
     s->next_inode_num = first_inode;
     s->fs_size = 0;
     s->fs_max_size = fs_max_size;
+    s->file_blocks = 0;
+    s->src_path_len = strlen(src_path);
+    s->thread_count = max_int(thread_count, 1);
+    s->hashed_count = 0;
+    s->copied_count = 0;
+    s->cache = mallocz(sizeof(FileCache));
         
     mkdir(s->files_path, 0755);
 
+    /* do not overwrite the files of the previous build */
+    filename = compose_path(dst_path, HEAD_FILENAME);
+    buf = load_file(filename);
+    if (buf) {
+        FSFileID next_id;
+        if (parse_tag_file_id(&next_id, buf, "NextFileID") == 0 &&
+            next_id > s->next_inode_num)
+            s->next_inode_num = next_id;
+        free(buf);
+    }
+    free(filename);
+    filename = compose_path(dst_path, CACHE_FILENAME);
+    file_cache_load(s, filename);
+    free(filename);
+
     root_id = s->next_inode_num++;
     file_id_to_filename(fname, root_id);
     filename = compose_path(s->files_path, fname);
@@ -265,13 +903,35 @@ int main(int argc, char **argv)
         perror(filename);
         exit(1);
     }
-    fprintf(f, "Version: 1\n");
-    fprintf(f, "Revision: 1\n");
-    fprintf(f, "\n");
     s->f = f;
-    scan_dir(s, src_path);
+
+    root = mallocz(sizeof(FLDir));
+    scan_tree(s, src_path, root);
+    file_tab = NULL;
+    file_count = 0;
+    file_size = 0;
+    fl_get_files(&file_tab, &file_count, &file_size, root);
+    build_files(s, file_tab, file_count);
+
+    if (binary) {
+        write_binary_filelist(s, root);
+    } else {
+        fprintf(f, "Version: 1\n");
+        fprintf(f, "Revision: 1\n");
+        fprintf(f, "\n");
+        fl_write_text(f, root);
+    }
     fclose(f);
 
+    filename1 = compose_path(dst_path, CACHE_FILENAME);
+    file_cache_save(s, filename1, file_tab, file_count);
+    free(filename1);
+    free(file_tab);
+    fl_free(root);
+
+    printf("%d files: %d hashed, %d copied\n",
+           file_count, s->hashed_count, s->copied_count);
+
     /* take into account the filelist size */
     if (stat(filename, &st) < 0) {
         perror(filename);
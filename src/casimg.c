@@ -0,0 +1,191 @@
+/*
+ * Content addressed disk image builder
+ * 
+ * Copyright (c) 2026 The TinyEMU contributors
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <getopt.h>
+
+#include "cutils.h"
+#include "virtio.h"
+#include "sha256.h"
+#include "block_cas.h"
+
+static BOOL is_zero(const uint8_t *buf, int len)
+{
+    int i;
+    for(i = 0; i < len; i++) {
+        if (buf[i] != 0)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/* return TRUE if the chunk was added to the store */
+static BOOL store_chunk(const char *store_path, const uint8_t *hash,
+                        const uint8_t *buf, int len)
+{
+    char *fname, *tmp_fname, *p;
+    size_t len1;
+    FILE *f;
+
+    fname = block_cas_get_chunk_path(store_path, hash);
+    if (access(fname, F_OK) == 0) {
+        free(fname);
+        return FALSE;
+    }
+    p = strrchr(fname, '/');
+    *p = '\0';
+    if (mkdir(fname, 0755) < 0 && errno != EEXIST) {
+        perror(fname);
+        exit(1);
+    }
+    *p = '/';
+    /* the chunk is renamed once complete so that an interrupted ingest
+       does not leave an invalid chunk */
+    len1 = strlen(fname);
+    tmp_fname = malloc(len1 + 5);
+    memcpy(tmp_fname, fname, len1);
+    memcpy(tmp_fname + len1, ".tmp", 5);
+    f = fopen(tmp_fname, "wb");
+    if (!f) {
+        perror(tmp_fname);
+        exit(1);
+    }
+    fwrite(buf, 1, len, f);
+    if (fclose(f) != 0 || rename(tmp_fname, fname) < 0) {
+        perror(fname);
+        exit(1);
+    }
+    free(tmp_fname);
+    free(fname);
+    return TRUE;
+}
+
+int main(int argc, char **argv)
+{
+    int chunk_size, ret, path_len, len;
+    const char *store_path, *infilename, *outfilename, *p;
+    char *store_dir;
+    FILE *f, *fo;
+    uint8_t *buf, header[BLOCK_CAS_HEADER_SIZE], hash[SHA256_DIGEST_LENGTH];
+    int64_t image_size, nb_chunks, i, nb_zero, nb_new;
+
+    if ((optind + 2) >= argc) {
+        printf("casimg version " CONFIG_VERSION ", Copyright (c) 2026 The TinyEMU contributors\n"
+               "usage: casimg store_path infile manifest [chunksize]\n"
+               "Add a disk image to a content addressed chunk store and create its manifest\n"
+               "\n"
+               "store_path must be a directory. It is stored in the manifest as is, so a\n"
+               "relative path must be relative to the manifest directory.\n"
+               "chunksize is the chunk size in KB\n");
+        exit(1);
+    }
+
+    store_path = argv[optind++];
+    infilename = argv[optind++];
+    outfilename = argv[optind++];
+    chunk_size = BLOCK_CAS_DEFAULT_CHUNK_SIZE / 1024;
+    if (optind < argc)
+        chunk_size = strtol(argv[optind++], NULL, 0);
+    if (chunk_size <= 0 || chunk_size > 16384) {
+        fprintf(stderr, "invalid chunk size\n");
+        exit(1);
+    }
+    chunk_size *= 1024;
+
+    f = fopen(infilename, "rb");
+    if (!f) {
+        perror(infilename);
+        exit(1);
+    }
+    fseeko(f, 0, SEEK_END);
+    image_size = ftello(f);
+    fseeko(f, 0, SEEK_SET);
+    nb_chunks = (image_size + chunk_size - 1) / chunk_size;
+    if (nb_chunks >= UINT32_MAX) {
+        fprintf(stderr, "%s: image too large\n", infilename);
+        exit(1);
+    }
+
+    fo = fopen(outfilename, "wb");
+    if (!fo) {
+        perror(outfilename);
+        exit(1);
+    }
+    path_len = strlen(store_path);
+    memcpy(header, BLOCK_CAS_MAGIC, 8);
+    put_le32(header + 8, chunk_size);
+    put_le32(header + 12, nb_chunks);
+    put_le64(header + 16, image_size);
+    put_le32(header + 24, path_len);
+    fwrite(header, 1, sizeof(header), fo);
+    fwrite(store_path, 1, path_len, fo);
+
+    /* the store path is relative to the manifest directory */
+    p = strrchr(outfilename, '/');
+    if (store_path[0] != '/' && p) {
+        len = p + 1 - outfilename;
+        store_dir = malloc(len + path_len + 1);
+        memcpy(store_dir, outfilename, len);
+        memcpy(store_dir + len, store_path, path_len + 1);
+    } else {
+        store_dir = strdup(store_path);
+    }
+
+    buf = malloc(chunk_size);
+    nb_zero = 0;
+    nb_new = 0;
+    for(i = 0; i < nb_chunks; i++) {
+        ret = fread(buf, 1, chunk_size, f);
+        if (ret <= 0) {
+            perror("fread");
+            exit(1);
+        }
+        if (ret < chunk_size)
+            memset(buf + ret, 0, chunk_size - ret);
+        if (is_zero(buf, chunk_size)) {
+            memset(hash, 0, sizeof(hash));
+            nb_zero++;
+        } else {
+            SHA256(buf, chunk_size, hash);
+            if (store_chunk(store_dir, hash, buf, chunk_size))
+                nb_new++;
+        }
+        fwrite(hash, 1, sizeof(hash), fo);
+    }
+    fclose(f);
+    if (fclose(fo) != 0) {
+        perror(outfilename);
+        exit(1);
+    }
+    printf("%" PRId64 " chunks: %" PRId64 " zero, %" PRId64 " new, %" PRId64
+           " already stored\n",
+           nb_chunks, nb_zero, nb_new, nb_chunks - nb_zero - nb_new);
+    return 0;
+}
@@ -82,6 +82,14 @@ static inline int min_int(int a, int b)
         return b;
 }
 
+static inline size_t min_size(size_t a, size_t b)
+{
+    if (a < b)
+        return a;
+    else
+        return b;
+}
+
 void *mallocz(size_t size);
 
 #if defined(_WIN32)
@@ -1,11 +1,18 @@
 #ifndef FBUF_H
 #define FBUF_H
 
+#if !defined(EMSCRIPTEN)
+/* the buffer is stored as chunks so that it can grow without copying
+   its content. Missing chunks read as zero. */
+#define FBUF_CHUNK_BITS 16
+#define FBUF_CHUNK_SIZE (1 << FBUF_CHUNK_BITS)
+#endif
+
 typedef struct {
 #if defined(EMSCRIPTEN)
     int handle;
 #else
-    uint8_t *data;
+    uint8_t **chunks; /* NULL if the chunk only contains zeros */
 #endif
     size_t allocated_size;
 } FileBuffer;
@@ -13,10 +20,11 @@ typedef struct {
 void file_buffer_init(FileBuffer *bs);
 void file_buffer_reset(FileBuffer *bs);
 int file_buffer_resize(FileBuffer *bs, size_t new_size);
-void file_buffer_write(FileBuffer *bs, size_t offset, const uint8_t *buf,
-                       size_t size);
-void file_buffer_set(FileBuffer *bs, size_t offset, int val, size_t size);
+int file_buffer_write(FileBuffer *bs, size_t offset, const uint8_t *buf,
+                      size_t size);
+int file_buffer_set(FileBuffer *bs, size_t offset, int val, size_t size);
 void file_buffer_read(FileBuffer *bs, size_t offset, uint8_t *buf,
                       size_t size);
+size_t file_buffer_get_resident_size(FileBuffer *bs);
 
 #endif /* FBUF_H */
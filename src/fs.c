@@ -81,7 +81,8 @@ FSFile *fs_walk_path1(FSDevice *fs, FSFile *f, const char *path,
         f = f1;
         is_first = FALSE;
         if (ret <= 0) {
-            fs->fs_delete(fs, f);
+            if (f)
+                fs->fs_delete(fs, f);
             f = NULL;
             break;
         } else if (is_last) {
@@ -86,6 +86,8 @@
 #define	P9_EEXIST    17
 #define	P9_ENOTDIR   20
 #define P9_EINVAL    22
+#define P9_ENFILE    23
+#define P9_EMFILE    24
 #define	P9_ENOSPC    28
 #define P9_ENOTEMPTY 39
 #define P9_EPROTO    71
@@ -193,10 +195,11 @@ struct FSDevice {
     int (*fs_getlock)(FSDevice *fs, FSFile *f, FSLock *lock);
 };
 
-FSDevice *fs_disk_init(const char *root_path);
+FSDevice *fs_disk_init(const char *root_path, BOOL mmap_read);
 FSDevice *fs_mem_init(void);
 FSDevice *fs_net_init(const char *url, void (*start)(void *opaque), void *opaque);
 void fs_net_set_pwd(FSDevice *fs, const char *pwd);
+
 #ifdef EMSCRIPTEN
 void fs_import_file(const char *filename, uint8_t *buf, int buf_len);
 #endif
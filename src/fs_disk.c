@@ -21,6 +21,9 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
  * THE SOFTWARE.
  */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* O_PATH, AT_EMPTY_PATH */
+#endif
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -34,47 +37,137 @@
 #include <fcntl.h>
 #include <dirent.h>
 #include <errno.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 
 #include "cutils.h"
 #include "list.h"
 #include "fs.h"
 
+#define INO_GEN_SIZE 256 /* power of two */
+
 typedef struct {
     FSDevice common;
     char *root_path;
+    /* incremented at each modification of the directories or of the
+       file attributes */
+    uint64_t stat_gen;
+    /* incremented when the content of a file whose inode number has
+       this hash is modified */
+    uint64_t ino_gen[INO_GEN_SIZE];
+    /* Read the files opened in read-only mode from a shared mapping.
+       The host must not truncate them while they are opened. */
+    BOOL mmap_read;
 } FSDeviceDisk;
 
 static void fs_close(FSDevice *fs, FSFile *f);
 
+#define DIR_BUF_SIZE 65536
+
+/* A fid holds an O_PATH file descriptor to its file so that the
+   operations are done relative to it without resolving the complete
+   path again. */
 struct FSFile {
     uint32_t uid;
-    char *path; /* complete path */
+    int fd; /* O_PATH file descriptor */
     BOOL is_opened;
     BOOL is_dir;
-    union {
-        int fd;
-        DIR *dirp;
-    } u;
+    int open_fd; /* opened file or directory */
+    uint64_t ino; /* inode number of the opened file */
+    /* mapping of a file opened in read-only mode */
+    BOOL can_map;
+    uint8_t *map_ptr;
+    size_t map_size;
+    uint64_t map_gen;
+    /* stat cache, valid until the next modification */
+    BOOL st_valid;
+    uint64_t st_gen;
+    uint64_t st_ino_gen;
+    struct stat st;
+    /* buffered directory entries */
+    uint8_t *dir_buf;
+    int dir_buf_len;
+    int dir_buf_pos;
+    uint64_t dir_offset; /* offset of the next entry */
 };
 
+/* linux_dirent64 */
+typedef struct {
+    uint64_t d_ino;
+    int64_t d_off;
+    uint16_t d_reclen;
+    uint8_t d_type;
+    char d_name[];
+} DiskDirEnt;
+
 static void fs_delete(FSDevice *fs, FSFile *f)
 {
     if (f->is_opened)
         fs_close(fs, f);
-    free(f->path);
+    close(f->fd);
     free(f);
 }
 
-/* warning: path belong to fid_create() */
-static FSFile *fid_create(FSDevice *s1, char *path, uint32_t uid)
+/* warning: fd belong to fid_create() */
+static FSFile *fid_create(FSDevice *s1, int fd, uint32_t uid)
 {
     FSFile *f;
     f = mallocz(sizeof(*f));
-    f->path = path;
+    f->fd = fd;
     f->uid = uid;
     return f;
 }
 
+/* path usable to reopen or modify the file referenced by 'fd' */
+static char *fd_path(char *buf, int buf_size, int fd)
+{
+    snprintf(buf, buf_size, "/proc/self/fd/%d", fd);
+    return buf;
+}
+
+static void fs_modified(FSDevice *fs1)
+{
+    FSDeviceDisk *fs = (FSDeviceDisk *)fs1;
+    fs->stat_gen++;
+}
+
+static uint64_t *fs_ino_gen(FSDevice *fs1, uint64_t ino)
+{
+    FSDeviceDisk *fs = (FSDeviceDisk *)fs1;
+    return &fs->ino_gen[ino & (INO_GEN_SIZE - 1)];
+}
+
+/* the content of the file (hence its size or mtime) was modified */
+static void fs_ino_modified(FSDevice *fs, uint64_t ino)
+{
+    (*fs_ino_gen(fs, ino))++;
+}
+
+static void fid_set_stat(FSDevice *fs1, FSFile *f, const struct stat *st)
+{
+    FSDeviceDisk *fs = (FSDeviceDisk *)fs1;
+    f->st = *st;
+    f->st_gen = fs->stat_gen;
+    f->st_ino_gen = *fs_ino_gen(fs1, st->st_ino);
+    f->st_valid = TRUE;
+}
+
+/* The cached attributes are used once so that modifications done
+   on the host are seen. */
+static int fid_stat(FSDevice *fs1, FSFile *f, struct stat *st)
+{
+    FSDeviceDisk *fs = (FSDeviceDisk *)fs1;
+    if (f->st_valid && f->st_gen == fs->stat_gen &&
+        f->st_ino_gen == *fs_ino_gen(fs1, f->st.st_ino)) {
+        *st = f->st;
+        f->st_valid = FALSE;
+        return 0;
+    }
+    f->st_valid = FALSE;
+    return fstatat(f->fd, "", st, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+}
+
 
 static int errno_table[][2] = {
     { P9_EPERM, EPERM },
@@ -82,6 +175,8 @@ static int errno_table[][2] = {
     { P9_EIO, EIO },
     { P9_EEXIST, EEXIST },
     { P9_EINVAL, EINVAL },
+    { P9_ENFILE, ENFILE },
+    { P9_EMFILE, EMFILE },
     { P9_ENOSPC, ENOSPC },
     { P9_ENOTEMPTY, ENOTEMPTY },
     { P9_EPROTO, EPROTO },
@@ -155,20 +250,6 @@ static void fs_statfs(FSDevice *fs1, FSStatFS *st)
     st->f_ffree = st1.f_ffree;
 }
 
-static char *compose_path(const char *path, const char *name)
-{
-    int path_len, name_len;
-    char *d;
-
-    path_len = strlen(path);
-    name_len = strlen(name);
-    d = malloc(path_len + 1 + name_len + 1);
-    memcpy(d, path, path_len);
-    d[path_len] = '/';
-    memcpy(d + path_len + 1, name, name_len + 1);
-    return d;
-}
-
 static int fs_attach(FSDevice *fs1, FSFile **pf,
                      FSQID *qid, uint32_t uid,
                      const char *uname, const char *aname)
@@ -176,12 +257,20 @@ static int fs_attach(FSDevice *fs1, FSFile **pf,
     FSDeviceDisk *fs = (FSDeviceDisk *)fs1;
     struct stat st;
     FSFile *f;
+    int fd;
     
-    if (lstat(fs->root_path, &st) != 0) {
+    fd = open(fs->root_path, O_PATH | O_DIRECTORY);
+    if (fd < 0) {
+        *pf = NULL;
+        return -errno_to_p9(errno);
+    }
+    if (fstatat(fd, "", &st, AT_EMPTY_PATH) != 0) {
+        close(fd);
         *pf = NULL;
         return -errno_to_p9(errno);
     }
-    f = fid_create(fs1, strdup(fs->root_path), uid);
+    f = fid_create(fs1, fd, uid);
+    fid_set_stat(fs1, f, &st);
     stat_to_qid(qid, &st);
     *pf = f;
     return 0;
@@ -190,22 +279,39 @@ static int fs_attach(FSDevice *fs1, FSFile **pf,
 static int fs_walk(FSDevice *fs, FSFile **pf, FSQID *qids,
                    FSFile *f, int n, char **names)
 {
-    char *path, *path1;
     struct stat st;
-    int i;
+    int i, fd, fd1, err;
+    FSFile *f1;
 
-    path = strdup(f->path);
+    fd = dup(f->fd);
+    if (fd < 0) {
+        *pf = NULL;
+        return -errno_to_p9(errno);
+    }
     for(i = 0; i < n; i++) {
-        path1 = compose_path(path, names[i]);
-        if (lstat(path1, &st) != 0) {
-            free(path1);
+        fd1 = openat(fd, names[i], O_PATH | O_NOFOLLOW);
+        if (fd1 < 0)
+            break;
+        if (fstatat(fd1, "", &st, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) != 0) {
+            close(fd1);
             break;
         }
-        free(path);
-        path = path1;
+        close(fd);
+        fd = fd1;
         stat_to_qid(&qids[i], &st);
     }
-    *pf = fid_create(fs, path, f->uid);
+    /* an error on the first element is reported as such (e.g. when
+       no file descriptor is left) */
+    if (i == 0 && n > 0) {
+        err = errno;
+        close(fd);
+        *pf = NULL;
+        return -errno_to_p9(err);
+    }
+    f1 = fid_create(fs, fd, f->uid);
+    if (i > 0)
+        fid_set_stat(fs, f1, &st);
+    *pf = f1;
     return i;
 }
 
@@ -213,19 +319,13 @@ static int fs_walk(FSDevice *fs, FSFile **pf, FSQID *qids,
 static int fs_mkdir(FSDevice *fs, FSQID *qid, FSFile *f,
                     const char *name, uint32_t mode, uint32_t gid)
 {
-    char *path;
     struct stat st;
     
-    path = compose_path(f->path, name);
-    if (mkdir(path, mode) < 0) {
-        free(path);
+    fs_modified(fs);
+    if (mkdirat(f->fd, name, mode) < 0)
         return -errno_to_p9(errno);
-    }
-    if (lstat(path, &st) != 0) {
-        free(path);
+    if (fstatat(f->fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
         return -errno_to_p9(errno);
-    }
-    free(path);
     stat_to_qid(qid, &st);
     return 0;
 }
@@ -234,28 +334,40 @@ static int fs_open(FSDevice *fs, FSQID *qid, FSFile *f, uint32_t flags,
                    FSOpenCompletionFunc *cb, void *opaque)
 {
     struct stat st;
+    char buf[64];
+    int fd;
+
     fs_close(fs, f);
 
-    if (stat(f->path, &st) != 0) 
-        return -errno_to_p9(errno);
-    stat_to_qid(qid, &st);
-    
     if (flags & P9_O_DIRECTORY) {
-        DIR *dirp;
-        dirp = opendir(f->path);
-        if (!dirp)
-            return -errno_to_p9(errno);
-        f->is_opened = TRUE;
-        f->is_dir = TRUE;
-        f->u.dirp = dirp;
+        fd = openat(f->fd, ".", O_RDONLY | O_DIRECTORY);
     } else {
-        int fd;
-        fd = open(f->path, p9_flags_to_host(flags) & ~O_CREAT);
-        if (fd < 0)
-            return -errno_to_p9(errno);
-        f->is_opened = TRUE;
-        f->is_dir = FALSE;
-        f->u.fd = fd;
+        fd = open(fd_path(buf, sizeof(buf), f->fd),
+                  p9_flags_to_host(flags) & ~(O_CREAT | O_NOFOLLOW));
+    }
+    if (fd < 0)
+        return -errno_to_p9(errno);
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -errno_to_p9(errno);
+    }
+    /* only a truncation modifies the file */
+    if (flags & P9_O_TRUNC) {
+        fs_modified(fs);
+        fs_ino_modified(fs, st.st_ino);
+    }
+    f->ino = st.st_ino;
+    stat_to_qid(qid, &st);
+    f->is_opened = TRUE;
+    f->is_dir = ((flags & P9_O_DIRECTORY) != 0);
+    f->open_fd = fd;
+    f->can_map = (((FSDeviceDisk *)fs)->mmap_read && S_ISREG(st.st_mode) &&
+                  (flags & P9_O_NOACCESS) == P9_O_RDONLY);
+    if (f->is_dir) {
+        f->dir_buf = malloc(DIR_BUF_SIZE);
+        f->dir_buf_len = 0;
+        f->dir_buf_pos = 0;
+        f->dir_offset = 0;
     }
     return 0;
 }
@@ -264,28 +376,32 @@ static int fs_create(FSDevice *fs, FSQID *qid, FSFile *f, const char *name,
                      uint32_t flags, uint32_t mode, uint32_t gid)
 {
     struct stat st;
-    char *path;
-    int ret, fd;
+    int fd, path_fd;
 
     fs_close(fs, f);
+    fs_modified(fs);
     
-    path = compose_path(f->path, name);
-    fd = open(path, p9_flags_to_host(flags) | O_CREAT, mode);
-    if (fd < 0) {
-        free(path);
+    fd = openat(f->fd, name, p9_flags_to_host(flags) | O_CREAT, mode);
+    if (fd < 0)
+        return -errno_to_p9(errno);
+    path_fd = openat(f->fd, name, O_PATH | O_NOFOLLOW);
+    if (path_fd < 0) {
+        close(fd);
         return -errno_to_p9(errno);
     }
-    ret = lstat(path, &st);
-    if (ret != 0) {
-        free(path);
+    if (fstat(fd, &st) != 0) {
+        close(path_fd);
         close(fd);
         return -errno_to_p9(errno);
     }
-    free(f->path);
-    f->path = path;
+    /* an existing file may be truncated */
+    fs_ino_modified(fs, st.st_ino);
+    close(f->fd);
+    f->fd = path_fd;
+    f->ino = st.st_ino;
     f->is_opened = TRUE;
     f->is_dir = FALSE;
-    f->u.fd = fd;
+    f->open_fd = fd;
     stat_to_qid(qid, &st);
     return 0;
 }
@@ -293,36 +409,49 @@ static int fs_create(FSDevice *fs, FSQID *qid, FSFile *f, const char *name,
 static int fs_readdir(FSDevice *fs, FSFile *f, uint64_t offset,
                       uint8_t *buf, int count)
 {
-    struct dirent *de;
-    int len, pos, name_len, type, d_type;
+    DiskDirEnt *de;
+    int len, pos, name_len, type, d_type, ret;
 
     if (!f->is_opened || !f->is_dir)
         return -P9_EPROTO;
-    if (offset == 0)
-        rewinddir(f->u.dirp);
-    else
-        seekdir(f->u.dirp, offset);
+    if (offset != f->dir_offset) {
+        if (lseek(f->open_fd, offset, SEEK_SET) < 0)
+            return -errno_to_p9(errno);
+        f->dir_buf_len = 0;
+        f->dir_buf_pos = 0;
+        f->dir_offset = offset;
+    }
     pos = 0;
     for(;;) {
-        de = readdir(f->u.dirp);
-        if (de == NULL)
-            break;
+        if (f->dir_buf_pos >= f->dir_buf_len) {
+            ret = syscall(SYS_getdents64, f->open_fd, f->dir_buf,
+                          DIR_BUF_SIZE);
+            if (ret < 0) {
+                if (pos == 0)
+                    return -errno_to_p9(errno);
+                break;
+            }
+            if (ret == 0)
+                break;
+            f->dir_buf_len = ret;
+            f->dir_buf_pos = 0;
+        }
+        de = (DiskDirEnt *)(f->dir_buf + f->dir_buf_pos);
         name_len = strlen(de->d_name);
         len = 13 + 8 + 1 + 2 + name_len;
         if ((pos + len) > count)
             break;
-        offset = telldir(f->u.dirp);
+        f->dir_buf_pos += de->d_reclen;
+        f->dir_offset = de->d_off;
         d_type = de->d_type;
         if (d_type == DT_UNKNOWN) {
-            char *path;
             struct stat st;
-            path = compose_path(f->path, de->d_name);
-            if (lstat(path, &st) == 0) {
+            if (fstatat(f->open_fd, de->d_name, &st,
+                        AT_SYMLINK_NOFOLLOW) == 0) {
                 d_type = st.st_mode >> 12;
             } else {
                 d_type = DT_REG; /* default */
             }
-            free(path);
         }
         if (d_type == DT_DIR)
             type = P9_QTDIR;
@@ -335,7 +464,7 @@ static int fs_readdir(FSDevice *fs, FSFile *f, uint64_t offset,
         pos += 4;
         put_le64(buf + pos, de->d_ino);
         pos += 8;
-        put_le64(buf + pos, offset);
+        put_le64(buf + pos, de->d_off);
         pos += 8;
         buf[pos++] = d_type;
         put_le16(buf + pos, name_len);
@@ -346,6 +475,46 @@ static int fs_readdir(FSDevice *fs, FSFile *f, uint64_t offset,
     return pos;
 }
 
+static void fid_unmap(FSFile *f)
+{
+    if (f->map_ptr) {
+        munmap(f->map_ptr, f->map_size);
+        f->map_ptr = NULL;
+        f->map_size = 0;
+    }
+}
+
+/* map the whole file again if it was written or truncated through
+   this device since the last read */
+static void fid_update_map(FSDevice *fs, FSFile *f)
+{
+    struct stat st;
+    uint64_t gen;
+    void *ptr;
+
+    gen = *fs_ino_gen(fs, f->ino);
+    if (f->map_ptr && f->map_gen == gen)
+        return;
+    f->map_gen = gen;
+    if (fstat(f->open_fd, &st) != 0 ||
+        st.st_size != (size_t)st.st_size) {
+        fid_unmap(f);
+        return;
+    }
+    if (f->map_ptr && f->map_size == st.st_size)
+        return;
+    fid_unmap(f);
+    if (st.st_size == 0)
+        return;
+    ptr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, f->open_fd, 0);
+    if (ptr == MAP_FAILED) {
+        f->can_map = FALSE;
+        return;
+    }
+    f->map_ptr = ptr;
+    f->map_size = st.st_size;
+}
+
 static int fs_read(FSDevice *fs, FSFile *f, uint64_t offset,
                    uint8_t *buf, int count)
 {
@@ -353,7 +522,16 @@ static int fs_read(FSDevice *fs, FSFile *f, uint64_t offset,
 
     if (!f->is_opened || f->is_dir)
         return -P9_EPROTO;
-    ret = pread(f->u.fd, buf, count, offset);
+    if (f->can_map) {
+        fid_update_map(fs, f);
+        /* beyond the mapping, the file may have been extended */
+        if (offset < f->map_size) {
+            ret = min_size(count, f->map_size - offset);
+            memcpy(buf, f->map_ptr + offset, ret);
+            return ret;
+        }
+    }
+    ret = pread(f->open_fd, buf, count, offset);
     if (ret < 0) 
         return -errno_to_p9(errno);
     else
@@ -367,7 +545,8 @@ static int fs_write(FSDevice *fs, FSFile *f, uint64_t offset,
 
     if (!f->is_opened || f->is_dir)
         return -P9_EPROTO;
-    ret = pwrite(f->u.fd, buf, count, offset);
+    fs_ino_modified(fs, f->ino);
+    ret = pwrite(f->open_fd, buf, count, offset);
     if (ret < 0) 
         return -errno_to_p9(errno);
     else
@@ -378,10 +557,13 @@ static void fs_close(FSDevice *fs, FSFile *f)
 {
     if (!f->is_opened)
         return;
-    if (f->is_dir)
-        closedir(f->u.dirp);
-    else
-        close(f->u.fd);
+    close(f->open_fd);
+    fid_unmap(f);
+    f->can_map = FALSE;
+    if (f->is_dir) {
+        free(f->dir_buf);
+        f->dir_buf = NULL;
+    }
     f->is_opened = FALSE;
 }
 
@@ -389,7 +571,7 @@ static int fs_stat(FSDevice *fs, FSFile *f, FSStat *st)
 {
     struct stat st1;
 
-    if (lstat(f->path, &st1) != 0)
+    if (fid_stat(fs, f, &st1) != 0)
         return -P9_ENOENT;
     stat_to_qid(&st->qid, &st1);
     st->st_mode = st1.st_mode;
@@ -415,22 +597,29 @@ static int fs_setattr(FSDevice *fs, FSFile *f, uint32_t mask,
                       uint64_t mtime_sec, uint64_t mtime_nsec)
 {
     BOOL ctime_updated = FALSE;
+    char path[64];
 
+    fs_modified(fs);
+    fd_path(path, sizeof(path), f->fd);
     if (mask & (P9_SETATTR_UID | P9_SETATTR_GID)) {
-        if (lchown(f->path, (mask & P9_SETATTR_UID) ? uid : -1,
-                   (mask & P9_SETATTR_GID) ? gid : -1) < 0)
+        if (fchownat(f->fd, "", (mask & P9_SETATTR_UID) ? uid : -1,
+                     (mask & P9_SETATTR_GID) ? gid : -1,
+                     AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) < 0)
             return -errno_to_p9(errno);
         ctime_updated = TRUE;
     }
     /* must be done after uid change for suid */
     if (mask & P9_SETATTR_MODE) {
-        if (chmod(f->path, mode) < 0)
+        if (chmod(path, mode) < 0)
             return -errno_to_p9(errno);
         ctime_updated = TRUE;
     }
     if (mask & P9_SETATTR_SIZE) {
-        if (truncate(f->path, size) < 0)
+        struct stat st;
+        if (truncate(path, size) < 0)
             return -errno_to_p9(errno);
+        if (fstatat(f->fd, "", &st, AT_EMPTY_PATH) == 0)
+            fs_ino_modified(fs, st.st_ino);
         ctime_updated = TRUE;
     }
     if (mask & (P9_SETATTR_ATIME | P9_SETATTR_MTIME)) {
@@ -459,12 +648,13 @@ static int fs_setattr(FSDevice *fs, FSFile *f, uint32_t mask,
             ts[1].tv_sec = 0;
             ts[1].tv_nsec = UTIME_OMIT;
         }
-        if (utimensat(AT_FDCWD, f->path, ts, AT_SYMLINK_NOFOLLOW) < 0)
+        if (utimensat(AT_FDCWD, path, ts, 0) < 0)
             return -errno_to_p9(errno);
         ctime_updated = TRUE;
     }
     if ((mask & P9_SETATTR_CTIME) && !ctime_updated) {
-        if (lchown(f->path, -1, -1) < 0)
+        if (fchownat(f->fd, "", -1, -1,
+                     AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) < 0)
             return -errno_to_p9(errno);
     }
     return 0;
@@ -472,33 +662,25 @@ static int fs_setattr(FSDevice *fs, FSFile *f, uint32_t mask,
 
 static int fs_link(FSDevice *fs, FSFile *df, FSFile *f, const char *name)
 {
-    char *path;
+    char path[64];
     
-    path = compose_path(df->path, name);
-    if (link(f->path, path) < 0) {
-        free(path);
+    fs_modified(fs);
+    if (linkat(AT_FDCWD, fd_path(path, sizeof(path), f->fd),
+               df->fd, name, AT_SYMLINK_FOLLOW) < 0)
         return -errno_to_p9(errno);
-    }
-    free(path);
     return 0;
 }
 
 static int fs_symlink(FSDevice *fs, FSQID *qid,
                       FSFile *f, const char *name, const char *symgt, uint32_t gid)
 {
-    char *path;
     struct stat st;
     
-    path = compose_path(f->path, name);
-    if (symlink(symgt, path) < 0) {
-        free(path);
+    fs_modified(fs);
+    if (symlinkat(symgt, f->fd, name) < 0)
         return -errno_to_p9(errno);
-    }
-    if (lstat(path, &st) != 0) {
-        free(path);
+    if (fstatat(f->fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
         return -errno_to_p9(errno);
-    }
-    free(path);
     stat_to_qid(qid, &st);
     return 0;
 }
@@ -507,19 +689,13 @@ static int fs_mknod(FSDevice *fs, FSQID *qid,
              FSFile *f, const char *name, uint32_t mode, uint32_t major,
              uint32_t minor, uint32_t gid)
 {
-    char *path;
     struct stat st;
     
-    path = compose_path(f->path, name);
-    if (mknod(path, mode, makedev(major, minor)) < 0) {
-        free(path);
+    fs_modified(fs);
+    if (mknodat(f->fd, name, mode, makedev(major, minor)) < 0)
         return -errno_to_p9(errno);
-    }
-    if (lstat(path, &st) != 0) {
-        free(path);
+    if (fstatat(f->fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
         return -errno_to_p9(errno);
-    }
-    free(path);
     stat_to_qid(qid, &st);
     return 0;
 }
@@ -527,7 +703,7 @@ static int fs_mknod(FSDevice *fs, FSQID *qid,
 static int fs_readlink(FSDevice *fs, char *buf, int buf_size, FSFile *f)
 {
     int ret;
-    ret = readlink(f->path, buf, buf_size - 1);
+    ret = readlinkat(f->fd, "", buf, buf_size - 1);
     if (ret < 0)
         return -errno_to_p9(errno);
     buf[ret] = '\0';
@@ -537,31 +713,23 @@ static int fs_readlink(FSDevice *fs, char *buf, int buf_size, FSFile *f)
 static int fs_renameat(FSDevice *fs, FSFile *f, const char *name, 
                 FSFile *new_f, const char *new_name)
 {
-    char *path, *new_path;
-    int ret;
-
-    path = compose_path(f->path, name);
-    new_path = compose_path(new_f->path, new_name);
-    ret = rename(path, new_path);
-    free(path);
-    free(new_path);
-    if (ret < 0)
+    fs_modified(fs);
+    if (renameat(f->fd, name, new_f->fd, new_name) < 0)
         return -errno_to_p9(errno);
     return 0;
 }
 
 static int fs_unlinkat(FSDevice *fs, FSFile *f, const char *name)
 {
-    char *path;
     int ret;
 
-    path = compose_path(f->path, name);
-    ret = remove(path);
-    free(path);
+    fs_modified(fs);
+    ret = unlinkat(f->fd, name, 0);
+    if (ret < 0 && errno == EISDIR)
+        ret = unlinkat(f->fd, name, AT_REMOVEDIR);
     if (ret < 0)
         return -errno_to_p9(errno);
     return 0;
-    
 }
 
 static int fs_lock(FSDevice *fs, FSFile *f, const FSLock *lock)
@@ -578,7 +746,7 @@ static int fs_lock(FSDevice *fs, FSFile *f, const FSLock *lock)
     fl.l_start = lock->start;
     fl.l_len = lock->length;
     
-    ret = fcntl(f->u.fd, F_SETLK, &fl);
+    ret = fcntl(f->open_fd, F_SETLK, &fl);
     if (ret == 0) {
         ret = P9_LOCK_SUCCESS;
     } else if (errno == EAGAIN || errno == EACCES) {
@@ -603,7 +771,7 @@ static int fs_getlock(FSDevice *fs, FSFile *f, FSLock *lock)
     fl.l_start = lock->start;
     fl.l_len = lock->length;
 
-    ret = fcntl(f->u.fd, F_GETLK, &fl);
+    ret = fcntl(f->open_fd, F_GETLK, &fl);
     if (ret < 0) {
         ret = -errno_to_p9(errno);
     } else {
@@ -620,7 +788,7 @@ static void fs_disk_end(FSDevice *fs1)
     free(fs->root_path);
 }
 
-FSDevice *fs_disk_init(const char *root_path)
+FSDevice *fs_disk_init(const char *root_path, BOOL mmap_read)
 {
     FSDeviceDisk *fs;
     struct stat st;
@@ -655,5 +823,16 @@ FSDevice *fs_disk_init(const char *root_path)
     fs->common.fs_getlock = fs_getlock;
     
     fs->root_path = strdup(root_path);
+    fs->mmap_read = mmap_read;
+
+    /* each fid holds a file descriptor and the guest keeps one fid
+       per cached directory entry */
+    {
+        struct rlimit rl;
+        if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+            rl.rlim_cur = rl.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &rl);
+        }
+    }
     return (FSDevice *)fs;
 }
@@ -59,6 +59,9 @@
 #else
 #define DEFAULT_INODE_CACHE_SIZE (256 * 1024 * 1024)
 #endif
+/* files larger than 1/CACHE_LARGE_FILE_RATIO of the cache size are
+   evicted first if they are not reused */
+#define CACHE_LARGE_FILE_RATIO 8
 
 typedef enum {
     FT_FIFO = 1,
@@ -74,7 +77,8 @@ typedef enum {
     REG_STATE_LOCAL, /* local content */
     REG_STATE_UNLOADED, /* content not loaded */
     REG_STATE_LOADING, /* content is being loaded */
-    REG_STATE_LOADED, /* loaded, not modified, stored in cached_inode_list */
+    REG_STATE_LOADED, /* loaded, not modified, stored in inode_cache_list
+                         when not opened */
 } FSINodeRegStateEnum;
 
 typedef struct FSBaseURL {
@@ -111,6 +115,11 @@ typedef struct FSINode {
             struct list_head link;
             struct FSOpenInfo *open_info; /* used in LOADING state */
             BOOL is_fscmd;
+            int32_t open_file_count; /* number of opened FSFile */
+            /* LOADED state: resident size counted in inode_cache_size */
+            int64_t cache_size;
+            uint32_t access_count; /* number of opens since loaded */
+            BOOL evicted; /* the content was removed from the cache */
 #ifdef DUMP_CACHE_LOAD
             char *filename;
 #endif
@@ -118,6 +127,14 @@ typedef struct FSINode {
         struct {
             struct list_head de_list; /* list of FSDirEntry */
             int size;
+            int count; /* number of entries */
+            /* NULL if less than DIR_HASH_COUNT_MIN entries */
+            struct FSDirEntry **hash_table;
+            int hash_size; /* power of two */
+            /* if not NULL, the entries are loaded from the binary file
+               list on the first access */
+            struct FSFileList *filelist;
+            uint32_t filelist_offset;
         } dir;
         struct {
             uint32_t major;
@@ -129,19 +146,43 @@ typedef struct FSINode {
     } u;
 } FSINode;
 
-typedef struct {
+/* binary file list kept in memory while some directories are not
+   loaded */
+typedef struct FSFileList {
+    FSDevice *fs;
+    uint8_t *buf; /* zero terminated */
+    size_t size;
+} FSFileList;
+
+typedef struct FSDirEntry {
     struct list_head link;
+    struct FSDirEntry *hash_next; /* in the directory hash table */
+    uint32_t hash;
     FSINode *inode;
     uint8_t mark; /* temporary use only */
     char name[0];
 } FSDirEntry;
 
+/* minimum number of entries for a directory to use a hash table */
+#define DIR_HASH_COUNT_MIN 16
+
+/* path lookup cache */
+#define DENTRY_CACHE_SIZE 1024 /* power of two */
+
+typedef struct {
+    char *path; /* NULL if the entry is free */
+    uint32_t hash;
+    uint32_t gen;
+    FSINode *inode;
+} FSDentryCacheEntry;
+
 typedef enum {
     FS_CMD_XHR,
     FS_CMD_PBKDF2,
+    FS_CMD_CACHE_STATS,
 } FSCMDRequestEnum;
 
-#define FS_CMD_REPLY_LEN_MAX 64
+#define FS_CMD_REPLY_LEN_MAX 256
 
 typedef struct {
     FSCMDRequestEnum type;
@@ -183,6 +224,17 @@ typedef struct {
     struct list_head file_list; /* list of PreloadArchiveFile.link */
 } PreloadArchive;
 
+typedef struct {
+    int64_t cache_size; /* resident bytes of the loaded files */
+    int64_t cache_size_limit;
+    uint64_t hit_count; /* opens of an already loaded file */
+    uint64_t load_count; /* files downloaded */
+    uint64_t load_bytes;
+    uint64_t reload_count; /* downloads of a previously evicted file */
+    uint64_t evict_count;
+    uint64_t evict_bytes;
+} FSNetCacheStats;
+
 typedef struct FSDeviceMem {
     FSDevice common;
 
@@ -195,9 +247,16 @@ typedef struct FSDeviceMem {
     int block_size_log2;
     uint32_t block_size; /* for stat/statfs */
     FSINode *root_inode;
-    struct list_head inode_cache_list; /* list of FSINode.u.reg.link */
-    int64_t inode_cache_size;
+    FSFileList *filelist;
+    FSDentryCacheEntry dentry_cache[DENTRY_CACHE_SIZE];
+    /* incremented when a directory entry is removed so that the path
+       lookup cache is invalidated */
+    uint32_t dentry_gen;
+    /* list of FSINode.u.reg.link, most recently used first */
+    struct list_head inode_cache_list;
+    int64_t inode_cache_size; /* resident bytes of the loaded files */
     int64_t inode_cache_size_limit;
+    FSNetCacheStats cache_stats;
     struct list_head preload_list; /* list of PreloadEntry.link */
     struct list_head preload_archive_list; /* list of PreloadArchive.link */
     /* network */
@@ -235,16 +294,22 @@ typedef struct FSOpenInfo {
     FSINode *n;
     DecryptFileState *dec_state;
     size_t cur_pos;
+    BOOL write_error; /* not enough memory: the end of the data is ignored */
 
     struct list_head archive_link; /* FS_OPEN_WGET_ARCHIVE_FILE */
     uint64_t archive_offset;  /* FS_OPEN_WGET_ARCHIVE_FILE */
     struct list_head archive_file_list; /* FS_OPEN_WGET_ARCHIVE */
 
-    /* the following is set in case there is a fs_open callback */
+    /* fs_open() calls waiting for the file */
+    struct list_head waiter_list; /* list of FSOpenWaiter */
+} FSOpenInfo;
+
+typedef struct {
+    struct list_head link;
     FSFile *f;
     FSOpenCompletionFunc *cb;
     void *opaque;
-} FSOpenInfo;
+} FSOpenWaiter;
 
 static void fs_close(FSDevice *fs, FSFile *f);
 static void inode_decref(FSDevice *fs1, FSINode *n);
@@ -262,6 +327,8 @@ static FSBaseURL *fs_net_set_base_url(FSDevice *fs1,
                                       AES_KEY *aes_state);
 static void fs_cmd_close(FSDevice *fs, FSFile *f);
 static void fs_error_archive(FSOpenInfo *oi);
+static void inode_dir_load(FSINode *n);
+static void inode_cache_remove(FSDeviceMem *fs, FSINode *n);
 #ifdef DUMP_CACHE_LOAD
 static void dump_loaded_file(FSDevice *fs1, FSINode *n);
 #endif
@@ -270,42 +337,165 @@ static void dump_loaded_file(FSDevice *fs1, FSINode *n);
 /* file buffer (the content of the buffer can be stored elsewhere) */
 void file_buffer_init(FileBuffer *bs)
 {
-    bs->data = NULL;
+    bs->chunks = NULL;
     bs->allocated_size = 0;
 }
 
+static size_t fbuf_chunk_count(size_t size)
+{
+    return (size + FBUF_CHUNK_SIZE - 1) >> FBUF_CHUNK_BITS;
+}
+
+/* the last chunk is only allocated up to the end of the buffer */
+static size_t fbuf_chunk_len(size_t size, size_t idx)
+{
+    size_t len;
+    len = size - (idx << FBUF_CHUNK_BITS);
+    if (len > FBUF_CHUNK_SIZE)
+        len = FBUF_CHUNK_SIZE;
+    return len;
+}
+
 void file_buffer_reset(FileBuffer *bs)
 {
-    free(bs->data);
+    size_t i, n;
+
+    n = fbuf_chunk_count(bs->allocated_size);
+    for(i = 0; i < n; i++)
+        free(bs->chunks[i]);
+    free(bs->chunks);
     file_buffer_init(bs);
 }
 
 int file_buffer_resize(FileBuffer *bs, size_t new_size)
 {
-    uint8_t *new_data;
-    new_data = realloc(bs->data, new_size);
-    if (!new_data && new_size != 0)
-        return -1;
-    bs->data = new_data;
+    size_t i, n, new_n;
+    uint8_t **new_chunks, *ptr;
+
+    n = fbuf_chunk_count(bs->allocated_size);
+    new_n = fbuf_chunk_count(new_size);
+    /* resize the last chunk which is kept */
+    i = min_size(n, new_n);
+    if (i > 0 && bs->chunks[i - 1]) {
+        ptr = realloc(bs->chunks[i - 1], fbuf_chunk_len(new_size, i - 1));
+        if (!ptr)
+            return -1;
+        bs->chunks[i - 1] = ptr;
+    }
+    if (new_n != n) {
+        for(i = new_n; i < n; i++) {
+            free(bs->chunks[i]);
+            bs->chunks[i] = NULL;
+        }
+        if (new_n == 0) {
+            free(bs->chunks);
+            new_chunks = NULL;
+        } else {
+            new_chunks = realloc(bs->chunks, sizeof(bs->chunks[0]) * new_n);
+            if (!new_chunks)
+                return -1;
+            for(i = n; i < new_n; i++)
+                new_chunks[i] = NULL;
+        }
+        bs->chunks = new_chunks;
+    }
     bs->allocated_size = new_size;
     return 0;
 }
 
-void file_buffer_write(FileBuffer *bs, size_t offset, const uint8_t *buf,
-                       size_t size)
+/* the chunks are allocated on the first write. Return NULL if not
+   enough memory. */
+static uint8_t *fbuf_get_chunk(FileBuffer *bs, size_t idx)
 {
-    memcpy(bs->data + offset, buf, size);
+    uint8_t *ptr;
+    ptr = bs->chunks[idx];
+    if (!ptr) {
+        ptr = calloc(1, fbuf_chunk_len(bs->allocated_size, idx));
+        bs->chunks[idx] = ptr;
+    }
+    return ptr;
 }
 
-void file_buffer_set(FileBuffer *bs, size_t offset, int val, size_t size)
+/* return -1 if not enough memory */
+int file_buffer_write(FileBuffer *bs, size_t offset, const uint8_t *buf,
+                      size_t size)
 {
-    memset(bs->data + offset, val, size);
+    size_t idx, l, pos;
+    uint8_t *ptr;
+
+    while (size > 0) {
+        idx = offset >> FBUF_CHUNK_BITS;
+        pos = offset & (FBUF_CHUNK_SIZE - 1);
+        l = min_size(size, FBUF_CHUNK_SIZE - pos);
+        ptr = fbuf_get_chunk(bs, idx);
+        if (!ptr)
+            return -1;
+        memcpy(ptr + pos, buf, l);
+        offset += l;
+        buf += l;
+        size -= l;
+    }
+    return 0;
+}
+
+/* return -1 if not enough memory */
+int file_buffer_set(FileBuffer *bs, size_t offset, int val, size_t size)
+{
+    size_t idx, l, pos;
+    uint8_t *ptr;
+
+    while (size > 0) {
+        idx = offset >> FBUF_CHUNK_BITS;
+        pos = offset & (FBUF_CHUNK_SIZE - 1);
+        l = min_size(size, FBUF_CHUNK_SIZE - pos);
+        if (val == 0 && pos == 0 &&
+            l == fbuf_chunk_len(bs->allocated_size, idx)) {
+            /* the whole chunk is cleared: release it */
+            free(bs->chunks[idx]);
+            bs->chunks[idx] = NULL;
+        } else if (val != 0 || bs->chunks[idx]) {
+            ptr = fbuf_get_chunk(bs, idx);
+            if (!ptr)
+                return -1;
+            memset(ptr + pos, val, l);
+        }
+        offset += l;
+        size -= l;
+    }
+    return 0;
+}
+
+/* return the size of the allocated chunks */
+size_t file_buffer_get_resident_size(FileBuffer *bs)
+{
+    size_t i, n, size;
+
+    n = fbuf_chunk_count(bs->allocated_size);
+    size = 0;
+    for(i = 0; i < n; i++) {
+        if (bs->chunks[i])
+            size += fbuf_chunk_len(bs->allocated_size, i);
+    }
+    return size;
 }
 
 void file_buffer_read(FileBuffer *bs, size_t offset, uint8_t *buf,
                        size_t size)
 {
-    memcpy(buf, bs->data + offset, size);
+    size_t idx, l, pos;
+
+    while (size > 0) {
+        idx = offset >> FBUF_CHUNK_BITS;
+        pos = offset & (FBUF_CHUNK_SIZE - 1);
+        l = min_size(size, FBUF_CHUNK_SIZE - pos);
+        if (bs->chunks[idx])
+            memcpy(buf, bs->chunks[idx] + pos, l);
+        else
+            memset(buf, 0, l);
+        offset += l;
+        buf += l;
+        size -= l;
+    }
 }
 #endif
 
@@ -343,9 +533,7 @@ static void inode_free(FSDevice *fs1, FSINode *n)
 #endif
         switch(n->u.reg.state)  {
         case REG_STATE_LOADED:
-            list_del(&n->u.reg.link);
-            fs->inode_cache_size -= n->u.reg.size;
-            assert(fs->inode_cache_size >= 0);
+            inode_cache_remove(fs, n);
             fs_base_url_decref(fs1, n->u.reg.base_url);
             break;
         case REG_STATE_LOADING:
@@ -374,6 +562,7 @@ static void inode_free(FSDevice *fs1, FSINode *n)
         break;
     case FT_DIR:
         assert(list_empty(&n->u.dir.de_list));
+        free(n->u.dir.hash_table);
         break;
     default:
         break;
@@ -445,47 +634,109 @@ static FSINode *inode_new(FSDevice *fs1, FSINodeTypeEnum type,
     return n;
 }
 
+static uint32_t name_hash(const char *name, int len)
+{
+    uint32_t h;
+    int i;
+
+    h = 1;
+    for(i = 0; i < len; i++)
+        h = h * 263 + (uint8_t)name[i];
+    return h;
+}
+
+/* rebuild the hash table of a directory with 'hash_size' buckets */
+static void dir_hash_resize(FSINode *n, int hash_size)
+{
+    struct list_head *el;
+    FSDirEntry *de, **tab;
+    int h;
+
+    free(n->u.dir.hash_table);
+    tab = mallocz(sizeof(tab[0]) * hash_size);
+    list_for_each(el, &n->u.dir.de_list) {
+        de = list_entry(el, FSDirEntry, link);
+        h = de->hash & (hash_size - 1);
+        de->hash_next = tab[h];
+        tab[h] = de;
+    }
+    n->u.dir.hash_table = tab;
+    n->u.dir.hash_size = hash_size;
+}
+
 /* warning: the refcount of 'n1' is not incremented by this function */
 /* XXX: test FS max size */
 static FSDirEntry *inode_dir_add(FSDevice *fs1, FSINode *n, const char *name,
                                  FSINode *n1)
 {
     FSDeviceMem *fs = (FSDeviceMem *)fs1;
-    FSDirEntry *de;
+    FSDirEntry *de, **pde;
     int name_len, dirent_size, new_size;
     assert(n->type == FT_DIR);
 
+    inode_dir_load(n);
     name_len = strlen(name);
     de = mallocz(sizeof(*de) + name_len + 1);
     de->inode = n1;
+    de->hash = name_hash(name, name_len);
     memcpy(de->name, name, name_len + 1);
     dirent_size = sizeof(*de) + name_len + 1;
     new_size = n->u.dir.size + dirent_size;
     fs->fs_blocks += to_blocks(fs, new_size) - to_blocks(fs, n->u.dir.size);
     n->u.dir.size = new_size;
+    /* the list keeps the readdir order */
     list_add_tail(&de->link, &n->u.dir.de_list);
+    n->u.dir.count++;
+    if (n->u.dir.hash_table) {
+        if (n->u.dir.count > n->u.dir.hash_size) {
+            dir_hash_resize(n, n->u.dir.hash_size * 2);
+        } else {
+            pde = &n->u.dir.hash_table[de->hash & (n->u.dir.hash_size - 1)];
+            de->hash_next = *pde;
+            *pde = de;
+        }
+    } else if (n->u.dir.count >= DIR_HASH_COUNT_MIN) {
+        dir_hash_resize(n, DIR_HASH_COUNT_MIN * 2);
+    }
     return de;
 }
 
-static FSDirEntry *inode_search(FSINode *n, const char *name)
+static FSDirEntry *inode_search1(FSINode *n, const char *name, int name_len)
 {
     struct list_head *el;
     FSDirEntry *de;
+    uint32_t h;
 
     if (n->type != FT_DIR)
         return NULL;
 
-    list_for_each(el, &n->u.dir.de_list) {
-        de = list_entry(el, FSDirEntry, link);
-        if (!strcmp(de->name, name))
-            return de;
+    inode_dir_load(n);
+    if (n->u.dir.hash_table) {
+        h = name_hash(name, name_len);
+        for(de = n->u.dir.hash_table[h & (n->u.dir.hash_size - 1)];
+            de != NULL; de = de->hash_next) {
+            if (de->hash == h && !memcmp(de->name, name, name_len) &&
+                de->name[name_len] == '\0')
+                return de;
+        }
+    } else {
+        list_for_each(el, &n->u.dir.de_list) {
+            de = list_entry(el, FSDirEntry, link);
+            if (!memcmp(de->name, name, name_len) &&
+                de->name[name_len] == '\0')
+                return de;
+        }
     }
     return NULL;
 }
 
+static FSDirEntry *inode_search(FSINode *n, const char *name)
+{
+    return inode_search1(n, name, strlen(name));
+}
+
 static FSINode *inode_search_path1(FSDevice *fs, FSINode *n, const char *path)
 {
-    char name[1024];
     const char *p, *p1;
     int len;
     FSDirEntry *de;
@@ -503,13 +754,9 @@ static FSINode *inode_search_path1(FSDevice *fs, FSINode *n, const char *path)
             len = p1 - p;
             p1++;
         }
-        if (len > sizeof(name) - 1)
-            return NULL;
-        memcpy(name, p, len);
-        name[len] = '\0';
         if (n->type != FT_DIR)
             return NULL;
-        de = inode_search(n, name);
+        de = inode_search1(n, p, len);
         if (!de)
             return NULL;
         n = de->inode;
@@ -520,12 +767,33 @@ static FSINode *inode_search_path1(FSDevice *fs, FSINode *n, const char *path)
     return n;
 }
 
+/* the path lookups from the root are cached. The inode of a cached
+   path stays valid as long as no directory entry is removed. */
 static FSINode *inode_search_path(FSDevice *fs1, const char *path)
 {
     FSDeviceMem *fs = (FSDeviceMem *)fs1;
+    FSDentryCacheEntry *ce;
+    FSINode *n;
+    uint32_t h;
+    int len;
+
     if (!fs1)
         return NULL;
-    return inode_search_path1(fs1, fs->root_inode, path);
+    len = strlen(path);
+    h = name_hash(path, len);
+    ce = &fs->dentry_cache[h & (DENTRY_CACHE_SIZE - 1)];
+    if (ce->path && ce->hash == h && ce->gen == fs->dentry_gen &&
+        !strcmp(ce->path, path))
+        return ce->inode;
+    n = inode_search_path1(fs1, fs->root_inode, path);
+    if (n) {
+        free(ce->path);
+        ce->path = strdup(path);
+        ce->hash = h;
+        ce->gen = fs->dentry_gen;
+        ce->inode = n;
+    }
+    return n;
 }
 
 static BOOL is_empty_dir(FSDevice *fs, FSINode *n)
@@ -533,6 +801,7 @@ static BOOL is_empty_dir(FSDevice *fs, FSINode *n)
     struct list_head *el;
     FSDirEntry *de;
 
+    inode_dir_load(n);
     list_for_each(el, &n->u.dir.de_list) {
         de = list_entry(el, FSDirEntry, link);
         if (strcmp(de->name, ".") != 0 &&
@@ -545,9 +814,19 @@ static BOOL is_empty_dir(FSDevice *fs, FSINode *n)
 static void inode_dirent_delete_no_decref(FSDevice *fs1, FSINode *n, FSDirEntry *de)
 {
     FSDeviceMem *fs = (FSDeviceMem *)fs1;
+    FSDirEntry **pde;
     int dirent_size, new_size;
     dirent_size = sizeof(*de) + strlen(de->name) + 1;
 
+    if (n->u.dir.hash_table) {
+        pde = &n->u.dir.hash_table[de->hash & (n->u.dir.hash_size - 1)];
+        while (*pde != de)
+            pde = &(*pde)->hash_next;
+        *pde = de->hash_next;
+    }
+    n->u.dir.count--;
+    fs->dentry_gen++;
+
     new_size = n->u.dir.size - dirent_size;
     fs->fs_blocks += to_blocks(fs, new_size) - to_blocks(fs, n->u.dir.size);
     n->u.dir.size = new_size;
@@ -665,8 +944,57 @@ static int fs_mkdir(FSDevice *fs, FSQID *qid, FSFile *f,
     return 0;
 }
 
-/* remove elements in the cache considering that 'added_size' will be
-   added */
+/* Loaded files are kept in inode_cache_list in access order. Opened
+   files are pinned: they are removed from the list until their last
+   close but their content is still counted in inode_cache_size. */
+static void inode_cache_insert(FSDeviceMem *fs, FSINode *n)
+{
+    n->u.reg.cache_size = file_buffer_get_resident_size(&n->u.reg.fbuf);
+    n->u.reg.access_count = 0;
+    fs->inode_cache_size += n->u.reg.cache_size;
+    if (n->u.reg.open_file_count == 0)
+        list_add(&n->u.reg.link, &fs->inode_cache_list);
+}
+
+static void inode_cache_remove(FSDeviceMem *fs, FSINode *n)
+{
+    if (n->u.reg.open_file_count == 0)
+        list_del(&n->u.reg.link);
+    fs->inode_cache_size -= n->u.reg.cache_size;
+    assert(fs->inode_cache_size >= 0);
+}
+
+static void inode_pin(FSDeviceMem *fs, FSINode *n)
+{
+    if (n->type != FT_REG)
+        return;
+    if (n->u.reg.open_file_count++ == 0 &&
+        n->u.reg.state == REG_STATE_LOADED) {
+        list_del(&n->u.reg.link);
+    }
+}
+
+static void inode_unpin(FSDeviceMem *fs, FSINode *n)
+{
+    if (n->type != FT_REG)
+        return;
+    assert(n->u.reg.open_file_count >= 1);
+    if (--n->u.reg.open_file_count == 0 &&
+        n->u.reg.state == REG_STATE_LOADED) {
+        /* a large file which was read only once is evicted first so
+           that it does not push out the frequently used files */
+        if (n->u.reg.access_count <= 1 &&
+            n->u.reg.cache_size > fs->inode_cache_size_limit /
+            CACHE_LARGE_FILE_RATIO) {
+            list_add_tail(&n->u.reg.link, &fs->inode_cache_list);
+        } else {
+            list_add(&n->u.reg.link, &fs->inode_cache_list);
+        }
+    }
+}
+
+/* remove the least recently used files from the cache considering
+   that 'added_size' will be added */
 static void fs_trim_cache(FSDevice *fs1, int64_t added_size)
 {
     FSDeviceMem *fs = (FSDeviceMem *)fs1;
@@ -678,19 +1006,17 @@ static void fs_trim_cache(FSDevice *fs1, int64_t added_size)
     list_for_each_prev_safe(el, el1, &fs->inode_cache_list) {
         n = list_entry(el, FSINode, u.reg.link);
         assert(n->u.reg.state == REG_STATE_LOADED);
-        /* cannot remove open files */
-        //        printf("open_count=%d\n", n->open_count);
-        if (n->open_count != 0)
-            continue;
+        assert(n->u.reg.open_file_count == 0);
 #ifdef DEBUG_CACHE
         printf("fs_trim_cache: remove '%s' size=%ld\n",
-               n->u.reg.filename, (long)n->u.reg.size);
+               n->u.reg.filename, (long)n->u.reg.cache_size);
 #endif
+        fs->cache_stats.evict_count++;
+        fs->cache_stats.evict_bytes += n->u.reg.cache_size;
+        inode_cache_remove(fs, n);
         file_buffer_reset(&n->u.reg.fbuf);
         n->u.reg.state = REG_STATE_UNLOADED;
-        list_del(&n->u.reg.link);
-        fs->inode_cache_size -= n->u.reg.size;
-        assert(fs->inode_cache_size >= 0);
+        n->u.reg.evicted = TRUE;
         if ((fs->inode_cache_size + added_size) <= fs->inode_cache_size_limit)
             break;
     }
@@ -698,6 +1024,11 @@ static void fs_trim_cache(FSDevice *fs1, int64_t added_size)
 
 static void fs_open_end(FSOpenInfo *oi)
 {
+    struct list_head *el, *el1;
+
+    list_for_each_safe(el, el1, &oi->waiter_list) {
+        free(list_entry(el, FSOpenWaiter, link));
+    }
     if (oi->open_type == FS_OPEN_WGET_ARCHIVE_FILE) {
         list_del(&oi->archive_link);
     }
@@ -712,11 +1043,18 @@ static int fs_open_write_cb(void *opaque, const uint8_t *data, size_t size)
     size_t len;
     FSINode *n = oi->n;
 
+    if (oi->write_error)
+        return 0;
     /* we ignore extraneous data */
     len = n->u.reg.size - oi->cur_pos;
     if (size < len)
         len = size;
-    file_buffer_write(&n->u.reg.fbuf, oi->cur_pos, data, len);
+    if (file_buffer_write(&n->u.reg.fbuf, oi->cur_pos, data, len) < 0) {
+        /* the file is incomplete, so an error is reported at the end
+           of the transfer */
+        oi->write_error = TRUE;
+        return 0;
+    }
     oi->cur_pos += len;
     return 0;
 }
@@ -724,22 +1062,24 @@ static int fs_open_write_cb(void *opaque, const uint8_t *data, size_t size)
 static void fs_wget_set_loaded(FSINode *n)
 {
     FSOpenInfo *oi;
+    FSOpenWaiter *w;
     FSDeviceMem *fs;
-    FSFile *f;
     FSQID qid;
+    struct list_head *el;
 
     assert(n->u.reg.state == REG_STATE_LOADING);
     oi = n->u.reg.open_info;
     fs = (FSDeviceMem *)oi->fs;
     n->u.reg.state = REG_STATE_LOADED;
-    list_add(&n->u.reg.link, &fs->inode_cache_list);
-    fs->inode_cache_size += n->u.reg.size;
+    inode_cache_insert(fs, n);
 
-    if (oi->cb) {
-        f = oi->f;
-        f->is_opened = TRUE;
+    list_for_each(el, &oi->waiter_list) {
+        w = list_entry(el, FSOpenWaiter, link);
+        w->f->is_opened = TRUE;
+        inode_pin(fs, n);
+        n->u.reg.access_count++;
         inode_to_qid(&qid, n);
-        oi->cb(oi->fs, &qid, 0, oi->opaque);
+        w->cb(oi->fs, &qid, 0, w->opaque);
     }
     fs_open_end(oi);
 }
@@ -747,12 +1087,15 @@ static void fs_wget_set_loaded(FSINode *n)
 static void fs_wget_set_error(FSINode *n)
 {
     FSOpenInfo *oi;
+    FSOpenWaiter *w;
+    struct list_head *el;
     assert(n->u.reg.state == REG_STATE_LOADING);
     oi = n->u.reg.open_info;
     n->u.reg.state = REG_STATE_UNLOADED;
     file_buffer_reset(&n->u.reg.fbuf);
-    if (oi->cb) {
-        oi->cb(oi->fs, NULL, -P9_EIO, oi->opaque);
+    list_for_each(el, &oi->waiter_list) {
+        w = list_entry(el, FSOpenWaiter, link);
+        w->cb(oi->fs, NULL, -P9_EIO, w->opaque);
     }
     fs_open_end(oi);
 }
@@ -777,11 +1120,15 @@ static void fs_read_archive(FSOpenInfo *oi)
             if (l > sizeof(buf))
                 l = sizeof(buf);
             file_buffer_read(&n->u.reg.fbuf, pos, buf, l);
-            file_buffer_write(&n1->u.reg.fbuf, pos1, buf, l);
+            if (file_buffer_write(&n1->u.reg.fbuf, pos1, buf, l) < 0)
+                break;
             pos += l;
             pos1 += l;
         }
-        fs_wget_set_loaded(n1);
+        if (pos1 < n1->u.reg.size)
+            fs_wget_set_error(n1);
+        else
+            fs_wget_set_loaded(n1);
     }
 }
 
@@ -836,6 +1183,7 @@ static void fs_open_cb(void *opaque, int err, void *data, size_t size)
 
 static int fs_open_wget(FSDevice *fs1, FSINode *n, FSOpenWgetEnum open_type)
 {
+    FSDeviceMem *fs = (FSDeviceMem *)fs1;
     char *url;
     FSOpenInfo *oi;
     char fname[FILEID_SIZE_MAX];
@@ -844,6 +1192,10 @@ static int fs_open_wget(FSDevice *fs1, FSINode *n, FSOpenWgetEnum open_type)
     assert(n->u.reg.state == REG_STATE_UNLOADED);
 
     fs_trim_cache(fs1, n->u.reg.size);
+    fs->cache_stats.load_count++;
+    fs->cache_stats.load_bytes += n->u.reg.size;
+    if (n->u.reg.evicted)
+        fs->cache_stats.reload_count++;
 
     if (file_buffer_resize(&n->u.reg.fbuf, n->u.reg.size) < 0)
         return -P9_EIO;
@@ -853,6 +1205,7 @@ static int fs_open_wget(FSDevice *fs1, FSINode *n, FSOpenWgetEnum open_type)
     oi->fs = fs1;
     oi->n = n;
     oi->open_type = open_type;
+    init_list_head(&oi->waiter_list);
     if (open_type != FS_OPEN_WGET_ARCHIVE_FILE) {
         if (open_type == FS_OPEN_WGET_ARCHIVE)
             init_list_head(&oi->archive_file_list);
@@ -1030,7 +1383,6 @@ static int fs_open(FSDevice *fs1, FSQID *qid, FSFile *f, uint32_t flags,
         switch(n->u.reg.state) {
         case REG_STATE_UNLOADED:
             {
-                FSOpenInfo *oi;
                 /* need to load the file */
                 fs_preload_files(fs1, n->u.reg.file_id);
                 /* The state can be modified by the fs_preload_files */
@@ -1039,34 +1391,28 @@ static int fs_open(FSDevice *fs1, FSQID *qid, FSFile *f, uint32_t flags,
                 ret = fs_open_wget(fs1, n, FS_OPEN_WGET_REG);
                 if (ret)
                     return ret;
-                oi = n->u.reg.open_info;
-                oi->f = f;
-                oi->cb = cb;
-                oi->opaque = opaque;
-                return 1; /* completion callback will be called later */
+                goto handle_loading;
             }
             break;
         case REG_STATE_LOADING:
         handle_loading:
             {
-                FSOpenInfo *oi;
-                /* we only handle the case where the file is being preloaded */
-                oi = n->u.reg.open_info;
-                if (oi->cb)
-                    return -P9_EIO;
-                oi = n->u.reg.open_info;
-                oi->f = f;
-                oi->cb = cb;
-                oi->opaque = opaque;
+                FSOpenWaiter *w;
+                /* the file may be opened several times while it is
+                   loading */
+                w = malloc(sizeof(*w));
+                w->f = f;
+                w->cb = cb;
+                w->opaque = opaque;
+                list_add_tail(&w->link, &n->u.reg.open_info->waiter_list);
                 return 1; /* completion callback will be called later */
             }
             break;
         case REG_STATE_LOCAL:
             goto do_open;
         case REG_STATE_LOADED:
-            /* move to front */
-            list_del(&n->u.reg.link);
-            list_add(&n->u.reg.link, &fs->inode_cache_list);
+            fs->cache_stats.hit_count++;
+            n->u.reg.access_count++;
             goto do_open;
         default:
             abort();
@@ -1074,6 +1420,7 @@ static int fs_open(FSDevice *fs1, FSQID *qid, FSFile *f, uint32_t flags,
     } else {
     do_open:
         f->is_opened = TRUE;
+        inode_pin(fs, n);
         inode_to_qid(qid, n);
         return 0;
     }
@@ -1098,6 +1445,7 @@ static int fs_create(FSDevice *fs, FSQID *qid, FSFile *f, const char *name,
         inode_dec_open(fs, f->inode);
         f->inode = inode_inc_open(fs, n1);
         f->is_opened = TRUE;
+        inode_pin((FSDeviceMem *)fs, n1);
         f->open_flags = flags;
         inode_to_qid(qid, n1);
         return 0;
@@ -1116,6 +1464,7 @@ static int fs_readdir(FSDevice *fs, FSFile *f, uint64_t offset1,
     if (!f->is_opened || n->type != FT_DIR)
         return -P9_EPROTO;
 
+    inode_dir_load(n);
     el = n->u.dir.de_list.next;
     offset = 0;
     while (offset < offset1) {
@@ -1218,7 +1567,8 @@ static int fs_truncate(FSDevice *fs1, FSINode *n, uint64_t size)
                 if (file_buffer_resize(&n->u.reg.fbuf, new_allocated_size) < 0)
                     return -P9_ENOSPC;
             }
-            file_buffer_set(&n->u.reg.fbuf, n->u.reg.size, 0, diff);
+            if (file_buffer_set(&n->u.reg.fbuf, n->u.reg.size, 0, diff) < 0)
+                return -P9_ENOSPC;
         } else {
             new_allocated_size = n->u.reg.fbuf.allocated_size * 4 / 5;
             if (size <= new_allocated_size) {
@@ -1228,9 +1578,7 @@ static int fs_truncate(FSDevice *fs1, FSINode *n, uint64_t size)
         }
         /* file is modified, so it is now local */
         if (n->u.reg.state == REG_STATE_LOADED) {
-            list_del(&n->u.reg.link);
-            fs->inode_cache_size -= n->u.reg.size;
-            assert(fs->inode_cache_size >= 0);
+            inode_cache_remove(fs, n);
             n->u.reg.state = REG_STATE_LOCAL;
         }
         break;
@@ -1271,18 +1619,18 @@ static int fs_write(FSDevice *fs1, FSFile *f, uint64_t offset,
     inode_update_mtime(fs1, n);
     /* file is modified, so it is now local */
     if (n->u.reg.state == REG_STATE_LOADED) {
-        list_del(&n->u.reg.link);
-        fs->inode_cache_size -= n->u.reg.size;
-        assert(fs->inode_cache_size >= 0);
+        inode_cache_remove(fs, n);
         n->u.reg.state = REG_STATE_LOCAL;
     }
-    file_buffer_write(&n->u.reg.fbuf, offset, buf, count);
+    if (file_buffer_write(&n->u.reg.fbuf, offset, buf, count) < 0)
+        return -P9_ENOSPC;
     return count;
 }
 
 static void fs_close(FSDevice *fs, FSFile *f)
 {
     if (f->is_opened) {
+        inode_unpin((FSDeviceMem *)fs, f->inode);
         f->is_opened = FALSE;
     }
     if (f->req)
@@ -1311,6 +1659,7 @@ static int fs_stat(FSDevice *fs1, FSFile *f, FSStat *st)
     } else if (n->type == FT_LNK) {
         st->st_size = strlen(n->u.symlink.name);
     } else if (n->type == FT_DIR) {
+        inode_dir_load(n);
         st->st_size = n->u.dir.size;
     } else {
         st->st_size = 0;
@@ -1503,6 +1852,7 @@ static void fs_mem_end(FSDevice *fs1)
     struct list_head *el, *el1, *el2, *el3;
     FSINode *n;
     FSDirEntry *de;
+    int i;
 
     list_for_each_safe(el, el1, &fs->inode_list) {
         n = list_entry(el, FSINode, link);
@@ -1518,6 +1868,12 @@ static void fs_mem_end(FSDevice *fs1)
         inode_free(fs1, n);
     }
     assert(list_empty(&fs->inode_cache_list));
+    for(i = 0; i < DENTRY_CACHE_SIZE; i++)
+        free(fs->dentry_cache[i].path);
+    if (fs->filelist) {
+        free(fs->filelist->buf);
+        free(fs->filelist);
+    }
     free(fs->import_dir);
 }
 
@@ -1741,6 +2097,8 @@ static void dump_loaded_file(FSDevice *fs1, FSINode *n)
     FSDeviceMem *fs = (FSDeviceMem *)fs1;
     char filename[1024];
     const char *fname, *p;
+    uint8_t buf[4096];
+    size_t pos, l;
 
     if (!fs->dump_cache_load || !n->u.reg.filename)
         return;
@@ -1790,7 +2148,11 @@ static void dump_loaded_file(FSDevice *fs1, FSINode *n)
         fprintf(fs->dump_preload_archive_file, "  %s %" PRId64 " %" PRIx64 "\n",
                 n->u.reg.filename, n->u.reg.size, n->u.reg.file_id);
         fflush(fs->dump_preload_archive_file);
-        fwrite(n->u.reg.fbuf.data, 1, n->u.reg.size, fs->dump_archive_file);
+        for(pos = 0; pos < n->u.reg.size; pos += l) {
+            l = min_size(n->u.reg.size - pos, sizeof(buf));
+            file_buffer_read(&n->u.reg.fbuf, pos, buf, l);
+            fwrite(buf, 1, l, fs->dump_archive_file);
+        }
         fflush(fs->dump_archive_file);
         fs->dump_archive_size += n->u.reg.size;
         if (fs->dump_archive_size >= ARCHIVE_SIZE_MAX) {
@@ -2025,6 +2387,167 @@ static int filelist_load_rec(FSDevice *fs1, const char **pp, FSINode *dir,
     return 0;
 }
 
+static const char *filelist_get_str(FSFileList *fl, uint64_t offset)
+{
+    if (offset >= fl->size)
+        return NULL;
+    return (const char *)fl->buf + offset;
+}
+
+#ifdef DUMP_CACHE_LOAD
+/* path of the directory 'n' relative to the root, rebuilt from the ".."
+   entries */
+static char *inode_dir_get_path(FSDeviceMem *fs, FSINode *n)
+{
+    struct list_head *el;
+    FSDirEntry *de;
+    FSINode *parent;
+    const char *name;
+    char *path, *path1;
+
+    path = strdup("");
+    while (n != fs->root_inode) {
+        de = inode_search(n, "..");
+        if (!de)
+            break;
+        parent = de->inode;
+        name = NULL;
+        list_for_each(el, &parent->u.dir.de_list) {
+            de = list_entry(el, FSDirEntry, link);
+            if (de->inode == n && strcmp(de->name, ".") != 0 &&
+                strcmp(de->name, "..") != 0) {
+                name = de->name;
+                break;
+            }
+        }
+        if (!name)
+            break;
+        if (path[0] == '\0')
+            path1 = strdup(name);
+        else
+            path1 = compose_path(name, path);
+        free(path);
+        path = path1;
+        n = parent;
+    }
+    return path;
+}
+#endif
+
+/* create the inodes of a directory from the binary file list */
+static void inode_dir_load(FSINode *n)
+{
+    FSFileList *fl = n->u.dir.filelist;
+    FSDevice *fs1;
+    FSDeviceMem *fs;
+    FSINodeTypeEnum type;
+    FSINode *n1;
+    const uint8_t *p;
+    const char *name, *lname;
+    uint32_t count, mode, i, offset;
+    uint64_t arg;
+#ifdef DUMP_CACHE_LOAD
+    char *path = NULL;
+#endif
+
+    if (!fl)
+        return;
+    n->u.dir.filelist = NULL;
+    fs1 = fl->fs;
+    fs = (FSDeviceMem *)fs1;
+    offset = n->u.dir.filelist_offset;
+    if ((uint64_t)offset + 4 > fl->size)
+        goto fail;
+    p = fl->buf + offset;
+    count = get_le32(p);
+    p += 4;
+    if ((uint64_t)offset + 4 + (uint64_t)count * FILELIST_ENTRY_SIZE > fl->size)
+        goto fail;
+    for(i = 0; i < count; i++, p += FILELIST_ENTRY_SIZE) {
+        mode = get_le32(p);
+        name = filelist_get_str(fl, get_le32(p + 20));
+        arg = get_le64(p + 24);
+        if (!name)
+            goto fail;
+        type = mode >> 12;
+        n1 = inode_new(fs1, type, mode, get_le32(p + 4), get_le32(p + 8));
+        n1->mtime_sec = get_le32(p + 12);
+        n1->mtime_nsec = get_le32(p + 16);
+        switch(type) {
+        case FT_CHR:
+        case FT_BLK:
+            n1->u.dev.major = arg >> 32;
+            n1->u.dev.minor = arg;
+            break;
+        case FT_REG:
+            if (arg > 0) {
+                fs_net_set_url(fs1, n1, "/", get_le64(p + 32), arg);
+                /* already counted when the file list was loaded */
+                fs->fs_blocks -= to_blocks(fs, arg);
+#ifdef DUMP_CACHE_LOAD
+                if (fs->dump_cache_load
+#ifdef DEBUG_CACHE
+                    || 1
+#endif
+                    ) {
+                    if (!path)
+                        path = inode_dir_get_path(fs, n);
+                    n1->u.reg.filename = compose_path(path, name);
+                }
+#endif
+            }
+            break;
+        case FT_DIR:
+            inode_dir_add(fs1, n1, ".", inode_incref(fs1, n1));
+            inode_dir_add(fs1, n1, "..", inode_incref(fs1, n));
+            n1->u.dir.filelist = fl;
+            n1->u.dir.filelist_offset = arg;
+            break;
+        case FT_LNK:
+            lname = filelist_get_str(fl, arg);
+            n1->u.symlink.name = strdup(lname ? lname : "");
+            break;
+        default:
+            break;
+        }
+        inode_dir_add(fs1, n, name, n1);
+    }
+#ifdef DUMP_CACHE_LOAD
+    free(path);
+#endif
+    return;
+ fail:
+#ifdef DUMP_CACHE_LOAD
+    free(path);
+#endif
+    fprintf(stderr, "invalid binary file list\n");
+}
+
+/* the file list is kept and each directory is loaded when it is first
+   accessed. 'buf' is zero terminated. */
+static int filelist_load_bin(FSDevice *fs1, uint8_t *buf, size_t size)
+{
+    FSDeviceMem *fs = (FSDeviceMem *)fs1;
+    FSFileList *fl;
+
+    if (size < FILELIST_HEADER_SIZE || fs->filelist)
+        return -1;
+    fl = mallocz(sizeof(*fl));
+    fl->fs = fs1;
+    fl->buf = buf;
+    fl->size = size;
+    fs->filelist = fl;
+    fs->root_inode->u.dir.filelist = fl;
+    fs->root_inode->u.dir.filelist_offset = get_le32(buf + 4);
+    fs->fs_blocks += get_le64(buf + 8);
+    return 0;
+}
+
+static BOOL filelist_is_bin(const uint8_t *buf, size_t size)
+{
+    return size >= 4 && get_le32(buf) == FILELIST_MAGIC;
+}
+
 static int filelist_load(FSDevice *fs1, const char *str)
 {
     FSDeviceMem *fs = (FSDeviceMem *)fs1;
@@ -2211,8 +2734,14 @@ static void filelist_loaded(FSDevice *fs, FSFile *f, int64_t size, void *opaque)
     fs->fs_delete(fs, f);
     fs->fs_unlinkat(fs, s->root_fd, ".filelist.txt");
 
-    if (filelist_load(fs, (char *)buf) != 0)
-        fatal_error("error while parsing file list");
+    if (filelist_is_bin(buf, size)) {
+        if (filelist_load_bin(fs, buf, size) != 0)
+            fatal_error("invalid binary file list");
+    } else {
+        if (filelist_load(fs, (char *)buf) != 0)
+            fatal_error("error while parsing file list");
+        free(buf);
+    }
 
     /* try to load the kernel and the preload file */
     s->file_index = 0;
@@ -2778,6 +3307,44 @@ static int fs_cmd_set_import_dir(FSDevice *fs, FSFile *f, const char *p)
     return 0;
 }
 
+/* set the maximum size of the loaded files kept in memory */
+static int fs_cmd_set_cache_size(FSDevice *fs1, const char *p)
+{
+    FSDeviceMem *fs = (FSDeviceMem *)fs1;
+    uint64_t size;
+
+    if (parse_uint64(&size, &p) < 0)
+        return -P9_EINVAL;
+    fs->inode_cache_size_limit = size;
+    fs_trim_cache(fs1, 0);
+    return 0;
+}
+
+static int fs_cmd_cache_stats(FSDevice *fs1, FSFile *f, const char *p)
+{
+    FSDeviceMem *fs = (FSDeviceMem *)fs1;
+    FSNetCacheStats st;
+    FSCMDRequest *req;
+
+    /* a request is already done or in progress */
+    if (f->req != NULL)
+        return -P9_EIO;
+    st = fs->cache_stats;
+    st.cache_size = fs->inode_cache_size;
+    st.cache_size_limit = fs->inode_cache_size_limit;
+    req = mallocz(sizeof(*req));
+    req->type = FS_CMD_CACHE_STATS;
+    req->reply_len = snprintf((char *)req->reply_buf, FS_CMD_REPLY_LEN_MAX,
+                              "%" PRId64 " %" PRId64 " %" PRIu64 " %" PRIu64
+                              " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64
+                              "\n",
+                              st.cache_size, st.cache_size_limit,
+                              st.hit_count, st.load_count, st.load_bytes,
+                              st.reload_count, st.evict_count, st.evict_bytes);
+    f->req = req;
+    return 0;
+}
+
 static int fs_cmd_write(FSDevice *fs, FSFile *f, uint64_t offset,
                         const uint8_t *buf, int buf_len)
 {
@@ -2809,6 +3376,10 @@ static int fs_cmd_write(FSDevice *fs, FSFile *f, uint64_t offset,
         err = fs_cmd_pbkdf2(fs, f, p);
     } else if (!strcmp(cmd, "set_import_dir")) {
         err = fs_cmd_set_import_dir(fs, f, p);
+    } else if (!strcmp(cmd, "set_cache_size")) {
+        err = fs_cmd_set_cache_size(fs, p);
+    } else if (!strcmp(cmd, "cache_stats")) {
+        err = fs_cmd_cache_stats(fs, f, p);
     } else {
         printf("unknown command: '%s'\n", cmd);
     fail:
@@ -26,6 +26,31 @@
 
 #define FILEID_SIZE_MAX 32
 
+/* Binary file list. All the values are little endian and the offsets
+   are relative to the start of the file. The strings are zero
+   terminated.
+
+   header:
+     u32 magic (FILELIST_MAGIC)
+     u32 root directory offset
+     u64 number of FS_BLOCK_SIZE blocks used by the regular files
+   directory:
+     u32 entry count
+     entries (FILELIST_ENTRY_SIZE bytes each):
+       u32 mode (including the file type)
+       u32 uid
+       u32 gid
+       u32 mtime_sec
+       u32 mtime_nsec
+       u32 name offset
+       u64 directory: directory offset, symlink: target offset,
+           device: (major << 32) | minor, regular file: size
+       u64 file ID (regular file)
+*/
+#define FILELIST_MAGIC 0x314c4654 /* "TFL1" */
+#define FILELIST_HEADER_SIZE 16
+#define FILELIST_ENTRY_SIZE 40
+
 #define FS_KEY_LEN 16
 
 /* default block size to determine the total filesytem size */
@@ -106,10 +106,12 @@ static PhysMemoryRange *default_register_ram(PhysMemoryMap *s, uint64_t addr,
 
     pr = register_ram_entry(s, addr, size, devram_flags);
 
-    pr->phys_mem = mallocz(size);
-    if (!pr->phys_mem) {
-        fprintf(stderr, "Could not allocate VM memory\n");
-        exit(1);
+    if (!(devram_flags & DEVRAM_FLAG_NO_ALLOC)) {
+        pr->phys_mem = mallocz(size);
+        if (!pr->phys_mem) {
+            fprintf(stderr, "Could not allocate VM memory\n");
+            exit(1);
+        }
     }
 
     if (devram_flags & DEVRAM_FLAG_DIRTY_BITS) {
@@ -178,7 +180,8 @@ void phys_mem_reset_dirty_bit(PhysMemoryRange *pr, size_t offset)
 
 static void default_free_ram(PhysMemoryMap *s, PhysMemoryRange *pr)
 {
-    free(pr->phys_mem);
+    if (!(pr->devram_flags & DEVRAM_FLAG_NO_ALLOC))
+        free(pr->phys_mem);
 }
 
 PhysMemoryRange *cpu_register_device(PhysMemoryMap *s, uint64_t addr,
@@ -37,6 +37,9 @@
 #include "iomem.h"
 #include "virtio.h"
 #include "machine.h"
+#include "block_cow.h"
+#include "block_lz.h"
+#include "block_readahead.h"
 #include "list.h"
 #include "fbuf.h"
 
@@ -76,23 +79,64 @@ typedef struct BlockDeviceFile {
     FILE *f;
     int64_t nb_sectors;
     BlockDeviceModeEnum mode;
-    uint8_t **sector_table;
+    BlockCOW *cow; /* written data in BF_MODE_SNAPSHOT */
 } BlockDeviceFile;
 
 #define SECTOR_SIZE 512
 
+/* number of decompressed chunks kept in memory for compressed images */
+#define LZ_CACHE_SIZE 16
 
-static void console_write(void *opaque, const uint8_t *buf, int len) {
-  /* printf("writing out \"%.*s\"\n",len,buf); */
-  for ( int i = 0; i < len; i++ )
-  {
-    fprintf(out, "%c",  buf[i]);
-  }
+/* read-ahead window size in sectors and number of windows */
+#define READAHEAD_WINDOW_SIZE 256
+#define READAHEAD_WINDOW_COUNT 4
+
+
+/* the guest output is accumulated and written with a single fwrite()
+   when the buffer is full or at the end of each execution quantum */
+static uint8_t console_out_buf[4096];
+static int console_out_len;
+
+static void console_flush(void)
+{
+    if (console_out_len > 0) {
+        fwrite(console_out_buf, 1, console_out_len, out);
+        console_out_len = 0;
+    }
+}
+
+static void console_write(void *opaque, const uint8_t *buf, int len)
+{
+    int l;
+
+    if (len >= sizeof(console_out_buf)) {
+        console_flush();
+        fwrite(buf, 1, len, out);
+        return;
+    }
+    while (len > 0) {
+        l = min_int(len, sizeof(console_out_buf) - console_out_len);
+        memcpy(console_out_buf + console_out_len, buf, l);
+        console_out_len += l;
+        buf += l;
+        len -= l;
+        if (console_out_len == sizeof(console_out_buf))
+            console_flush();
+    }
 }
 
 static int console_read(void *opaque, uint8_t *buf, int len)
 {
     int out_len, l;
+
+    /* once the guest is idle, the input file is streamed directly to
+       the receive buffers of the guest: it is only read as fast as the
+       guest consumes it */
+    if (console_fifo_count == 0) {
+        if (!global_boot_idle || !in)
+            return 0;
+        return fread(buf, 1, len, in);
+    }
     len = min_int(len, console_fifo_count);
     console_fifo_count -= len;
     out_len = 0;
@@ -131,6 +175,8 @@ static CharacterDevice *console_init(void)
 {
     CharacterDevice *dev;
     console_resize_pending = TRUE;
+    /* the machine may exit() on power off */
+    atexit(console_flush);
     dev = mallocz(sizeof(*dev));
     dev->write_data = console_write;
     dev->read_data = console_read;
@@ -157,6 +203,16 @@ static int64_t bf_get_sector_count(BlockDevice *bs)
     return bf->nb_sectors;
 }
 
+/* read from the disk image, ignoring the snapshot overlay */
+static int bf_read_image(void *opaque, uint64_t sector_num,
+                         uint8_t *buf, int n)
+{
+    BlockDeviceFile *bf = opaque;
+    fseek(bf->f, sector_num * SECTOR_SIZE, SEEK_SET);
+    fread(buf, 1, n * SECTOR_SIZE, bf->f);
+    return 0;
+}
+
 static int bf_read_async(BlockDevice *bs,
                          uint64_t sector_num, uint8_t *buf, int n,
                          BlockDeviceCompletionFunc *cb, void *opaque)
@@ -175,21 +231,10 @@ static int bf_read_async(BlockDevice *bs,
     if (!bf->f)
         return -1;
     if (bf->mode == BF_MODE_SNAPSHOT) {
-        int i;
-        for(i = 0; i < n; i++) {
-            if (!bf->sector_table[sector_num]) {
-                fseek(bf->f, sector_num * SECTOR_SIZE, SEEK_SET);
-                fread(buf, 1, SECTOR_SIZE, bf->f);
-            } else {
-                memcpy(buf, bf->sector_table[sector_num], SECTOR_SIZE);
-            }
-            sector_num++;
-            buf += SECTOR_SIZE;
-        }
+        return block_cow_read(bf->cow, sector_num, buf, n);
     } else {
         /* printf("seek '%n' '%n'\n", sector_num, SECTOR_SIZE); */
-        fseek(bf->f, sector_num * SECTOR_SIZE, SEEK_SET);
-        fread(buf, 1, n * SECTOR_SIZE, bf->f);
+        bf_read_image(bf, sector_num, buf, n);
     }
     /* for(int i = 0; i < n * SECTOR_SIZE; i++) */
     /*    printf("%x", buf[i]); */
@@ -217,20 +262,7 @@ static int bf_write_async(BlockDevice *bs,
         ret = 0;
         break;
     case BF_MODE_SNAPSHOT:
-        {
-            int i;
-            if ((sector_num + n) > bf->nb_sectors)
-                return -1;
-            for(i = 0; i < n; i++) {
-                if (!bf->sector_table[sector_num]) {
-                    bf->sector_table[sector_num] = malloc(SECTOR_SIZE);
-                }
-                memcpy(bf->sector_table[sector_num], buf, SECTOR_SIZE);
-                sector_num++;
-                buf += SECTOR_SIZE;
-            }
-            ret = 0;
-        }
+        ret = block_cow_write(bf->cow, sector_num, buf, n);
         break;
     default:
         abort();
@@ -281,18 +313,33 @@ void vm_start(int ram_size)
     BlockDevice *bs;
     BlockDeviceFile *bf;
     f = fopen("root-riscv64.bin", "r+b");
-    bf = mallocz(sizeof(*bf));
-    bf->mode = BF_MODE_RW;
-    bf->nb_sectors = 4194304 / 512;
-    bf->f = f;
-
-    /* printf("initializing block storage\n"); */
-
-    bs = mallocz(sizeof(*bs));
-    bs->opaque = bf;
-    bs->get_sector_count = bf_get_sector_count;
-    bs->read_async = bf_read_async;
-    bs->write_async = bf_write_async;
+    if (f && block_lz_probe(f)) {
+        /* compressed image (see lzimg): the writes are kept in memory */
+        bs = block_lz_init(f, LZ_CACHE_SIZE);
+        if (!bs) {
+            printf("root-riscv64.bin: invalid compressed image\n");
+            exit(1);
+        }
+    } else {
+        bf = mallocz(sizeof(*bf));
+        bf->mode = BF_MODE_RW;
+        bf->nb_sectors = 4194304 / 512;
+        bf->f = f;
+        if (bf->mode == BF_MODE_SNAPSHOT)
+            bf->cow = block_cow_new(bf->nb_sectors, bf_read_image, bf);
+
+        /* printf("initializing block storage\n"); */
+
+        bs = mallocz(sizeof(*bs));
+        bs->opaque = bf;
+        bs->get_sector_count = bf_get_sector_count;
+        bs->read_async = bf_read_async;
+        bs->write_async = bf_write_async;
+
+        /* group the sequential reads of the image file */
+        bs = block_readahead_init(bs, READAHEAD_WINDOW_SIZE,
+                                  READAHEAD_WINDOW_COUNT);
+    }
     p->tab_drive[0].block_dev = bs;
 
 
@@ -332,13 +379,17 @@ void virt_machine_run(void *opaque)
     int delay, i;
 
     if (m->console_dev && virtio_console_can_write_data(m->console_dev)) {
-        uint8_t buf[128];
+        uint8_t buf[4096];
         int ret, len;
-        len = virtio_console_get_write_len(m->console_dev);
-        len = min_int(len, sizeof(buf));
-        ret = m->console->read_data(m->console->opaque, buf, len);
-        if (ret > 0)
+        /* fill all the available receive buffers */
+        do {
+            len = virtio_console_get_write_len(m->console_dev);
+            len = min_int(len, sizeof(buf));
+            ret = m->console->read_data(m->console->opaque, buf, len);
+            if (ret <= 0)
+                break;
             virtio_console_write_data(m->console_dev, buf, ret);
+        } while (virtio_console_can_write_data(m->console_dev));
         if (console_resize_pending) {
             int w = 80;
             int h = 24;
@@ -356,6 +407,7 @@ void virt_machine_run(void *opaque)
         virt_machine_interp(m, MAX_EXEC_CYCLE);
         i++;
     }
+    console_flush();
 
     /* printf("delay %x\n", delay); */
     if (delay == 0) {
@@ -363,16 +415,8 @@ void virt_machine_run(void *opaque)
         virt_machine_run(m);
     } else {
         /* printf("sleep %n\n", MAX_SLEEP_TIME); */
-      if(!global_boot_idle) {
+        /* start streaming the input file (see console_read()) */
         global_boot_idle = TRUE;
-        /* printf("IDLE\n"); */
-        int c;
-        while ((c = fgetc(in)) != EOF)
-        {
-            console_queue_char(c);
-            /* printf("putting char %c\n", c); */
-        }
-      }
         virt_machine_run(m);
     }
 }
@@ -0,0 +1,180 @@
+/*
+ * LZ77 compression
+ * 
+ * Copyright (c) 2026 The TinyEMU contributors
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "cutils.h"
+#include "lz.h"
+
+#define HASH_BITS 12
+#define HASH_SIZE (1 << HASH_BITS)
+#define MAX_OFFSET 65535
+
+static inline uint32_t lz_hash(const uint8_t *p)
+{
+    return (get_le32(p) * 2654435761U) >> (32 - HASH_BITS);
+}
+
+static uint8_t *put_len(uint8_t *q, int len)
+{
+    while (len >= 255) {
+        *q++ = 255;
+        len -= 255;
+    }
+    *q++ = len;
+    return q;
+}
+
+static uint8_t *put_seq(uint8_t *q, const uint8_t *lit, int lit_len,
+                        int match_len)
+{
+    uint8_t *token = q++;
+    int ml;
+
+    if (lit_len >= 15) {
+        *token = 15 << 4;
+        q = put_len(q, lit_len - 15);
+    } else {
+        *token = lit_len << 4;
+    }
+    memcpy(q, lit, lit_len);
+    q += lit_len;
+    if (match_len != 0) {
+        ml = match_len - LZ_MIN_MATCH;
+        if (ml >= 15) {
+            *token |= 15;
+            q = put_len(q, ml - 15);
+        } else {
+            *token |= ml;
+        }
+    }
+    return q;
+}
+
+/* return the compressed size or -1 if it is larger than dst_size */
+int lz_compress(uint8_t *dst, int dst_size, const uint8_t *src, int src_len)
+{
+    int32_t hash_table[HASH_SIZE];
+    const uint8_t *p, *anchor, *ref, *src_end, *match_end;
+    uint8_t *q, *tmp;
+    int len, h;
+
+    /* the output is first built in a buffer large enough for the worst
+       case */
+    tmp = malloc(LZ_COMPRESS_BOUND(src_len));
+    q = tmp;
+    for(h = 0; h < HASH_SIZE; h++)
+        hash_table[h] = -1;
+    src_end = src + src_len;
+    anchor = src;
+    p = src;
+    while (p + LZ_MIN_MATCH <= src_end) {
+        h = lz_hash(p);
+        ref = hash_table[h] >= 0 ? src + hash_table[h] : NULL;
+        hash_table[h] = p - src;
+        if (!ref || (p - ref) > MAX_OFFSET ||
+            get_le32(ref) != get_le32(p)) {
+            p++;
+            continue;
+        }
+        match_end = p + LZ_MIN_MATCH;
+        ref += LZ_MIN_MATCH;
+        while (match_end < src_end && *match_end == *ref) {
+            match_end++;
+            ref++;
+        }
+        len = match_end - p;
+        q = put_seq(q, anchor, p - anchor, len);
+        *q++ = (match_end - ref) & 0xff;
+        *q++ = (match_end - ref) >> 8;
+        p = match_end;
+        anchor = p;
+    }
+    q = put_seq(q, anchor, src_end - anchor, 0);
+    len = q - tmp;
+    if (len > dst_size) {
+        len = -1;
+    } else {
+        memcpy(dst, tmp, len);
+    }
+    free(tmp);
+    return len;
+}
+
+static int get_len(const uint8_t **pp, const uint8_t *end, int len)
+{
+    const uint8_t *p = *pp;
+    int c;
+    if (len == 15) {
+        do {
+            if (p >= end)
+                return -1;
+            c = *p++;
+            len += c;
+        } while (c == 255);
+    }
+    *pp = p;
+    return len;
+}
+
+/* return the decompressed size or -1 if the data is invalid or does not
+   fit in dst_size bytes */
+int lz_decompress(uint8_t *dst, int dst_size, const uint8_t *src, int src_len)
+{
+    const uint8_t *p, *src_end;
+    uint8_t *q, *dst_end, *ref;
+    int token, len, offset;
+
+    p = src;
+    src_end = src + src_len;
+    q = dst;
+    dst_end = dst + dst_size;
+    while (p < src_end) {
+        token = *p++;
+        len = get_len(&p, src_end, token >> 4);
+        if (len < 0 || len > src_end - p || len > dst_end - q)
+            return -1;
+        memcpy(q, p, len);
+        p += len;
+        q += len;
+        if (p == src_end)
+            break;
+        len = get_len(&p, src_end, token & 15);
+        if (len < 0 || (src_end - p) < 2)
+            return -1;
+        len += LZ_MIN_MATCH;
+        offset = p[0] | (p[1] << 8);
+        p += 2;
+        if (offset == 0 || offset > q - dst || len > dst_end - q)
+            return -1;
+        /* the match may overlap the output */
+        ref = q - offset;
+        while (len-- > 0)
+            *q++ = *ref++;
+    }
+    return q - dst;
+}
@@ -0,0 +1,43 @@
+/*
+ * LZ77 compression
+ * 
+ * Copyright (c) 2026 The TinyEMU contributors
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef LZ_H
+#define LZ_H
+
+/* Simple byte oriented LZ77 codec. A compressed stream is a sequence of
+   tokens: the high nibble is the number of literals which follow and
+   the low nibble the match length minus LZ_MIN_MATCH. A nibble of 15 is
+   extended by bytes added to it until a byte != 255. Each match is
+   followed by a 16 bit little endian offset. The last token only has
+   literals. */
+
+#define LZ_MIN_MATCH 4
+
+/* worst case size of the compressed data */
+#define LZ_COMPRESS_BOUND(n) ((n) + (n) / 255 + 16)
+
+int lz_compress(uint8_t *dst, int dst_size, const uint8_t *src, int src_len);
+int lz_decompress(uint8_t *dst, int dst_size, const uint8_t *src, int src_len);
+
+#endif /* LZ_H */
@@ -0,0 +1,141 @@
+/*
+ * Compressed disk image builder
+ * 
+ * Copyright (c) 2026 The TinyEMU contributors
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "cutils.h"
+#include "virtio.h"
+#include "lz.h"
+#include "block_lz.h"
+
+static BOOL is_zero(const uint8_t *buf, int len)
+{
+    int i;
+    for(i = 0; i < len; i++) {
+        if (buf[i] != 0)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+int main(int argc, char **argv)
+{
+    int chunk_size, len, ret;
+    const char *infilename, *outfilename;
+    FILE *f, *fo;
+    uint8_t *buf, *cbuf, header[BLOCK_LZ_HEADER_SIZE], *index;
+    int64_t image_size, nb_chunks, i;
+    uint64_t pos;
+
+    if ((optind + 1) >= argc) {
+        printf("lzimg version " CONFIG_VERSION ", Copyright (c) 2026 The TinyEMU contributors\n"
+               "usage: lzimg infile outfile [chunksize]\n"
+               "Create a compressed disk image\n"
+               "\n"
+               "chunksize is the size of the independently compressed chunks in KB\n");
+        exit(1);
+    }
+
+    infilename = argv[optind++];
+    outfilename = argv[optind++];
+    chunk_size = BLOCK_LZ_DEFAULT_CHUNK_SIZE / 1024;
+    if (optind < argc)
+        chunk_size = strtol(argv[optind++], NULL, 0);
+    if (chunk_size <= 0 || chunk_size > 16384) {
+        fprintf(stderr, "invalid chunk size\n");
+        exit(1);
+    }
+    chunk_size *= 1024;
+
+    f = fopen(infilename, "rb");
+    if (!f) {
+        perror(infilename);
+        exit(1);
+    }
+    fseeko(f, 0, SEEK_END);
+    image_size = ftello(f);
+    fseeko(f, 0, SEEK_SET);
+    nb_chunks = (image_size + chunk_size - 1) / chunk_size;
+    if (nb_chunks >= UINT32_MAX) {
+        fprintf(stderr, "%s: image too large\n", infilename);
+        exit(1);
+    }
+
+    fo = fopen(outfilename, "wb");
+    if (!fo) {
+        perror(outfilename);
+        exit(1);
+    }
+    memcpy(header, BLOCK_LZ_MAGIC, 8);
+    put_le32(header + 8, chunk_size);
+    put_le32(header + 12, nb_chunks);
+    put_le64(header + 16, image_size);
+    fwrite(header, 1, sizeof(header), fo);
+    /* the index is written once the chunk sizes are known */
+    index = mallocz((nb_chunks + 1) * 8);
+    fwrite(index, 1, (nb_chunks + 1) * 8, fo);
+
+    buf = malloc(chunk_size);
+    cbuf = malloc(chunk_size);
+    pos = sizeof(header) + (nb_chunks + 1) * 8;
+    for(i = 0; i < nb_chunks; i++) {
+        put_le64(index + i * 8, pos);
+        ret = fread(buf, 1, chunk_size, f);
+        if (ret <= 0) {
+            perror("fread");
+            exit(1);
+        }
+        if (ret < chunk_size)
+            memset(buf + ret, 0, chunk_size - ret);
+        if (is_zero(buf, chunk_size)) {
+            len = 0;
+        } else {
+            /* store the chunk if it cannot be compressed */
+            len = lz_compress(cbuf, chunk_size - 1, buf, chunk_size);
+            if (len < 0) {
+                len = chunk_size;
+                fwrite(buf, 1, len, fo);
+            } else {
+                fwrite(cbuf, 1, len, fo);
+            }
+        }
+        pos += len;
+    }
+    put_le64(index + nb_chunks * 8, pos);
+    fclose(f);
+
+    fseeko(fo, sizeof(header), SEEK_SET);
+    fwrite(index, 1, (nb_chunks + 1) * 8, fo);
+    if (fclose(fo) != 0) {
+        perror(outfilename);
+        exit(1);
+    }
+    printf("%" PRId64 " chunks, %" PRId64 " -> %" PRIu64 " bytes\n",
+           nb_chunks, image_size, pos);
+    return 0;
+}
@@ -350,9 +350,32 @@ static int virt_machine_parse_config(VirtMachineParams *p,
             str = buf1;
         }
         p->tab_fs[p->fs_count].tag = strdup(str);
+        el = json_object_get(obj, "mmap");
+        if (!json_is_undefined(el)) {
+            if (el.type != JSON_BOOL) {
+                vm_error("mmap: boolean expected\n");
+                goto tag_fail;
+            }
+            p->tab_fs[p->fs_count].mmap_read = el.u.b;
+        }
         p->fs_count++;
     }
 
+    for(;;) {
+        snprintf(buf1, sizeof(buf1), "pmem%d", p->pmem_count);
+        obj = json_object_get(cfg, buf1);
+        if (json_is_undefined(obj))
+            break;
+        if (p->pmem_count >= MAX_PMEM_DEVICE) {
+            vm_error("Too many persistent memory devices\n");
+            return -1;
+        }
+        if (vm_get_str(obj, "file", &str) < 0)
+            goto tag_fail;
+        p->tab_pmem[p->pmem_count].filename = strdup(str);
+        p->pmem_count++;
+    }
+
     printf("virt_machine_parse_config7\n");
     for(;;) {
         snprintf(buf1, sizeof(buf1), "eth%d", p->eth_count);
@@ -648,6 +671,9 @@ void virt_machine_free_config(VirtMachineParams *p)
         free(p->tab_eth[i].driver);
         free(p->tab_eth[i].ifname);
     }
+    for(i = 0; i < p->pmem_count; i++) {
+        free(p->tab_pmem[i].filename);
+    }
     free(p->input_device);
     free(p->display_device);
     free(p->cfg_filename);
@@ -43,6 +43,9 @@ struct FBDevice {
 #define MAX_DRIVE_DEVICE 4
 #define MAX_FS_DEVICE 4
 #define MAX_ETH_DEVICE 1
+#define MAX_PMEM_DEVICE 4
+/* the size of a persistent memory region must be a multiple of it */
+#define VM_PMEM_ALIGN (2 * 1024 * 1024)
 
 #define VM_CONFIG_VERSION 1
 
@@ -71,6 +74,7 @@ typedef struct {
     char *device;
     char *tag; /* 9p mount tag */
     char *filename;
+    BOOL mmap_read; /* read the regular files through mmap() */
     FSDevice *fs_dev;
 } VMFSEntry;
 
@@ -80,6 +84,12 @@ typedef struct {
     EthernetDevice *net;
 } VMEthEntry;
 
+typedef struct {
+    char *filename;
+    uint8_t *mem; /* host mapping of the file */
+    uint64_t size; /* multiple of VM_PMEM_ALIGN */
+} VMPmemEntry;
+
 typedef struct VirtMachineClass VirtMachineClass;
 
 typedef struct {
@@ -98,6 +108,8 @@ typedef struct {
     int fs_count;
     VMEthEntry tab_eth[MAX_ETH_DEVICE];
     int eth_count;
+    VMPmemEntry tab_pmem[MAX_PMEM_DEVICE];
+    int pmem_count;
 
     char *cmdline; /* bios or kernel command line */
     BOOL accel_enable; /* enable acceleration (KVM) */
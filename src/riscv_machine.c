@@ -74,6 +74,9 @@ typedef struct RISCVMachine {
 #define PLIC_BASE_ADDR 0x40100000
 #define PLIC_SIZE      0x00400000
 #define FRAMEBUFFER_BASE_ADDR 0x41000000
+/* the persistent memory regions are placed after the RAM, aligned
+   for the guest memory hotplug */
+#define PMEM_ALIGN (128 * 1024 * 1024)
 
 #define RTC_FREQ 10000000
 #define RTC_FREQ_DIV 16 /* arbitrary, relative to CPU freq to have a
@@ -136,16 +139,66 @@ static uint32_t htif_read(void *opaque, uint32_t offset,
     return val;
 }
 
+/* return a pointer to 'len' bytes of guest RAM or NULL if they are not
+   in a single RAM range */
+static uint8_t *get_ram_buf(RISCVMachine *s, uint64_t paddr, uint64_t len)
+{
+    PhysMemoryRange *pr = get_phys_mem_range(s->mem_map, paddr);
+    if (!pr || !pr->is_ram || len > pr->size ||
+        paddr - pr->addr > pr->size - len)
+        return NULL;
+    return pr->phys_mem + (uintptr_t)(paddr - pr->addr);
+}
+
+#define HTIF_SYS_WRITE 64
+
+/* front-end system call proxy: 'addr' points to the system call number
+   followed by its arguments (8 64 bit words). Only write() to the
+   console is supported so that a whole string can be output with a
+   single command. */
+static void htif_syscall(RISCVMachine *s, uint64_t addr)
+{
+    uint8_t *magic_mem, *buf;
+    uint64_t fd, len;
+    int64_t ret;
+
+    magic_mem = get_ram_buf(s, addr, 8 * 8);
+    if (!magic_mem) {
+        printf("HTIF: invalid syscall address 0x%016" PRIx64 "\n", addr);
+        return;
+    }
+    ret = -38; /* -ENOSYS */
+    if (get_le64(magic_mem) == HTIF_SYS_WRITE) {
+        fd = get_le64(magic_mem + 8);
+        len = get_le64(magic_mem + 24);
+        buf = get_ram_buf(s, get_le64(magic_mem + 16), len);
+        if (fd != 1 && fd != 2) {
+            ret = -9; /* -EBADF */
+        } else if (!buf || len > INT32_MAX) {
+            ret = -14; /* -EFAULT */
+        } else {
+            s->common.console->write_data(s->common.console->opaque,
+                                          buf, len);
+            ret = len;
+        }
+    }
+    put_le64(magic_mem, ret);
+}
+
 static void htif_handle_cmd(RISCVMachine *s)
 {
     uint32_t device, cmd;
 
     device = s->htif_tohost >> 56;
     cmd = (s->htif_tohost >> 48) & 0xff;
-    if (s->htif_tohost == 1) {
-        /* shuthost */
+    if (device == 0 && cmd == 0 && (s->htif_tohost & 1)) {
+        /* shuthost: (exit_code << 1) | 1 */
         /* printf("\nPower off.\n"); */
-        exit(0);
+        exit((s->htif_tohost & (((uint64_t)1 << 48) - 1)) >> 1);
+    } else if (device == 0 && cmd == 0 && s->htif_tohost != 0) {
+        htif_syscall(s, s->htif_tohost & (((uint64_t)1 << 48) - 1));
+        s->htif_tohost = 0;
+        s->htif_fromhost = 1;
     } else if (device == 1 && cmd == 1) {
         uint8_t buf[1];
         buf[0] = s->htif_tohost & 0xff;
@@ -842,6 +895,7 @@ static VirtMachine *riscv_machine_init(const VirtMachineParams *p)
     VIRTIODevice *blk_dev;
     int irq_num, i, max_xlen, ram_flags;
     VIRTIOBusDef vbus_s, *vbus = &vbus_s;
+    uint64_t pmem_addr;
 
 
     if (!strcmp(p->machine_name, "riscv32")) {
@@ -938,6 +992,28 @@ static VirtMachine *riscv_machine_init(const VirtMachineParams *p)
         s->virtio_count++;
     }
 
+    /* virtio persistent memory: the file is directly mapped in the
+       guest physical address space */
+    pmem_addr = (RAM_BASE_ADDR + p->ram_size + PMEM_ALIGN - 1) &
+        ~(uint64_t)(PMEM_ALIGN - 1);
+    for(i = 0; i < p->pmem_count; i++) {
+        PhysMemoryRange *pr;
+        uint64_t size = p->tab_pmem[i].size;
+        if (max_xlen == 32 && (pmem_addr + size) > ((uint64_t)1 << 32)) {
+            vm_error("pmem%d: no room in the 32 bit address space\n", i);
+            exit(1);
+        }
+        pr = cpu_register_ram(s->mem_map, pmem_addr, size,
+                              DEVRAM_FLAG_NO_ALLOC);
+        pr->phys_mem = p->tab_pmem[i].mem;
+        vbus->irq = &s->plic_irq[irq_num];
+        virtio_pmem_init(vbus, pr);
+        vbus->addr += VIRTIO_SIZE;
+        irq_num++;
+        s->virtio_count++;
+        pmem_addr += (size + PMEM_ALIGN - 1) & ~(uint64_t)(PMEM_ALIGN - 1);
+    }
+
     // DONT display screen
     /* if (p->display_device) { */
     /*     FBDevice *fb_dev; */
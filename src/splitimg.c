@@ -27,25 +27,248 @@
 #include <string.h>
 #include <ctype.h>
 #include <getopt.h>
+#include <unistd.h>
+#include <pthread.h>
 
-int main(int argc, char **argv)
+#include "cutils.h"
+#include "sha256.h"
+#include "lz.h"
+
+#define GROUP_LEN_MAX 32 /* PREFETCH_GROUP_LEN_MAX in block_net.c */
+
+/* return the blocks in the order of their first read in the trace. */
+static int *read_trace(const char *filename, int drive_index,
+                       int blocksize, int n_block, int *pcount)
+{
+    FILE *f;
+    char line[1024];
+    int64_t time_ms;
+    uint64_t sector_num, first_block, last_block, b;
+    int index, n, count;
+    char type;
+    uint8_t *seen;
+    int *tab;
+
+    f = fopen(filename, "rb");
+    if (!f) {
+        perror(filename);
+        exit(1);
+    }
+    seen = calloc(n_block, 1);
+    tab = malloc(sizeof(tab[0]) * n_block);
+    count = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%" SCNd64 " %d %c %" SCNu64 " %d",
+                   &time_ms, &index, &type, &sector_num, &n) != 5) {
+            fprintf(stderr, "%s: invalid line: %s", filename, line);
+            exit(1);
+        }
+        /* the written data is kept locally */
+        if (index != drive_index || type != 'R' || n <= 0)
+            continue;
+        first_block = sector_num * 512 / blocksize;
+        last_block = (sector_num + n) * 512 - 1;
+        last_block /= blocksize;
+        for(b = first_block; b <= last_block && b < n_block; b++) {
+            if (!seen[b]) {
+                seen[b] = 1;
+                tab[count++] = b;
+            }
+        }
+    }
+    fclose(f);
+    free(seen);
+    *pcount = count;
+    return tab;
+}
+
+/* write the groups of 'group_len' blocks in the order of 'tab' */
+static void write_groups(FILE *f, const char *outpath, int blocksize,
+                         const int *tab, int count, int group_len)
 {
-    int blocksize, ret, i;
-    const char *infilename, *outpath;
-    FILE *f, *fo;
     char buf1[1024];
     uint8_t *buf;
+    FILE *fo;
+    int i, j, l;
+
+    buf = malloc(blocksize);
+    for(i = 0; i < count; i += group_len) {
+        l = count - i;
+        if (l > group_len)
+            l = group_len;
+        /* a group of one block is read with the block file */
+        if (l == 1)
+            break;
+        snprintf(buf1, sizeof(buf1), "%s/grp%09u.bin", outpath,
+                 i / group_len);
+        fo = fopen(buf1, "wb");
+        if (!fo) {
+            perror(buf1);
+            exit(1);
+        }
+        for(j = 0; j < l; j++) {
+            memset(buf, 0, blocksize);
+            fseeko(f, (off_t)tab[i + j] * blocksize, SEEK_SET);
+            fread(buf, 1, blocksize, f);
+            fwrite(buf, 1, blocksize, fo);
+        }
+        fclose(fo);
+    }
+    free(buf);
+}
+
+/* number of blocks read at once per thread */
+#define BATCH_BLOCKS 8
+
+typedef struct {
+    uint8_t *buf;
+    uint8_t *cbuf; /* compressed data */
+    unsigned int block_num;
+    BOOL is_zero;
+    uint8_t hash[SHA256_DIGEST_LENGTH];
+} SplitBlock;
+
+typedef struct {
+    SplitBlock *tab;
+    int count;
+    int thread_idx;
+    int thread_count;
+    const char *outpath;
+    int blocksize;
+    BOOL compress;
+} SplitThread;
+
+static BOOL is_zero_buf(const uint8_t *buf, int len)
+{
+    int i;
+    for(i = 0; i < len; i++) {
+        if (buf[i] != 0)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+static void split_block(SplitThread *st, SplitBlock *sb)
+{
+    char buf1[1024];
+    FILE *fo;
+    const uint8_t *data;
+    int len;
 
-    if ((optind + 1) >= argc) {
-        printf("splitimg version " CONFIG_VERSION ", Copyright (c) 2011-2016 Fabrice Bellard\n"
-               "usage: splitimg infile outpath [blocksize]\n"
-               "Create a multi-file disk image for the RISCVEMU HTTP block device\n"
-               "\n"
-               "outpath must be a directory\n"
-               "blocksize is the block size in KB\n");
+    sb->is_zero = is_zero_buf(sb->buf, st->blocksize);
+    if (sb->is_zero) {
+        /* not stored: it is marked with an empty hash in blk.txt */
+        memset(sb->hash, 0, SHA256_DIGEST_LENGTH);
+        return;
+    }
+    SHA256(sb->buf, st->blocksize, sb->hash);
+    data = sb->buf;
+    len = st->blocksize;
+    if (st->compress) {
+        /* stored uncompressed if it is not smaller */
+        len = lz_compress(sb->cbuf, st->blocksize - 1, sb->buf,
+                          st->blocksize);
+        if (len < 0)
+            len = st->blocksize;
+        else
+            data = sb->cbuf;
+    }
+    snprintf(buf1, sizeof(buf1), "%s/blk%09u.bin", st->outpath,
+             sb->block_num);
+    fo = fopen(buf1, "wb");
+    if (!fo) {
+        perror(buf1);
         exit(1);
     }
+    fwrite(data, 1, len, fo);
+    fclose(fo);
+}
+
+static void *split_thread(void *opaque)
+{
+    SplitThread *st = opaque;
+    int i;
+
+    for(i = st->thread_idx; i < st->count; i += st->thread_count)
+        split_block(st, &st->tab[i]);
+    return NULL;
+}
+
+static void help(void)
+{
+    printf("splitimg version " CONFIG_VERSION ", Copyright (c) 2011-2016 Fabrice Bellard\n"
+           "usage: splitimg [options] infile outpath [blocksize]\n"
+           "Create a multi-file disk image for the RISCVEMU HTTP block device\n"
+           "\n"
+           "outpath must be a directory\n"
+           "blocksize is the block size in KB\n"
+           "\n"
+           "Options:\n"
+           "-t trace    build the prefetch groups from the blocks read in the\n"
+           "            trace file (see temu -block-trace), in that order\n"
+           "-d drive    drive index in the trace file (default = 0)\n"
+           "-g len      number of blocks per prefetch group (default = 16)\n"
+           "-j threads  number of threads (default = number of CPUs)\n"
+           "-c          compress the blocks\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int blocksize, ret, i, j, c, drive_index, group_len, prefetch_count;
+    int thread_count, batch_size, count, zero_count;
+    const char *infilename, *outpath, *trace_filename;
+    FILE *f, *fo;
+    char buf1[1024];
+    int *prefetch_tab;
+    BOOL compress, eof;
+    SplitBlock *tab;
+    SplitThread *st_tab;
+    pthread_t *thread_tab;
+    uint8_t (*hash_tab)[SHA256_DIGEST_LENGTH];
+    char hash_str[SHA256_DIGEST_LENGTH * 2 + 1];
 
+    trace_filename = NULL;
+    drive_index = 0;
+    group_len = 16;
+    thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+    compress = FALSE;
+    for(;;) {
+        c = getopt(argc, argv, "ht:d:g:j:c");
+        if (c == -1)
+            break;
+        switch(c) {
+        case 'h':
+            help();
+            break;
+        case 't':
+            trace_filename = optarg;
+            break;
+        case 'd':
+            drive_index = strtol(optarg, NULL, 0);
+            break;
+        case 'g':
+            group_len = strtol(optarg, NULL, 0);
+            if (group_len < 1 || group_len > GROUP_LEN_MAX) {
+                fprintf(stderr, "the group length must be between 1 and %d\n",
+                        GROUP_LEN_MAX);
+                exit(1);
+            }
+            break;
+        case 'j':
+            thread_count = strtol(optarg, NULL, 0);
+            break;
+        case 'c':
+            compress = TRUE;
+            break;
+        default:
+            exit(1);
+        }
+    }
+    thread_count = max_int(thread_count, 1);
+
+    if ((optind + 1) >= argc)
+        help();
     infilename = argv[optind++];
     outpath = argv[optind++];
     blocksize = 256;
@@ -54,7 +277,16 @@ int main(int argc, char **argv)
 
     blocksize *= 1024;
     
-    buf = malloc(blocksize);
+    batch_size = thread_count * BATCH_BLOCKS;
+    tab = mallocz(sizeof(tab[0]) * batch_size);
+    for(j = 0; j < batch_size; j++) {
+        tab[j].buf = malloc(blocksize);
+        if (compress)
+            tab[j].cbuf = malloc(blocksize);
+    }
+    st_tab = mallocz(sizeof(st_tab[0]) * thread_count);
+    thread_tab = malloc(sizeof(thread_tab[0]) * thread_count);
+    hash_tab = NULL;
 
     f = fopen(infilename, "rb");
     if (!f) {
@@ -62,30 +294,70 @@ int main(int argc, char **argv)
         exit(1);
     }
     i = 0;
-    for(;;) {
-        ret = fread(buf, 1, blocksize, f);
-        if (ret < 0) {
-            perror("fread");
-            exit(1);
+    zero_count = 0;
+    eof = FALSE;
+    while (!eof) {
+        /* read a batch of blocks and process them in parallel */
+        for(count = 0; count < batch_size; count++) {
+            ret = fread(tab[count].buf, 1, blocksize, f);
+            if (ret == 0) {
+                if (ferror(f)) {
+                    perror("fread");
+                    exit(1);
+                }
+                eof = TRUE;
+                break;
+            }
+            if (ret < blocksize) {
+                printf("warning: last block is not full\n");
+                memset(tab[count].buf + ret, 0, blocksize - ret);
+            }
+            tab[count].block_num = i + count;
         }
-        if (ret == 0)
+        if (count == 0)
             break;
-        if (ret < blocksize) {
-            printf("warning: last block is not full\n");
-            memset(buf + ret, 0, blocksize - ret);
+        for(j = 0; j < thread_count; j++) {
+            SplitThread *st = &st_tab[j];
+            st->tab = tab;
+            st->count = count;
+            st->thread_idx = j;
+            st->thread_count = thread_count;
+            st->outpath = outpath;
+            st->blocksize = blocksize;
+            st->compress = compress;
+            if (thread_count > 1 &&
+                pthread_create(&thread_tab[j], NULL, split_thread, st) != 0) {
+                fprintf(stderr, "could not create thread\n");
+                exit(1);
+            }
         }
-        snprintf(buf1, sizeof(buf1), "%s/blk%09u.bin", outpath, i);
-        fo = fopen(buf1, "wb");
-        if (!fo) {
-            perror(buf1);
-            exit(1);
+        if (thread_count > 1) {
+            for(j = 0; j < thread_count; j++)
+                pthread_join(thread_tab[j], NULL);
+        } else {
+            split_thread(&st_tab[0]);
         }
-        fwrite(buf, 1, blocksize, fo);
-        fclose(fo);
-        i++;
+
+        hash_tab = realloc(hash_tab, SHA256_DIGEST_LENGTH * (i + count));
+        for(j = 0; j < count; j++) {
+            memcpy(hash_tab[i + j], tab[j].hash, SHA256_DIGEST_LENGTH);
+            if (tab[j].is_zero)
+                zero_count++;
+        }
+        i += count;
+    }
+    printf("%d blocks (%d zero blocks not stored)\n", i, zero_count);
+
+    prefetch_tab = NULL;
+    prefetch_count = 0;
+    if (trace_filename) {
+        prefetch_tab = read_trace(trace_filename, drive_index, blocksize, i,
+                                  &prefetch_count);
+        write_groups(f, outpath, blocksize, prefetch_tab, prefetch_count,
+                     group_len);
+        printf("%d prefetched blocks\n", prefetch_count);
     }
     fclose(f);
-    printf("%d blocks\n", i);
 
     snprintf(buf1, sizeof(buf1), "%s/blk.txt", outpath);
     fo = fopen(buf1, "wb");
@@ -96,6 +368,30 @@ int main(int argc, char **argv)
     fprintf(fo, "{\n");
     fprintf(fo, "  block_size: %d,\n", blocksize / 1024);
     fprintf(fo, "  n_block: %d,\n", i);
+    /* an empty string indicates a zero block */
+    fprintf(fo, "  sha256: [\n");
+    for(j = 0; j < i; j++) {
+        if (is_zero_buf(hash_tab[j], SHA256_DIGEST_LENGTH)) {
+            hash_str[0] = '\0';
+        } else {
+            for(c = 0; c < SHA256_DIGEST_LENGTH; c++)
+                sprintf(hash_str + 2 * c, "%02x", hash_tab[j][c]);
+        }
+        fprintf(fo, "    \"%s\",\n", hash_str);
+    }
+    fprintf(fo, "  ],\n");
+    if (prefetch_count > 0) {
+        fprintf(fo, "  prefetch_group_len: %d,\n", group_len);
+        fprintf(fo, "  prefetch: [");
+        for(j = 0; j < prefetch_count; j++) {
+            if ((j % 16) == 0)
+                fprintf(fo, "\n    ");
+            else
+                fprintf(fo, " ");
+            fprintf(fo, "%d,", prefetch_tab[j]);
+        }
+        fprintf(fo, "\n  ],\n");
+    }
     fprintf(fo, "}\n");
     fclose(fo);
     return 0;
@@ -37,6 +37,7 @@
 #include <sys/ioctl.h>
 #include <net/if.h>
 #include <linux/if_tun.h>
+#include <sys/mman.h>
 #endif
 #include <sys/stat.h>
 #include <signal.h>
@@ -45,6 +46,17 @@
 #include "iomem.h"
 #include "virtio.h"
 #include "machine.h"
+#include "block_cow.h"
+#include "block_lz.h"
+#include "block_cas.h"
+#include "block_readahead.h"
+#include "block_trace.h"
+#ifdef CONFIG_IO_URING
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
 #ifdef CONFIG_SLIRP
 #include "slirp/libslirp.h"
 #endif
@@ -210,11 +222,24 @@ typedef enum {
 
 #define SECTOR_SIZE 512
 
+/* number of chunks kept in memory for compressed and content addressed
+   images */
+#define CHUNK_CACHE_SIZE 16
+
+/* read-ahead window size in sectors and number of windows */
+#define READAHEAD_WINDOW_SIZE 256
+#define READAHEAD_WINDOW_COUNT 4
+
 typedef struct BlockDeviceFile {
     FILE *f;
     int64_t nb_sectors;
     BlockDeviceModeEnum mode;
-    uint8_t **sector_table;
+    BlockCOW *cow; /* written data in BF_MODE_SNAPSHOT */
+    char *cow_filename; /* if not NULL, the overlay is saved there */
+    /* if not NULL, the image is mapped in memory: it is writable only in
+       BF_MODE_RW, otherwise the writes are kept in the overlay */
+    uint8_t *mmap_buf;
+    size_t mmap_size;
 } BlockDeviceFile;
 
 static int64_t bf_get_sector_count(BlockDevice *bs)
@@ -225,6 +250,227 @@ static int64_t bf_get_sector_count(BlockDevice *bs)
 
 //#define DUMP_BLOCK_READ
 
+/* read from the disk image, ignoring the snapshot overlay */
+static int bf_read_image(void *opaque, uint64_t sector_num,
+                         uint8_t *buf, int n)
+{
+    BlockDeviceFile *bf = opaque;
+    if (bf->mmap_buf) {
+        memcpy(buf, bf->mmap_buf + sector_num * SECTOR_SIZE,
+               n * SECTOR_SIZE);
+    } else {
+        fseek(bf->f, sector_num * SECTOR_SIZE, SEEK_SET);
+        fread(buf, 1, n * SECTOR_SIZE, bf->f);
+    }
+    return 0;
+}
+
+#ifdef CONFIG_IO_URING
+
+/* The image accesses which do not involve the snapshot overlay are
+   submitted to an io_uring so that the emulation continues while they
+   are in progress. The completions are signaled with an eventfd which
+   is polled in virt_machine_run(). */
+
+#define BF_RING_SIZE 64
+
+typedef struct {
+    BlockDeviceCompletionFunc *cb;
+    void *opaque;
+    BOOL is_write;
+    int fd;
+    uint64_t offset;
+    struct iovec iov;
+} BFRequest;
+
+typedef struct {
+    int ring_fd;
+    int event_fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+} BFRing;
+
+static BFRing *bf_ring;
+
+static BFRing *bf_ring_new(int entries)
+{
+    BFRing *r;
+    struct io_uring_params p;
+    size_t sq_size, cq_size, sqes_size;
+    uint8_t *sq_ptr, *cq_ptr;
+    void *sqes;
+    int fd, event_fd;
+
+    memset(&p, 0, sizeof(p));
+    fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0)
+        return NULL;
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_size = max_int(sq_size, cq_size);
+        cq_size = sq_size;
+    }
+    cq_ptr = MAP_FAILED;
+    sqes = MAP_FAILED;
+    event_fd = -1;
+    sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED)
+        goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ptr = sq_ptr;
+    } else {
+        cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED)
+            goto fail;
+    }
+    sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+        goto fail;
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd < 0)
+        goto fail;
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_EVENTFD,
+                &event_fd, 1) < 0)
+        goto fail;
+
+    r = mallocz(sizeof(*r));
+    r->ring_fd = fd;
+    r->event_fd = event_fd;
+    r->sq_head = (unsigned *)(sq_ptr + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq_ptr + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq_ptr + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq_ptr + p.sq_off.array);
+    r->sq_entries = p.sq_entries;
+    r->sqes = sqes;
+    r->cq_head = (unsigned *)(cq_ptr + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq_ptr + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq_ptr + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq_ptr + p.cq_off.cqes);
+    return r;
+ fail:
+    if (event_fd >= 0)
+        close(event_fd);
+    if (sqes != MAP_FAILED)
+        munmap(sqes, sqes_size);
+    if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr)
+        munmap(cq_ptr, cq_size);
+    if (sq_ptr != MAP_FAILED)
+        munmap(sq_ptr, sq_size);
+    close(fd);
+    return NULL;
+}
+
+/* return 0 if OK, -1 if the request could not be submitted */
+static int bf_ring_submit(BFRing *r, BFRequest *req)
+{
+    struct io_uring_sqe *sqe;
+    unsigned tail, idx;
+
+    tail = *r->sq_tail;
+    if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >=
+        r->sq_entries)
+        return -1;
+    idx = tail & *r->sq_mask;
+    sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = req->is_write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = req->fd;
+    sqe->off = req->offset;
+    sqe->addr = (uintptr_t)&req->iov;
+    sqe->len = 1;
+    sqe->user_data = (uintptr_t)req;
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    if (syscall(__NR_io_uring_enter, r->ring_fd, 1, 0, 0, NULL, 0) < 0) {
+        /* cancel the submission */
+        __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+        return -1;
+    }
+    return 0;
+}
+
+/* return > 0 if the request is submitted ('cb' is called when it is
+   done) or < 0 if the synchronous path must be used */
+static int bf_ring_rw(BFRing *r, BOOL is_write, int fd, uint64_t offset,
+                      uint8_t *buf, size_t len,
+                      BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    BFRequest *req;
+
+    req = mallocz(sizeof(*req));
+    req->cb = cb;
+    req->opaque = opaque;
+    req->is_write = is_write;
+    req->fd = fd;
+    req->offset = offset;
+    req->iov.iov_base = buf;
+    req->iov.iov_len = len;
+    if (bf_ring_submit(r, req) < 0) {
+        free(req);
+        return -1;
+    }
+    return 1;
+}
+
+static void bf_ring_select_fill(BFRing *r, int *pfd_max, fd_set *rfds)
+{
+    FD_SET(r->event_fd, rfds);
+    *pfd_max = max_int(*pfd_max, r->event_fd);
+}
+
+/* call the completion functions of the finished requests */
+static void bf_ring_poll(BFRing *r, fd_set *rfds)
+{
+    struct io_uring_cqe *cqe;
+    BFRequest *req;
+    unsigned head;
+    uint64_t val;
+    int res;
+
+    if (!FD_ISSET(r->event_fd, rfds))
+        return;
+    read(r->event_fd, &val, sizeof(val));
+    head = *r->cq_head;
+    while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        cqe = &r->cqes[head & *r->cq_mask];
+        req = (BFRequest *)(uintptr_t)cqe->user_data;
+        res = cqe->res;
+        head++;
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+
+        if (res == -EINTR || res == -EAGAIN) {
+            res = 0;
+        } else if (res <= 0) {
+            req->cb(req->opaque, -1);
+            free(req);
+            continue;
+        }
+        if (res < req->iov.iov_len) {
+            /* partial transfer: submit the remaining part */
+            req->offset += res;
+            req->iov.iov_base = (uint8_t *)req->iov.iov_base + res;
+            req->iov.iov_len -= res;
+            if (bf_ring_submit(r, req) < 0) {
+                req->cb(req->opaque, -1);
+                free(req);
+            }
+            continue;
+        }
+        req->cb(req->opaque, 0);
+        free(req);
+    }
+}
+
+#endif /* CONFIG_IO_URING */
+
 static int bf_read_async(BlockDevice *bs,
                          uint64_t sector_num, uint8_t *buf, int n,
                          BlockDeviceCompletionFunc *cb, void *opaque)
@@ -241,21 +487,23 @@ static int bf_read_async(BlockDevice *bs,
 #endif
     if (!bf->f)
         return -1;
+    if ((sector_num + n) > bf->nb_sectors)
+        return -1;
+#ifdef CONFIG_IO_URING
+    if (bf_ring && (bf->mode != BF_MODE_SNAPSHOT ||
+                    !block_cow_is_modified(bf->cow, sector_num, n))) {
+        int ret;
+        ret = bf_ring_rw(bf_ring, FALSE, fileno(bf->f),
+                         sector_num * SECTOR_SIZE, buf, n * SECTOR_SIZE,
+                         cb, opaque);
+        if (ret > 0)
+            return ret;
+    }
+#endif
     if (bf->mode == BF_MODE_SNAPSHOT) {
-        int i;
-        for(i = 0; i < n; i++) {
-            if (!bf->sector_table[sector_num]) {
-                fseek(bf->f, sector_num * SECTOR_SIZE, SEEK_SET);
-                fread(buf, 1, SECTOR_SIZE, bf->f);
-            } else {
-                memcpy(buf, bf->sector_table[sector_num], SECTOR_SIZE);
-            }
-            sector_num++;
-            buf += SECTOR_SIZE;
-        }
+        return block_cow_read(bf->cow, sector_num, buf, n);
     } else {
-        fseek(bf->f, sector_num * SECTOR_SIZE, SEEK_SET);
-        fread(buf, 1, n * SECTOR_SIZE, bf->f);
+        bf_read_image(bf, sector_num, buf, n);
     }
     /* synchronous read */
     return 0;
@@ -273,25 +521,28 @@ static int bf_write_async(BlockDevice *bs,
         ret = -1; /* error */
         break;
     case BF_MODE_RW:
-        fseek(bf->f, sector_num * SECTOR_SIZE, SEEK_SET);
-        fwrite(buf, 1, n * SECTOR_SIZE, bf->f);
+        if ((sector_num + n) > bf->nb_sectors)
+            return -1;
+#ifdef CONFIG_IO_URING
+        if (bf_ring) {
+            ret = bf_ring_rw(bf_ring, TRUE, fileno(bf->f),
+                             sector_num * SECTOR_SIZE, (uint8_t *)buf,
+                             n * SECTOR_SIZE, cb, opaque);
+            if (ret > 0)
+                break;
+        }
+#endif
+        if (bf->mmap_buf) {
+            memcpy(bf->mmap_buf + sector_num * SECTOR_SIZE, buf,
+                   n * SECTOR_SIZE);
+        } else {
+            fseek(bf->f, sector_num * SECTOR_SIZE, SEEK_SET);
+            fwrite(buf, 1, n * SECTOR_SIZE, bf->f);
+        }
         ret = 0;
         break;
     case BF_MODE_SNAPSHOT:
-        {
-            int i;
-            if ((sector_num + n) > bf->nb_sectors)
-                return -1;
-            for(i = 0; i < n; i++) {
-                if (!bf->sector_table[sector_num]) {
-                    bf->sector_table[sector_num] = malloc(SECTOR_SIZE);
-                }
-                memcpy(bf->sector_table[sector_num], buf, SECTOR_SIZE);
-                sector_num++;
-                buf += SECTOR_SIZE;
-            }
-            ret = 0;
-        }
+        ret = block_cow_write(bf->cow, sector_num, buf, n);
         break;
     default:
         abort();
@@ -300,8 +551,50 @@ static int bf_write_async(BlockDevice *bs,
     return ret;
 }
 
+static BlockDeviceFile *bf_overlay_tab[MAX_DRIVE_DEVICE];
+static int bf_overlay_count;
+
+static void bf_save_overlays(void)
+{
+    BlockDeviceFile *bf;
+    int i;
+
+    for(i = 0; i < bf_overlay_count; i++) {
+        bf = bf_overlay_tab[i];
+        if (block_cow_save(bf->cow, bf->cow_filename) < 0)
+            fprintf(stderr, "%s: could not save the overlay\n",
+                    bf->cow_filename);
+    }
+}
+
+/* read-ahead statistics displayed at exit with -block-stats */
+static BOOL block_stats_enabled;
+static BlockDevice *bs_readahead_tab[MAX_DRIVE_DEVICE];
+static char *bs_readahead_filename[MAX_DRIVE_DEVICE];
+static int bs_readahead_count;
+
+static void block_print_stats(void)
+{
+    BlockReadaheadStats st;
+    uint64_t total;
+    int i;
+
+    for(i = 0; i < bs_readahead_count; i++) {
+        block_readahead_get_stats(bs_readahead_tab[i], &st);
+        total = st.hit_count + st.miss_count;
+        fprintf(stderr, "%s: read-ahead hits=%" PRIu64 " misses=%" PRIu64
+                " windows=%" PRIu64 " hit_rate=%0.1f%%\n",
+                bs_readahead_filename[i], st.hit_count, st.miss_count,
+                st.prefetch_count,
+                total ? (double)st.hit_count * 100 / total : 0.0);
+    }
+}
+
+/* in BF_MODE_SNAPSHOT, if 'cow_filename' is not NULL, the overlay is
+   loaded from it if it exists and saved to it at exit */
 static BlockDevice *block_device_init(const char *filename,
-                                      BlockDeviceModeEnum mode)
+                                      BlockDeviceModeEnum mode,
+                                      const char *cow_filename)
 {
     BlockDevice *bs;
     BlockDeviceFile *bf;
@@ -320,6 +613,31 @@ static BlockDevice *block_device_init(const char *filename,
         perror(filename);
         exit(1);
     }
+    if (block_lz_probe(f)) {
+        if (mode == BF_MODE_RW) {
+            fprintf(stderr, "%s: compressed images cannot be written\n",
+                    filename);
+            exit(1);
+        }
+        bs = block_lz_init(f, CHUNK_CACHE_SIZE);
+        if (!bs) {
+            fprintf(stderr, "%s: invalid compressed image\n", filename);
+            exit(1);
+        }
+        return bs;
+    }
+    if (block_cas_probe(f)) {
+        if (mode == BF_MODE_RW) {
+            fprintf(stderr, "%s: content addressed images cannot be written\n",
+                    filename);
+            exit(1);
+        }
+        fclose(f);
+        bs = block_cas_init(filename, CHUNK_CACHE_SIZE);
+        if (!bs)
+            exit(1);
+        return bs;
+    }
     fseek(f, 0, SEEK_END);
     file_size = ftello(f);
 
@@ -331,17 +649,156 @@ static BlockDevice *block_device_init(const char *filename,
     bf->f = f;
 
     if (mode == BF_MODE_SNAPSHOT) {
-        bf->sector_table = mallocz(sizeof(bf->sector_table[0]) *
-                                   bf->nb_sectors);
+        bf->cow = block_cow_new(bf->nb_sectors, bf_read_image, bf);
+        if (cow_filename) {
+            if (access(cow_filename, F_OK) == 0 &&
+                block_cow_load(bf->cow, cow_filename) < 0) {
+                fprintf(stderr, "%s: invalid overlay file\n", cow_filename);
+                exit(1);
+            }
+            bf->cow_filename = strdup(cow_filename);
+            if (bf_overlay_count == 0)
+                atexit(bf_save_overlays);
+            bf_overlay_tab[bf_overlay_count++] = bf;
+        }
     }
 
+#ifdef CONFIG_IO_URING
+    if (!bf_ring)
+        bf_ring = bf_ring_new(BF_RING_SIZE);
+#endif
+#ifndef _WIN32
+    /* map the image to avoid the stdio buffering and a system call per
+       request. The stdio functions are used if it fails. */
+    bf->mmap_size = bf->nb_sectors * SECTOR_SIZE;
+#ifdef CONFIG_IO_URING
+    /* the page faults would stall the emulation */
+    if (bf_ring)
+        bf->mmap_size = 0;
+#endif
+    if (bf->mmap_size != 0) {
+        void *ptr;
+        if (mode == BF_MODE_RW) {
+            ptr = mmap(NULL, bf->mmap_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, fileno(f), 0);
+        } else {
+            ptr = mmap(NULL, bf->mmap_size, PROT_READ, MAP_PRIVATE,
+                       fileno(f), 0);
+        }
+        if (ptr != MAP_FAILED)
+            bf->mmap_buf = ptr;
+    }
+#endif
+
     bs->opaque = bf;
     bs->get_sector_count = bf_get_sector_count;
     bs->read_async = bf_read_async;
     bs->write_async = bf_write_async;
+
+    /* without the mapping, the sequential reads are grouped to reduce
+       the number of system calls */
+    if (!bf->mmap_buf) {
+        bs = block_readahead_init(bs, READAHEAD_WINDOW_SIZE,
+                                  READAHEAD_WINDOW_COUNT);
+        if (block_stats_enabled) {
+            if (bs_readahead_count == 0)
+                atexit(block_print_stats);
+            bs_readahead_tab[bs_readahead_count] = bs;
+            bs_readahead_filename[bs_readahead_count++] = strdup(filename);
+        }
+    }
     return bs;
 }
 
+static int commit_write(void *opaque, uint64_t sector_num,
+                        const uint8_t *buf, int n)
+{
+    FILE *f = opaque;
+    fseeko(f, sector_num * 512, SEEK_SET);
+    if (fwrite(buf, 1, n * 512, f) != n * 512)
+        return -1;
+    return 0;
+}
+
+/* copy the clusters of the overlay 'cow_filename' to the disk image
+   'filename' and delete the overlay */
+static void block_device_commit(const char *filename,
+                                const char *cow_filename)
+{
+    BlockCOW *cow;
+    int64_t nb_sectors;
+    FILE *f;
+
+    if (access(cow_filename, F_OK) != 0)
+        return;
+    f = fopen(filename, "r+b");
+    if (!f) {
+        perror(filename);
+        exit(1);
+    }
+    if (block_lz_probe(f) || block_cas_probe(f)) {
+        fprintf(stderr, "%s: the overlay cannot be committed to this image\n",
+                filename);
+        exit(1);
+    }
+    fseek(f, 0, SEEK_END);
+    nb_sectors = ftello(f) / 512;
+    cow = block_cow_new(nb_sectors, NULL, NULL);
+    if (block_cow_load(cow, cow_filename) < 0) {
+        fprintf(stderr, "%s: invalid overlay file\n", cow_filename);
+        exit(1);
+    }
+    if (block_cow_commit(cow, commit_write, f) < 0 || fclose(f) != 0) {
+        perror(filename);
+        exit(1);
+    }
+    block_cow_free(cow);
+    unlink(cow_filename);
+}
+
+#ifndef _WIN32
+/* Map 'filename' so that it is directly accessed by the guest. The
+   guest writes go to the file only in BF_MODE_RW. The mapping is
+   padded with zeros up to a multiple of VM_PMEM_ALIGN. */
+static void pmem_init(VMPmemEntry *pe, const char *filename,
+                      BlockDeviceModeEnum mode)
+{
+    struct stat st;
+    uint8_t *mem;
+    uint64_t size;
+    void *ptr;
+    int fd;
+
+    fd = open(filename, mode == BF_MODE_RW ? O_RDWR : O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(filename);
+        exit(1);
+    }
+    size = (st.st_size + VM_PMEM_ALIGN - 1) & ~(uint64_t)(VM_PMEM_ALIGN - 1);
+    if (size == 0) {
+        fprintf(stderr, "%s: empty file\n", filename);
+        exit(1);
+    }
+    /* reserve the whole region, then map the file at its start */
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    ptr = mmap(mem, st.st_size, PROT_READ | PROT_WRITE,
+               (mode == BF_MODE_RW ? MAP_SHARED : MAP_PRIVATE) | MAP_FIXED,
+               fd, 0);
+    if (ptr == MAP_FAILED) {
+        perror(filename);
+        exit(1);
+    }
+    close(fd);
+    pe->mem = mem;
+    pe->size = size;
+}
+#endif
+
 #ifndef _WIN32
 
 typedef struct {
@@ -546,12 +1003,20 @@ void virt_machine_run(VirtMachine *m)
     if (m->net) {
         m->net->select_fill(m->net, &fd_max, &rfds, &wfds, &efds, &delay);
     }
+#ifdef CONFIG_IO_URING
+    if (bf_ring)
+        bf_ring_select_fill(bf_ring, &fd_max, &rfds);
+#endif
     tv.tv_sec = delay / 1000;
     tv.tv_usec = (delay % 1000) * 1000;
     ret = select(fd_max + 1, &rfds, &wfds, &efds, &tv);
     if (m->net) {
         m->net->select_poll(m->net, &rfds, &wfds, &efds, ret);
     }
+#ifdef CONFIG_IO_URING
+    if (bf_ring && ret > 0)
+        bf_ring_poll(bf_ring, &rfds);
+#endif
     if (ret > 0) {
     }
 
@@ -568,6 +1033,10 @@ static struct option options[] = {
     { "append", required_argument },
     { "no-accel", no_argument },
     { "build-preload", required_argument },
+    { "overlay", no_argument },
+    { "block-trace", required_argument },
+    { "commit", no_argument },
+    { "block-stats", no_argument },
     { NULL },
 };
 
@@ -578,6 +1047,11 @@ void help(void)
            "options are:\n"
            "-m ram_size       set the RAM size in MB\n"
            "-rw               allow write access to the disk image (default=snapshot)\n"
+           "-overlay          keep the snapshot of each disk image in 'image.cow'\n"
+           "                  (delete it to discard the changes)\n"
+           "-commit           write 'image.cow' to each disk image, delete it and exit\n"
+           "-block-trace file log the disk accesses to 'file' (see splitimg -t)\n"
+           "-block-stats      display the disk read-ahead statistics at exit\n"
            "-ctrlc            the C-c key stops the emulator instead of being sent to the\n"
            "                  emulated software\n"
            "-append cmdline   append cmdline to the kernel command line\n"
@@ -592,19 +1066,24 @@ void help(void)
 int main(int argc, char **argv)
 {
     VirtMachine *s;
-    const char *path, *cmdline, *build_preload_file;
+    const char *path, *cmdline, *build_preload_file, *block_trace_file;
     int c, option_index, i, ram_size, accel_enable;
-    BOOL allow_ctrlc;
+    BOOL allow_ctrlc, use_overlay, commit_overlay;
     BlockDeviceModeEnum drive_mode;
     VirtMachineParams p_s, *p = &p_s;
+    FILE *block_trace_f;
 
     ram_size = -1;
     allow_ctrlc = FALSE;
     (void)allow_ctrlc;
     drive_mode = BF_MODE_SNAPSHOT;
+    use_overlay = FALSE;
+    commit_overlay = FALSE;
     accel_enable = -1;
     cmdline = NULL;
     build_preload_file = NULL;
+    block_trace_file = NULL;
+    block_trace_f = NULL;
     for(;;) {
         c = getopt_long_only(argc, argv, "hm:", options, &option_index);
         if (c == -1)
@@ -630,6 +1109,18 @@ int main(int argc, char **argv)
             case 6: /* build-preload */
                 build_preload_file = optarg;
                 break;
+            case 7: /* overlay */
+                use_overlay = TRUE;
+                break;
+            case 8: /* block-trace */
+                block_trace_file = optarg;
+                break;
+            case 9: /* commit */
+                commit_overlay = TRUE;
+                break;
+            case 10: /* block-stats */
+                block_stats_enabled = TRUE;
+                break;
             default:
                 fprintf(stderr, "unknown option index: %d\n", option_index);
                 exit(1);
@@ -667,16 +1158,38 @@ int main(int argc, char **argv)
     }
 
     /* open the files & devices */
+    if (block_trace_file) {
+        block_trace_f = fopen(block_trace_file, "wb");
+        if (!block_trace_f) {
+            perror(block_trace_file);
+            exit(1);
+        }
+    }
     for(i = 0; i < p->drive_count; i++) {
         BlockDevice *drive;
         char *fname;
         fname = get_file_path(p->cfg_filename, p->tab_drive[i].filename);
         {
-            drive = block_device_init(fname, drive_mode);
+            char *cow_fname = NULL;
+            if (use_overlay || commit_overlay) {
+                cow_fname = malloc(strlen(fname) + 5);
+                sprintf(cow_fname, "%s.cow", fname);
+            }
+            if (commit_overlay)
+                block_device_commit(fname, cow_fname);
+            else
+                drive = block_device_init(fname, drive_mode, cow_fname);
+            free(cow_fname);
         }
         free(fname);
+        if (commit_overlay)
+            continue;
+        if (block_trace_f)
+            drive = block_trace_init(drive, block_trace_f, i);
         p->tab_drive[i].block_dev = drive;
     }
+    if (commit_overlay)
+        exit(0);
 
     for(i = 0; i < p->fs_count; i++) {
         FSDevice *fs;
@@ -689,7 +1202,7 @@ int main(int argc, char **argv)
 #else
             char *fname;
             fname = get_file_path(p->cfg_filename, path);
-            fs = fs_disk_init(fname);
+            fs = fs_disk_init(fname, p->tab_fs[i].mmap_read);
             if (!fs) {
                 fprintf(stderr, "%s: must be a directory\n", fname);
                 exit(1);
@@ -700,6 +1213,18 @@ int main(int argc, char **argv)
         p->tab_fs[i].fs_dev = fs;
     }
 
+    for(i = 0; i < p->pmem_count; i++) {
+#ifdef _WIN32
+        fprintf(stderr, "Persistent memory not supported yet\n");
+        exit(1);
+#else
+        char *fname;
+        fname = get_file_path(p->cfg_filename, p->tab_pmem[i].filename);
+        pmem_init(&p->tab_pmem[i], fname, drive_mode);
+        free(fname);
+#endif
+    }
+
     for(i = 0; i < p->eth_count; i++) {
 #ifdef CONFIG_SLIRP
         if (!strcmp(p->tab_eth[i].driver, "user")) {
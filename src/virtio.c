@@ -27,6 +27,7 @@
 #include <inttypes.h>
 #include <assert.h>
 #include <stdarg.h>
+#include <sys/mman.h>
 
 #include "cutils.h"
 #include "list.h"
@@ -99,16 +100,46 @@ typedef struct {
     uint32_t ready; /* 0 or 1 */
     uint32_t num;
     uint16_t last_avail_idx;
+    uint16_t used_idx; /* next used index (not yet visible to the driver) */
+    uint16_t signalled_used_idx; /* last used index published to the driver */
+    int used_pending; /* number of used buffers not signalled yet */
+    /* the packed ring uses desc_addr for the descriptor ring, avail_addr
+       for the driver event suppression area and used_addr for the
+       device event suppression area */
     virtio_phys_addr_t desc_addr;
     virtio_phys_addr_t avail_addr;
     virtio_phys_addr_t used_addr;
     BOOL manual_recv; /* if TRUE, the device_recv() callback is not called */
+    /* packed ring only */
+    uint8_t avail_wrap_counter;
+    uint8_t used_wrap_counter;
+    /* buffer ID and number of descriptors of the buffer starting at a
+       given ring position */
+    uint16_t buf_id[MAX_QUEUE_NUM];
+    uint16_t buf_desc_count[MAX_QUEUE_NUM];
 } QueueState;
 
 #define VRING_DESC_F_NEXT	1
 #define VRING_DESC_F_WRITE	2
 #define VRING_DESC_F_INDIRECT	4
 
+#define VRING_AVAIL_F_NO_INTERRUPT 1
+#define VRING_USED_F_NO_NOTIFY     1
+
+/* packed ring */
+#define VRING_PACKED_DESC_F_AVAIL (1 << 7)
+#define VRING_PACKED_DESC_F_USED  (1 << 15)
+
+#define VRING_PACKED_EVENT_FLAG_ENABLE  0
+#define VRING_PACKED_EVENT_FLAG_DISABLE 1
+#define VRING_PACKED_EVENT_FLAG_DESC    2
+
+/* feature bits handled by the virtio core */
+#define VIRTIO_RING_F_INDIRECT_DESC 28
+#define VIRTIO_RING_F_EVENT_IDX 29
+#define VIRTIO_F_VERSION_1      32
+#define VIRTIO_F_RING_PACKED    34
+
 typedef struct {
     uint64_t addr;
     uint32_t len;
@@ -116,6 +147,13 @@ typedef struct {
     uint16_t next;
 } VIRTIODesc;
 
+typedef struct {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t id; /* buffer ID */
+    uint16_t flags; /* VRING_DESC_F_x and VRING_PACKED_DESC_F_x */
+} VIRTIOPackedDesc;
+
 /* return < 0 to stop the notification (it must be manually restarted
    later), 0 if OK */
 typedef int VIRTIODeviceRecvFunc(VIRTIODevice *s1, int queue_idx,
@@ -138,8 +176,11 @@ struct VIRTIODevice {
     uint32_t int_status;
     uint32_t status;
     uint32_t device_features_sel;
+    uint32_t driver_features_sel;
+    uint64_t driver_features; /* features accepted by the driver */
     uint32_t queue_sel; /* currently selected queue */
     QueueState queue[MAX_QUEUE];
+    int batch_depth; /* > 0 if the used ring updates are delayed */
 
     /* device specific */
     uint32_t device_id;
@@ -166,7 +207,10 @@ static void virtio_reset(VIRTIODevice *s)
     s->status = 0;
     s->queue_sel = 0;
     s->device_features_sel = 0;
+    s->driver_features_sel = 0;
+    s->driver_features = 0;
     s->int_status = 0;
+    s->batch_depth = 0;
     for(i = 0; i < MAX_QUEUE; i++) {
         QueueState *qs = &s->queue[i];
         qs->ready = 0;
@@ -175,6 +219,50 @@ static void virtio_reset(VIRTIODevice *s)
         qs->avail_addr = 0;
         qs->used_addr = 0;
         qs->last_avail_idx = 0;
+        qs->used_idx = 0;
+        qs->signalled_used_idx = 0;
+        qs->used_pending = 0;
+        qs->avail_wrap_counter = 1;
+        qs->used_wrap_counter = 1;
+    }
+}
+
+static BOOL virtio_has_feature(VIRTIODevice *s, int bit)
+{
+    return (s->driver_features >> bit) & 1;
+}
+
+static uint32_t virtio_get_device_features(VIRTIODevice *s)
+{
+    uint64_t features;
+    features = s->device_features |
+        ((uint64_t)1 << VIRTIO_RING_F_INDIRECT_DESC) |
+        ((uint64_t)1 << VIRTIO_RING_F_EVENT_IDX) |
+        ((uint64_t)1 << VIRTIO_F_VERSION_1) |
+        ((uint64_t)1 << VIRTIO_F_RING_PACKED);
+    switch(s->device_features_sel) {
+    case 0:
+        return features;
+    case 1:
+        return features >> 32;
+    default:
+        return 0;
+    }
+}
+
+static void virtio_set_driver_features(VIRTIODevice *s, uint32_t val)
+{
+    switch(s->driver_features_sel) {
+    case 0:
+        s->driver_features = (s->driver_features & ~(uint64_t)0xffffffff) |
+            val;
+        break;
+    case 1:
+        s->driver_features = (s->driver_features & 0xffffffff) |
+            ((uint64_t)val << 32);
+        break;
+    default:
+        break;
     }
 }
 
@@ -368,37 +456,222 @@ static int virtio_memcpy_to_ram(VIRTIODevice *s, virtio_phys_addr_t addr,
     return 0;
 }
 
+static BOOL virtio_is_packed(VIRTIODevice *s)
+{
+    return virtio_has_feature(s, VIRTIO_F_RING_PACKED);
+}
+
+/* the packed ring state is indexed by ring position, so the size must
+   not exceed MAX_QUEUE_NUM. Only the split ring requires a power of two. */
+static void virtio_set_queue_num(VIRTIODevice *s, uint32_t val)
+{
+    if (val == 0 || val > MAX_QUEUE_NUM)
+        return;
+    if (!virtio_is_packed(s) && (val & (val - 1)) != 0)
+        return;
+    s->queue[s->queue_sel].num = val;
+}
+
 static int get_desc(VIRTIODevice *s, VIRTIODesc *desc,
                     int queue_idx, int desc_idx)
 {
     QueueState *qs = &s->queue[queue_idx];
-    return virtio_memcpy_from_ram(s, (void *)desc, qs->desc_addr +
-                                  desc_idx * sizeof(VIRTIODesc),
-                                  sizeof(VIRTIODesc));
+    if (virtio_is_packed(s)) {
+        VIRTIOPackedDesc pdesc;
+        if (virtio_memcpy_from_ram(s, (void *)&pdesc, qs->desc_addr +
+                                   desc_idx * sizeof(VIRTIOPackedDesc),
+                                   sizeof(VIRTIOPackedDesc)))
+            return -1;
+        /* the descriptors of a chain are contiguous in the ring */
+        desc->addr = pdesc.addr;
+        desc->len = pdesc.len;
+        desc->flags = pdesc.flags & (VRING_DESC_F_NEXT | VRING_DESC_F_WRITE |
+                                     VRING_DESC_F_INDIRECT);
+        desc->next = desc_idx + 1;
+        if (desc->next == qs->num)
+            desc->next = 0;
+        return 0;
+    } else {
+        return virtio_memcpy_from_ram(s, (void *)desc, qs->desc_addr +
+                                      desc_idx * sizeof(VIRTIODesc),
+                                      sizeof(VIRTIODesc));
+    }
+}
+
+/* read descriptor 'idx' of an indirect table */
+static int get_indirect_desc(VIRTIODevice *s, VIRTIODesc *desc,
+                             virtio_phys_addr_t table_addr, int table_len,
+                             int idx)
+{
+    if (virtio_is_packed(s)) {
+        VIRTIOPackedDesc pdesc;
+        if (virtio_memcpy_from_ram(s, (void *)&pdesc, table_addr +
+                                   idx * sizeof(VIRTIOPackedDesc),
+                                   sizeof(VIRTIOPackedDesc)))
+            return -1;
+        /* the table is used in order, without next flags */
+        desc->addr = pdesc.addr;
+        desc->len = pdesc.len;
+        desc->flags = pdesc.flags & (VRING_DESC_F_WRITE |
+                                     VRING_DESC_F_INDIRECT);
+        if (idx + 1 < table_len)
+            desc->flags |= VRING_DESC_F_NEXT;
+        desc->next = idx + 1;
+        return 0;
+    } else {
+        return virtio_memcpy_from_ram(s, (void *)desc, table_addr +
+                                      idx * sizeof(VIRTIODesc),
+                                      sizeof(VIRTIODesc));
+    }
+}
+
+/* iterate over the descriptors of a buffer, following at most one
+   indirect table */
+typedef struct {
+    int queue_idx;
+    virtio_phys_addr_t table_addr; /* 0 if not in an indirect table */
+    int table_len;
+    int count; /* number of visited descriptors, used to detect loops */
+    VIRTIODesc desc; /* current descriptor */
+} VIRTIODescIter;
+
+/* part of a buffer in guest memory */
+typedef struct {
+    uint8_t *ptr;
+    int len;
+} VIRTIOSegment;
+
+static int desc_iter_load(VIRTIODevice *s, VIRTIODescIter *it, int desc_idx)
+{
+    if (it->table_addr != 0) {
+        if (desc_idx >= it->table_len)
+            return -1;
+        if (get_indirect_desc(s, &it->desc, it->table_addr, it->table_len,
+                              desc_idx))
+            return -1;
+        /* nested indirect tables are not allowed */
+        if (it->desc.flags & VRING_DESC_F_INDIRECT)
+            return -1;
+    } else {
+        if (get_desc(s, &it->desc, it->queue_idx, desc_idx))
+            return -1;
+        if (it->desc.flags & VRING_DESC_F_INDIRECT) {
+            if (it->desc.flags & VRING_DESC_F_NEXT)
+                return -1;
+            it->table_addr = it->desc.addr;
+            it->table_len = it->desc.len / sizeof(VIRTIODesc);
+            it->count = 0;
+            return desc_iter_load(s, it, 0);
+        }
+    }
+    return 0;
+}
+
+static int desc_iter_init(VIRTIODevice *s, VIRTIODescIter *it,
+                          int queue_idx, int desc_idx)
+{
+    it->queue_idx = queue_idx;
+    it->table_addr = 0;
+    it->table_len = 0;
+    it->count = 0;
+    return desc_iter_load(s, it, desc_idx);
+}
+
+/* return -1 if there is no next descriptor or if the chain is invalid */
+static int desc_iter_next(VIRTIODevice *s, VIRTIODescIter *it)
+{
+    int max_count;
+
+    if (!(it->desc.flags & VRING_DESC_F_NEXT))
+        return -1;
+    if (it->table_addr != 0)
+        max_count = it->table_len;
+    else
+        max_count = s->queue[it->queue_idx].num;
+    if (++it->count >= max_count)
+        return -1;
+    return desc_iter_load(s, it, it->desc.next);
+}
+
+/* return the index of the first descriptor of the next available
+   buffer or -1 if there is none */
+static int virtio_queue_get_avail(VIRTIODevice *s, int queue_idx)
+{
+    QueueState *qs = &s->queue[queue_idx];
+    int desc_idx, count;
+    uint16_t flags, avail_idx;
+    virtio_phys_addr_t addr;
+
+    if (virtio_is_packed(s)) {
+        desc_idx = qs->last_avail_idx;
+        addr = qs->desc_addr + desc_idx * sizeof(VIRTIOPackedDesc);
+        flags = virtio_read16(s, addr + 14);
+        if (((flags & VRING_PACKED_DESC_F_AVAIL) != 0) !=
+            qs->avail_wrap_counter ||
+            ((flags & VRING_PACKED_DESC_F_USED) != 0) ==
+            qs->avail_wrap_counter)
+            return -1;
+        /* find the buffer ID stored in the last descriptor of the
+           chain */
+        count = 1;
+        while ((flags & VRING_DESC_F_NEXT) && count < qs->num) {
+            if (++desc_idx == qs->num)
+                desc_idx = 0;
+            addr = qs->desc_addr + desc_idx * sizeof(VIRTIOPackedDesc);
+            flags = virtio_read16(s, addr + 14);
+            count++;
+        }
+        qs->buf_id[qs->last_avail_idx] = virtio_read16(s, addr + 12);
+        qs->buf_desc_count[qs->last_avail_idx] = count;
+        return qs->last_avail_idx;
+    } else {
+        avail_idx = virtio_read16(s, qs->avail_addr + 2);
+        if (qs->last_avail_idx == avail_idx)
+            return -1;
+        return virtio_read16(s, qs->avail_addr + 4 +
+                             (qs->last_avail_idx & (qs->num - 1)) * 2);
+    }
+}
+
+/* skip the buffer returned by virtio_queue_get_avail() */
+static void virtio_queue_next_avail(VIRTIODevice *s, int queue_idx)
+{
+    QueueState *qs = &s->queue[queue_idx];
+    int idx;
+
+    if (virtio_is_packed(s)) {
+        idx = qs->last_avail_idx + qs->buf_desc_count[qs->last_avail_idx];
+        if (idx >= qs->num) {
+            idx -= qs->num;
+            qs->avail_wrap_counter ^= 1;
+        }
+        qs->last_avail_idx = idx;
+    } else {
+        qs->last_avail_idx++;
+    }
 }
 
 static int memcpy_to_from_queue(VIRTIODevice *s, uint8_t *buf,
                                 int queue_idx, int desc_idx,
                                 int offset, int count, BOOL to_queue)
 {
-    VIRTIODesc desc;
+    VIRTIODescIter it;
     int l, f_write_flag;
 
     if (count == 0)
         return 0;
 
-    get_desc(s, &desc, queue_idx, desc_idx);
+    if (desc_iter_init(s, &it, queue_idx, desc_idx))
+        return -1;
 
     if (to_queue) {
         f_write_flag = VRING_DESC_F_WRITE;
         /* find the first write descriptor */
         for(;;) {
-            if ((desc.flags & VRING_DESC_F_WRITE) == f_write_flag)
+            if ((it.desc.flags & VRING_DESC_F_WRITE) == f_write_flag)
                 break;
-            if (!(desc.flags & VRING_DESC_F_NEXT))
+            if (desc_iter_next(s, &it))
                 return -1;
-            desc_idx = desc.next;
-            get_desc(s, &desc, queue_idx, desc_idx);
         }
     } else {
         f_write_flag = 0;
@@ -406,34 +679,30 @@ static int memcpy_to_from_queue(VIRTIODevice *s, uint8_t *buf,
 
     /* find the descriptor at offset */
     for(;;) {
-        if ((desc.flags & VRING_DESC_F_WRITE) != f_write_flag)
+        if ((it.desc.flags & VRING_DESC_F_WRITE) != f_write_flag)
             return -1;
-        if (offset < desc.len)
+        if (offset < it.desc.len)
             break;
-        if (!(desc.flags & VRING_DESC_F_NEXT))
+        offset -= it.desc.len;
+        if (desc_iter_next(s, &it))
             return -1;
-        desc_idx = desc.next;
-        offset -= desc.len;
-        get_desc(s, &desc, queue_idx, desc_idx);
     }
 
     for(;;) {
-        l = min_int(count, desc.len - offset);
+        l = min_int(count, it.desc.len - offset);
         if (to_queue)
-            virtio_memcpy_to_ram(s, desc.addr + offset, buf, l);
+            virtio_memcpy_to_ram(s, it.desc.addr + offset, buf, l);
         else
-            virtio_memcpy_from_ram(s, buf, desc.addr + offset, l);
+            virtio_memcpy_from_ram(s, buf, it.desc.addr + offset, l);
         count -= l;
         if (count == 0)
             break;
         offset += l;
         buf += l;
-        if (offset == desc.len) {
-            if (!(desc.flags & VRING_DESC_F_NEXT))
+        if (offset == it.desc.len) {
+            if (desc_iter_next(s, &it))
                 return -1;
-            desc_idx = desc.next;
-            get_desc(s, &desc, queue_idx, desc_idx);
-            if ((desc.flags & VRING_DESC_F_WRITE) != f_write_flag)
+            if ((it.desc.flags & VRING_DESC_F_WRITE) != f_write_flag)
                 return -1;
             offset = 0;
         }
@@ -457,55 +726,230 @@ static int memcpy_to_queue(VIRTIODevice *s,
                                 count, TRUE);
 }
 
+/* Get the guest memory segments of 'count' bytes at 'offset' in the
+   read ('to_queue' = FALSE) or write part of a buffer so that they can
+   be accessed directly. Contiguous pages are merged. Return the number
+   of segments or -1 if there are more than 'tab_size' segments. */
+static int get_queue_segments(VIRTIODevice *s, VIRTIOSegment *tab,
+                              int tab_size, int queue_idx, int desc_idx,
+                              int offset, int count, BOOL to_queue)
+{
+    VIRTIODescIter it;
+    virtio_phys_addr_t addr;
+    uint8_t *ptr;
+    int l, len, f_write_flag, n;
+
+    if (count == 0)
+        return 0;
+
+    if (desc_iter_init(s, &it, queue_idx, desc_idx))
+        return -1;
+
+    if (to_queue) {
+        f_write_flag = VRING_DESC_F_WRITE;
+        /* find the first write descriptor */
+        for(;;) {
+            if ((it.desc.flags & VRING_DESC_F_WRITE) == f_write_flag)
+                break;
+            if (desc_iter_next(s, &it))
+                return -1;
+        }
+    } else {
+        f_write_flag = 0;
+    }
+
+    /* find the descriptor at offset */
+    for(;;) {
+        if ((it.desc.flags & VRING_DESC_F_WRITE) != f_write_flag)
+            return -1;
+        if (offset < it.desc.len)
+            break;
+        offset -= it.desc.len;
+        if (desc_iter_next(s, &it))
+            return -1;
+    }
+
+    n = 0;
+    for(;;) {
+        len = min_int(count, it.desc.len - offset);
+        addr = it.desc.addr + offset;
+        count -= len;
+        while (len > 0) {
+            l = min_int(len, VIRTIO_PAGE_SIZE -
+                        (addr & (VIRTIO_PAGE_SIZE - 1)));
+            ptr = s->get_ram_ptr(s, addr, to_queue);
+            if (!ptr)
+                return -1;
+            if (n > 0 && tab[n - 1].ptr + tab[n - 1].len == ptr) {
+                tab[n - 1].len += l;
+            } else {
+                if (n >= tab_size)
+                    return -1;
+                tab[n].ptr = ptr;
+                tab[n].len = l;
+                n++;
+            }
+            addr += l;
+            len -= l;
+        }
+        if (count == 0)
+            break;
+        if (desc_iter_next(s, &it))
+            return -1;
+        if ((it.desc.flags & VRING_DESC_F_WRITE) != f_write_flag)
+            return -1;
+        offset = 0;
+    }
+    return n;
+}
+
+/* return TRUE if 'event_idx' is in the range ]old_idx, new_idx] */
+static inline BOOL vring_need_event(uint16_t event_idx, uint16_t new_idx,
+                                    uint16_t old_idx)
+{
+    return (uint16_t)(new_idx - event_idx - 1) < (uint16_t)(new_idx - old_idx);
+}
+
+/* make the pending used entries visible to the driver. Return TRUE if
+   it asked to be interrupted. */
+static BOOL virtio_publish_used(VIRTIODevice *s, int queue_idx)
+{
+    QueueState *qs = &s->queue[queue_idx];
+    uint16_t old_idx, new_idx;
+
+    if (qs->used_pending == 0)
+        return FALSE;
+    qs->used_pending = 0;
+    old_idx = qs->signalled_used_idx;
+    new_idx = qs->used_idx;
+    qs->signalled_used_idx = new_idx;
+    if (virtio_is_packed(s)) {
+        uint16_t off_wrap, flags;
+        int off;
+        /* the used descriptors are already visible: only check the
+           driver event suppression structure */
+        off_wrap = virtio_read16(s, qs->avail_addr);
+        flags = virtio_read16(s, qs->avail_addr + 2);
+        if (flags == VRING_PACKED_EVENT_FLAG_DISABLE)
+            return FALSE;
+        if (flags != VRING_PACKED_EVENT_FLAG_DESC ||
+            !virtio_has_feature(s, VIRTIO_RING_F_EVENT_IDX))
+            return TRUE;
+        off = off_wrap & 0x7fff;
+        if ((off_wrap >> 15) != qs->used_wrap_counter)
+            off -= qs->num;
+        return vring_need_event(off, new_idx, old_idx);
+    }
+    virtio_write16(s, qs->used_addr + 2, new_idx);
+    if (virtio_has_feature(s, VIRTIO_RING_F_EVENT_IDX)) {
+        /* used_event is stored after the avail ring */
+        return vring_need_event(virtio_read16(s, qs->avail_addr + 4 +
+                                              qs->num * 2),
+                                new_idx, old_idx);
+    } else {
+        return !(virtio_read16(s, qs->avail_addr) &
+                 VRING_AVAIL_F_NO_INTERRUPT);
+    }
+}
+
+/* publish the used entries of all the queues and raise a single
+   interrupt if needed */
+static void virtio_flush_used(VIRTIODevice *s)
+{
+    BOOL need_irq;
+    int i;
+
+    need_irq = FALSE;
+    for(i = 0; i < MAX_QUEUE; i++) {
+        if (virtio_publish_used(s, i))
+            need_irq = TRUE;
+    }
+    if (need_irq) {
+        s->int_status |= 1;
+        set_irq(s->irq, 1);
+    }
+}
+
+/* the completions done between virtio_batch_begin() and
+   virtio_batch_end() are signalled with at most one interrupt */
+static void virtio_batch_begin(VIRTIODevice *s)
+{
+    s->batch_depth++;
+}
+
+static void virtio_batch_end(VIRTIODevice *s)
+{
+    assert(s->batch_depth > 0);
+    if (--s->batch_depth == 0)
+        virtio_flush_used(s);
+}
+
 /* signal that the descriptor has been consumed */
 static void virtio_consume_desc(VIRTIODevice *s,
                                 int queue_idx, int desc_idx, int desc_len)
 {
     QueueState *qs = &s->queue[queue_idx];
     virtio_phys_addr_t addr;
-    uint32_t index;
-
-    addr = qs->used_addr + 2;
-    index = virtio_read16(s, addr);
-    virtio_write16(s, addr, index + 1);
-
-    addr = qs->used_addr + 4 + (index & (qs->num - 1)) * 8;
-    virtio_write32(s, addr, desc_idx);
-    virtio_write32(s, addr + 4, desc_len);
+    int idx;
+
+    if (virtio_is_packed(s)) {
+        /* the used descriptor overwrites the first descriptor of the
+           oldest available buffer and it is skipped with its whole
+           chain by the driver */
+        addr = qs->desc_addr + qs->used_idx * sizeof(VIRTIOPackedDesc);
+        virtio_write32(s, addr + 8, desc_len);
+        virtio_write16(s, addr + 12, qs->buf_id[desc_idx]);
+        virtio_write16(s, addr + 14, qs->used_wrap_counter ?
+                       (VRING_PACKED_DESC_F_AVAIL | VRING_PACKED_DESC_F_USED) :
+                       0);
+        idx = qs->used_idx + qs->buf_desc_count[desc_idx];
+        if (idx >= qs->num) {
+            idx -= qs->num;
+            qs->used_wrap_counter ^= 1;
+        }
+        qs->used_idx = idx;
+    } else {
+        addr = qs->used_addr + 4 + (qs->used_idx & (qs->num - 1)) * 8;
+        virtio_write32(s, addr, desc_idx);
+        virtio_write32(s, addr + 4, desc_len);
+        qs->used_idx++;
+    }
+    qs->used_pending++;
 
-    s->int_status |= 1;
-    set_irq(s->irq, 1);
+    if (s->batch_depth == 0)
+        virtio_flush_used(s);
 }
 
 static int get_desc_rw_size(VIRTIODevice *s,
                              int *pread_size, int *pwrite_size,
                              int queue_idx, int desc_idx)
 {
-    VIRTIODesc desc;
+    VIRTIODescIter it;
     int read_size, write_size;
 
     read_size = 0;
     write_size = 0;
-    get_desc(s, &desc, queue_idx, desc_idx);
+    if (desc_iter_init(s, &it, queue_idx, desc_idx))
+        return -1;
 
     for(;;) {
-        if (desc.flags & VRING_DESC_F_WRITE)
+        if (it.desc.flags & VRING_DESC_F_WRITE)
             break;
-        read_size += desc.len;
-        if (!(desc.flags & VRING_DESC_F_NEXT))
+        read_size += it.desc.len;
+        if (!(it.desc.flags & VRING_DESC_F_NEXT))
             goto done;
-        desc_idx = desc.next;
-        get_desc(s, &desc, queue_idx, desc_idx);
+        if (desc_iter_next(s, &it))
+            return -1;
     }
 
     for(;;) {
-        if (!(desc.flags & VRING_DESC_F_WRITE))
+        if (!(it.desc.flags & VRING_DESC_F_WRITE))
             return -1;
-        write_size += desc.len;
-        if (!(desc.flags & VRING_DESC_F_NEXT))
+        write_size += it.desc.len;
+        if (!(it.desc.flags & VRING_DESC_F_NEXT))
             break;
-        desc_idx = desc.next;
-        get_desc(s, &desc, queue_idx, desc_idx);
+        if (desc_iter_next(s, &it))
+            return -1;
     }
 
  done:
@@ -518,16 +962,28 @@ static int get_desc_rw_size(VIRTIODevice *s,
 static void queue_notify(VIRTIODevice *s, int queue_idx)
 {
     QueueState *qs = &s->queue[queue_idx];
-    uint16_t avail_idx;
     int desc_idx, read_size, write_size;
-
-    if (qs->manual_recv)
+    BOOL event_idx;
+
+    event_idx = virtio_has_feature(s, VIRTIO_RING_F_EVENT_IDX);
+    if (qs->manual_recv) {
+        /* the device polls the queue, so the driver does not need to
+           notify it. With VIRTIO_RING_F_EVENT_IDX, avail_event is
+           never advanced for the same effect. */
+        if (virtio_is_packed(s)) {
+            virtio_write16(s, qs->used_addr + 2,
+                           VRING_PACKED_EVENT_FLAG_DISABLE);
+        } else if (!event_idx) {
+            virtio_write16(s, qs->used_addr, VRING_USED_F_NO_NOTIFY);
+        }
         return;
+    }
 
-    avail_idx = virtio_read16(s, qs->avail_addr + 2);
-    while (qs->last_avail_idx != avail_idx) {
-        desc_idx = virtio_read16(s, qs->avail_addr + 4 +
-                                 (qs->last_avail_idx & (qs->num - 1)) * 2);
+    virtio_batch_begin(s);
+    for(;;) {
+        desc_idx = virtio_queue_get_avail(s, queue_idx);
+        if (desc_idx < 0)
+            break;
         if (!get_desc_rw_size(s, &read_size, &write_size, queue_idx, desc_idx)) {
 #ifdef DEBUG_VIRTIO
             if (s->debug & VIRTIO_DEBUG_IO) {
@@ -536,11 +992,30 @@ static void queue_notify(VIRTIODevice *s, int queue_idx)
             }
 #endif
             if (s->device_recv(s, queue_idx, desc_idx,
-                               read_size, write_size) < 0)
-                break;
+                               read_size, write_size) < 0) {
+                /* the device is busy: it rescans the queue when the
+                   pending request completes, so no notification is
+                   needed until then */
+                goto done;
+            }
+        }
+        virtio_queue_next_avail(s, queue_idx);
+    }
+    if (event_idx) {
+        /* only notify the device for buffers added after this point */
+        if (virtio_is_packed(s)) {
+            virtio_write16(s, qs->used_addr, qs->last_avail_idx |
+                           (qs->avail_wrap_counter << 15));
+            virtio_write16(s, qs->used_addr + 2,
+                           VRING_PACKED_EVENT_FLAG_DESC);
+        } else {
+            /* avail_event is stored after the used ring */
+            virtio_write16(s, qs->used_addr + 4 + qs->num * 8,
+                           qs->last_avail_idx);
         }
-        qs->last_avail_idx++;
     }
+ done:
+    virtio_batch_end(s);
 }
 
 static uint32_t virtio_config_read(VIRTIODevice *s, uint32_t offset,
@@ -627,17 +1102,7 @@ static uint32_t virtio_mmio_read(void *opaque, uint32_t offset, int size_log2)
             val = s->vendor_id;
             break;
         case VIRTIO_MMIO_DEVICE_FEATURES:
-            switch(s->device_features_sel) {
-            case 0:
-                val = s->device_features;
-                break;
-            case 1:
-                val = 1; /* version 1 */
-                break;
-            default:
-                val = 0;
-                break;
-            }
+            val = virtio_get_device_features(s);
             break;
         case VIRTIO_MMIO_DEVICE_FEATURES_SEL:
             val = s->device_features_sel;
@@ -738,14 +1203,18 @@ static void virtio_mmio_write(void *opaque, uint32_t offset,
         case VIRTIO_MMIO_DEVICE_FEATURES_SEL:
             s->device_features_sel = val;
             break;
+        case VIRTIO_MMIO_DRIVER_FEATURES:
+            virtio_set_driver_features(s, val);
+            break;
+        case VIRTIO_MMIO_DRIVER_FEATURES_SEL:
+            s->driver_features_sel = val;
+            break;
         case VIRTIO_MMIO_QUEUE_SEL:
             if (val < MAX_QUEUE)
                 s->queue_sel = val;
             break;
         case VIRTIO_MMIO_QUEUE_NUM:
-            if ((val & (val - 1)) == 0 && val > 0) {
-                s->queue[s->queue_sel].num = val;
-            }
+            virtio_set_queue_num(s, val);
             break;
         case VIRTIO_MMIO_QUEUE_DESC_LOW:
             set_low32(&s->queue[s->queue_sel].desc_addr, val);
@@ -804,21 +1273,14 @@ static uint32_t virtio_pci_read(void *opaque, uint32_t offset1, int size_log2)
         if (size_log2 == 2) {
             switch(offset) {
             case VIRTIO_PCI_DEVICE_FEATURE:
-                switch(s->device_features_sel) {
-                case 0:
-                    val = s->device_features;
-                    break;
-                case 1:
-                    val = 1; /* version 1 */
-                    break;
-                default:
-                    val = 0;
-                    break;
-                }
+                val = virtio_get_device_features(s);
                 break;
             case VIRTIO_PCI_DEVICE_FEATURE_SEL:
                 val = s->device_features_sel;
                 break;
+            case VIRTIO_PCI_GUEST_FEATURE_SEL:
+                val = s->driver_features_sel;
+                break;
             case VIRTIO_PCI_QUEUE_DESC_LOW:
                 val = s->queue[s->queue_sel].desc_addr;
                 break;
@@ -906,6 +1368,12 @@ static void virtio_pci_write(void *opaque, uint32_t offset1,
             case VIRTIO_PCI_DEVICE_FEATURE_SEL:
                 s->device_features_sel = val;
                 break;
+            case VIRTIO_PCI_GUEST_FEATURE_SEL:
+                s->driver_features_sel = val;
+                break;
+            case VIRTIO_PCI_GUEST_FEATURE:
+                virtio_set_driver_features(s, val);
+                break;
             case VIRTIO_PCI_QUEUE_DESC_LOW:
                 set_low32(&s->queue[s->queue_sel].desc_addr, val);
                 break;
@@ -934,9 +1402,7 @@ static void virtio_pci_write(void *opaque, uint32_t offset1,
                     s->queue_sel = val;
                 break;
             case VIRTIO_PCI_QUEUE_SIZE:
-                if ((val & (val - 1)) == 0 && val > 0) {
-                    s->queue[s->queue_sel].num = val;
-                }
+                virtio_set_queue_num(s, val);
                 break;
             case VIRTIO_PCI_QUEUE_ENABLE:
                 s->queue[s->queue_sel].ready = val & 1;
@@ -1035,6 +1501,7 @@ static void virtio_block_req_end(VIRTIODevice *s, int ret)
         virtio_consume_desc(s, queue_idx, desc_idx, write_size);
         break;
     case VIRTIO_BLK_T_OUT:
+        free(s1->req.buf);
         if (ret < 0)
             buf1[0] = VIRTIO_BLK_S_IOERR;
         else
@@ -1052,12 +1519,15 @@ static void virtio_block_req_cb(void *opaque, int ret)
     VIRTIODevice *s = opaque;
     VIRTIOBlockDevice *s1 = (VIRTIOBlockDevice *)s;
 
+    /* the completion and the next requests share the same interrupt */
+    virtio_batch_begin(s);
     virtio_block_req_end(s, ret);
 
     s1->req_in_progress = FALSE;
 
     /* handle next requests */
     queue_notify((VIRTIODevice *)s, s1->req.queue_idx);
+    virtio_batch_end(s);
 }
 
 /* XXX: handle async I/O */
@@ -1102,9 +1572,10 @@ static int virtio_block_recv_request(VIRTIODevice *s, int queue_idx,
         len = read_size - sizeof(h);
         buf = malloc(len);
         memcpy_from_queue(s, buf, queue_idx, desc_idx, sizeof(h), len);
+        /* the buffer is kept until the end of the write */
+        s1->req.buf = buf;
         ret = bs->write_async(bs, h.sector_num, buf, len / SECTOR_SIZE,
                               virtio_block_req_cb, s);
-        free(buf);
         if (ret > 0) {
             /* asyncronous write */
             s1->req_in_progress = TRUE;
@@ -1182,12 +1653,10 @@ static BOOL virtio_net_can_write_packet(EthernetDevice *es)
 {
     VIRTIODevice *s = es->device_opaque;
     QueueState *qs = &s->queue[0];
-    uint16_t avail_idx;
 
     if (!qs->ready)
         return FALSE;
-    avail_idx = virtio_read16(s, qs->avail_addr + 2);
-    return qs->last_avail_idx != avail_idx;
+    return virtio_queue_get_avail(s, 0) >= 0;
 }
 
 static void virtio_net_write_packet(EthernetDevice *es, const uint8_t *buf, int buf_len)
@@ -1199,15 +1668,12 @@ static void virtio_net_write_packet(EthernetDevice *es, const uint8_t *buf, int
     int desc_idx;
     VIRTIONetHeader h;
     int len, read_size, write_size;
-    uint16_t avail_idx;
 
     if (!qs->ready)
         return;
-    avail_idx = virtio_read16(s, qs->avail_addr + 2);
-    if (qs->last_avail_idx == avail_idx)
+    desc_idx = virtio_queue_get_avail(s, queue_idx);
+    if (desc_idx < 0)
         return;
-    desc_idx = virtio_read16(s, qs->avail_addr + 4 +
-                             (qs->last_avail_idx & (qs->num - 1)) * 2);
     if (get_desc_rw_size(s, &read_size, &write_size, queue_idx, desc_idx))
         return;
     len = s1->header_size + buf_len;
@@ -1216,8 +1682,8 @@ static void virtio_net_write_packet(EthernetDevice *es, const uint8_t *buf, int
     memset(&h, 0, s1->header_size);
     memcpy_to_queue(s, queue_idx, desc_idx, 0, &h, s1->header_size);
     memcpy_to_queue(s, queue_idx, desc_idx, s1->header_size, buf, buf_len);
+    virtio_queue_next_avail(s, queue_idx);
     virtio_consume_desc(s, queue_idx, desc_idx, len);
-    qs->last_avail_idx++;
 }
 
 static void virtio_net_set_carrier(EthernetDevice *es, BOOL carrier_state)
@@ -1291,12 +1757,10 @@ static int virtio_console_recv_request(VIRTIODevice *s, int queue_idx,
 BOOL virtio_console_can_write_data(VIRTIODevice *s)
 {
     QueueState *qs = &s->queue[0];
-    uint16_t avail_idx;
 
     if (!qs->ready)
         return FALSE;
-    avail_idx = virtio_read16(s, qs->avail_addr + 2);
-    return qs->last_avail_idx != avail_idx;
+    return virtio_queue_get_avail(s, 0) >= 0;
 }
 
 int virtio_console_get_write_len(VIRTIODevice *s)
@@ -1305,15 +1769,12 @@ int virtio_console_get_write_len(VIRTIODevice *s)
     QueueState *qs = &s->queue[queue_idx];
     int desc_idx;
     int read_size, write_size;
-    uint16_t avail_idx;
 
     if (!qs->ready)
         return 0;
-    avail_idx = virtio_read16(s, qs->avail_addr + 2);
-    if (qs->last_avail_idx == avail_idx)
+    desc_idx = virtio_queue_get_avail(s, queue_idx);
+    if (desc_idx < 0)
         return 0;
-    desc_idx = virtio_read16(s, qs->avail_addr + 4 +
-                             (qs->last_avail_idx & (qs->num - 1)) * 2);
     if (get_desc_rw_size(s, &read_size, &write_size, queue_idx, desc_idx))
         return 0;
     return write_size;
@@ -1324,18 +1785,15 @@ int virtio_console_write_data(VIRTIODevice *s, const uint8_t *buf, int buf_len)
     int queue_idx = 0;
     QueueState *qs = &s->queue[queue_idx];
     int desc_idx;
-    uint16_t avail_idx;
 
     if (!qs->ready)
         return 0;
-    avail_idx = virtio_read16(s, qs->avail_addr + 2);
-    if (qs->last_avail_idx == avail_idx)
+    desc_idx = virtio_queue_get_avail(s, queue_idx);
+    if (desc_idx < 0)
         return 0;
-    desc_idx = virtio_read16(s, qs->avail_addr + 4 +
-                             (qs->last_avail_idx & (qs->num - 1)) * 2);
     memcpy_to_queue(s, queue_idx, desc_idx, 0, buf, buf_len);
+    virtio_queue_next_avail(s, queue_idx);
     virtio_consume_desc(s, queue_idx, desc_idx, buf_len);
-    qs->last_avail_idx++;
     return buf_len;
 }
 
@@ -1427,7 +1885,6 @@ static int virtio_input_queue_event(VIRTIODevice *s,
     int queue_idx = 0;
     QueueState *qs = &s->queue[queue_idx];
     int desc_idx, buf_len;
-    uint16_t avail_idx;
     uint8_t buf[8];
 
     if (!qs->ready)
@@ -1438,15 +1895,13 @@ static int virtio_input_queue_event(VIRTIODevice *s,
     put_le32(buf + 4, value);
     buf_len = 8;
 
-    avail_idx = virtio_read16(s, qs->avail_addr + 2);
-    if (qs->last_avail_idx == avail_idx)
+    desc_idx = virtio_queue_get_avail(s, queue_idx);
+    if (desc_idx < 0)
         return -1;
-    desc_idx = virtio_read16(s, qs->avail_addr + 4 +
-                             (qs->last_avail_idx & (qs->num - 1)) * 2);
     //    printf("send: queue_idx=%d desc_idx=%d\n", queue_idx, desc_idx);
     memcpy_to_queue(s, queue_idx, desc_idx, 0, buf, buf_len);
+    virtio_queue_next_avail(s, queue_idx);
     virtio_consume_desc(s, queue_idx, desc_idx, buf_len);
-    qs->last_avail_idx++;
     return 0;
 }
 
@@ -1458,15 +1913,16 @@ int virtio_input_send_key_event(VIRTIODevice *s, BOOL is_down,
 
     if (s1->type != VIRTIO_INPUT_TYPE_KEYBOARD)
         return -1;
+    virtio_batch_begin(s);
     ret = virtio_input_queue_event(s, VIRTIO_INPUT_EV_KEY, key_code, is_down);
-    if (ret)
-        return ret;
-    return virtio_input_queue_event(s, VIRTIO_INPUT_EV_SYN, 0, 0);
+    if (ret == 0)
+        ret = virtio_input_queue_event(s, VIRTIO_INPUT_EV_SYN, 0, 0);
+    virtio_batch_end(s);
+    return ret;
 }
 
-/* also used for the tablet */
-int virtio_input_send_mouse_event(VIRTIODevice *s, int dx, int dy, int dz,
-                                  unsigned int buttons)
+static int virtio_input_send_mouse_event1(VIRTIODevice *s, int dx, int dy,
+                                          int dz, unsigned int buttons)
 {
     VIRTIOInputDevice *s1 = (VIRTIOInputDevice *)s;
     int ret, i, b, last_b;
@@ -1512,6 +1968,19 @@ int virtio_input_send_mouse_event(VIRTIODevice *s, int dx, int dy, int dz,
     return virtio_input_queue_event(s, VIRTIO_INPUT_EV_SYN, 0, 0);
 }
 
+/* also used for the tablet */
+int virtio_input_send_mouse_event(VIRTIODevice *s, int dx, int dy, int dz,
+                                  unsigned int buttons)
+{
+    int ret;
+
+    /* all the events are signalled with a single interrupt */
+    virtio_batch_begin(s);
+    ret = virtio_input_send_mouse_event1(s, dx, dy, dz, buttons);
+    virtio_batch_end(s);
+    return ret;
+}
+
 static void set_bit(uint8_t *tab, int k)
 {
     tab[k >> 3] |= 1 << (k & 7);
@@ -1647,6 +2116,60 @@ VIRTIODevice *virtio_input_init(VIRTIOBusDef *bus, VirtioInputTypeEnum type)
     return (VIRTIODevice *)s;
 }
 
+/*********************************************************************/
+/* persistent memory device */
+
+#define VIRTIO_PMEM_REQ_TYPE_FLUSH 0
+
+#define VIRTIO_PMEM_RESP_TYPE_OK  0
+#define VIRTIO_PMEM_RESP_TYPE_EIO 1
+
+typedef struct VIRTIOPmemDevice {
+    VIRTIODevice common;
+    PhysMemoryRange *pr;
+} VIRTIOPmemDevice;
+
+static int virtio_pmem_recv_request(VIRTIODevice *s, int queue_idx,
+                                    int desc_idx, int read_size,
+                                    int write_size)
+{
+    VIRTIOPmemDevice *s1 = (VIRTIOPmemDevice *)s;
+    PhysMemoryRange *pr = s1->pr;
+    uint8_t buf[4];
+    uint32_t type, ret;
+
+    if (read_size < 4 || write_size < 4) {
+        virtio_consume_desc(s, queue_idx, desc_idx, 0);
+        return 0;
+    }
+    memcpy_from_queue(s, buf, queue_idx, desc_idx, 0, 4);
+    type = get_le32(buf);
+    ret = VIRTIO_PMEM_RESP_TYPE_EIO;
+    if (type == VIRTIO_PMEM_REQ_TYPE_FLUSH) {
+        /* write the modified pages of a shared file mapping */
+        if (msync(pr->phys_mem, pr->org_size, MS_SYNC) == 0)
+            ret = VIRTIO_PMEM_RESP_TYPE_OK;
+    }
+    put_le32(buf, ret);
+    memcpy_to_queue(s, queue_idx, desc_idx, 0, buf, 4);
+    virtio_consume_desc(s, queue_idx, desc_idx, 4);
+    return 0;
+}
+
+/* 'pr' is the guest memory range directly accessed by the guest */
+VIRTIODevice *virtio_pmem_init(VIRTIOBusDef *bus, PhysMemoryRange *pr)
+{
+    VIRTIOPmemDevice *s;
+
+    s = mallocz(sizeof(*s));
+    virtio_init(&s->common, bus,
+                27, 16, virtio_pmem_recv_request);
+    s->pr = pr;
+    put_le64(s->common.config_space, pr->addr);
+    put_le64(s->common.config_space + 8, pr->org_size);
+    return (VIRTIODevice *)s;
+}
+
 /*********************************************************************/
 /* 9p filesystem device */
 
@@ -1656,12 +2179,21 @@ typedef struct {
     FSFile *fd;
 } FIDDesc;
 
+/* must be a power of two */
+#define P9_REQ_HASH_SIZE 64
+
+#define P9_MSIZE_MAX (512 * 1024)
+/* maximum number of guest memory segments of a read or write request */
+#define P9_SEGS_MAX (P9_MSIZE_MAX / VIRTIO_PAGE_SIZE + 16)
+
 typedef struct VIRTIO9PDevice {
     VIRTIODevice common;
     FSDevice *fs;
     int msize; /* maximum message size */
     struct list_head fid_list; /* list of FIDDesc */
-    BOOL req_in_progress;
+    /* requests waiting for an asynchronous completion, indexed by tag */
+    struct list_head req_hash[P9_REQ_HASH_SIZE]; /* list of P9Request */
+    int req_count;
 } VIRTIO9PDevice;
 
 static FIDDesc *fid_find1(VIRTIO9PDevice *s, uint32_t fid)
@@ -1968,11 +2500,12 @@ static int unmarshall(VIRTIO9PDevice *s, int queue_idx,
     return 0;
 }
 
-static void virtio_9p_send_reply(VIRTIO9PDevice *s, int queue_idx,
-                                 int desc_idx, uint8_t id, uint16_t tag,
-                                 uint8_t *buf, int buf_len)
+/* 'data_len' bytes were already written after 'buf' in the reply */
+static void virtio_9p_send_reply1(VIRTIO9PDevice *s, int queue_idx,
+                                  int desc_idx, uint8_t id, uint16_t tag,
+                                  uint8_t *buf, int buf_len, int data_len)
 {
-    uint8_t *buf1;
+    uint8_t hdr[7];
     int len;
 
 #ifdef DEBUG_VIRTIO
@@ -1982,15 +2515,22 @@ static void virtio_9p_send_reply(VIRTIO9PDevice *s, int queue_idx,
         printf("\n");
     }
 #endif
-    len = buf_len + 7;
-    buf1 = malloc(len);
-    put_le32(buf1, len);
-    buf1[4] = id + 1;
-    put_le16(buf1 + 5, tag);
-    memcpy(buf1 + 7, buf, buf_len);
-    memcpy_to_queue((VIRTIODevice *)s, queue_idx, desc_idx, 0, buf1, len);
+    len = sizeof(hdr) + buf_len + data_len;
+    put_le32(hdr, len);
+    hdr[4] = id + 1;
+    put_le16(hdr + 5, tag);
+    memcpy_to_queue((VIRTIODevice *)s, queue_idx, desc_idx, 0,
+                    hdr, sizeof(hdr));
+    memcpy_to_queue((VIRTIODevice *)s, queue_idx, desc_idx, sizeof(hdr),
+                    buf, buf_len);
     virtio_consume_desc((VIRTIODevice *)s, queue_idx, desc_idx, len);
-    free(buf1);
+}
+
+static void virtio_9p_send_reply(VIRTIO9PDevice *s, int queue_idx,
+                                 int desc_idx, uint8_t id, uint16_t tag,
+                                 uint8_t *buf, int buf_len)
+{
+    virtio_9p_send_reply1(s, queue_idx, desc_idx, id, tag, buf, buf_len, 0);
 }
 
 static void virtio_9p_send_error(VIRTIO9PDevice *s, int queue_idx,
@@ -2004,14 +2544,85 @@ static void virtio_9p_send_error(VIRTIO9PDevice *s, int queue_idx,
 }
 
 typedef struct {
+    struct list_head link;
     VIRTIO9PDevice *dev;
     int queue_idx;
     int desc_idx;
     uint16_t tag;
-} P9OpenInfo;
+    uint32_t fid;
+} P9Request;
+
+static P9Request *p9_req_find_tag(VIRTIO9PDevice *s, uint16_t tag)
+{
+    struct list_head *el;
+    P9Request *req;
+
+    list_for_each(el, &s->req_hash[tag & (P9_REQ_HASH_SIZE - 1)]) {
+        req = list_entry(el, P9Request, link);
+        if (req->tag == tag)
+            return req;
+    }
+    return NULL;
+}
+
+static BOOL p9_req_fid_busy(VIRTIO9PDevice *s, uint32_t fid)
+{
+    struct list_head *el;
+    P9Request *req;
+    int i;
+
+    for(i = 0; i < P9_REQ_HASH_SIZE; i++) {
+        list_for_each(el, &s->req_hash[i]) {
+            req = list_entry(el, P9Request, link);
+            if (req->fid == fid)
+                return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static void p9_req_add(VIRTIO9PDevice *s, P9Request *req)
+{
+    list_add_tail(&req->link, &s->req_hash[req->tag & (P9_REQ_HASH_SIZE - 1)]);
+    s->req_count++;
+}
+
+static void p9_req_del(VIRTIO9PDevice *s, P9Request *req)
+{
+    list_del(&req->link);
+    s->req_count--;
+}
+
+/* Return TRUE if the request must wait for the completion of a pending
+   one. Otherwise it is processed while the others are pending and the
+   replies may be sent out of order. */
+static BOOL virtio_9p_must_wait(VIRTIO9PDevice *s, int queue_idx,
+                                int desc_idx, uint8_t id)
+{
+    uint8_t buf[4];
+
+    if (s->req_count == 0)
+        return FALSE;
+    /* with the packed ring, the used descriptors are written in
+       order, so a single request can be in progress */
+    if (virtio_is_packed((VIRTIODevice *)s))
+        return TRUE;
+    if (id == 100) /* version */
+        return TRUE;
+    if (memcpy_from_queue((VIRTIODevice *)s, buf, queue_idx, desc_idx,
+                          7, id == 108 ? 2 : 4))
+        return FALSE;
+    if (id == 108) {
+        /* flush: the reply must follow the one of the flushed request */
+        return p9_req_find_tag(s, get_le16(buf)) != NULL;
+    } else {
+        /* the fid is the first field of all the other requests */
+        return p9_req_fid_busy(s, get_le32(buf));
+    }
+}
 
 static void virtio_9p_open_reply(FSDevice *fs, FSQID *qid, int err,
-                                 P9OpenInfo *oi)
+                                 P9Request *oi)
 {
     VIRTIO9PDevice *s = oi->dev;
     uint8_t buf[32];
@@ -2031,16 +2642,17 @@ static void virtio_9p_open_reply(FSDevice *fs, FSQID *qid, int err,
 static void virtio_9p_open_cb(FSDevice *fs, FSQID *qid, int err,
                               void *opaque)
 {
-    P9OpenInfo *oi = opaque;
+    P9Request *oi = opaque;
     VIRTIO9PDevice *s = oi->dev;
     int queue_idx = oi->queue_idx;
 
+    virtio_batch_begin((VIRTIODevice *)s);
+    p9_req_del(s, oi);
     virtio_9p_open_reply(fs, qid, err, oi);
 
-    s->req_in_progress = FALSE;
-
-    /* handle next requests */
+    /* handle the requests which were waiting for this one */
     queue_notify((VIRTIODevice *)s, queue_idx);
+    virtio_batch_end((VIRTIODevice *)s);
 }
 
 static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
@@ -2058,9 +2670,6 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
     if (queue_idx != 0)
         return 0;
 
-    if (s->req_in_progress)
-        return -1;
-
     offset = 0;
     header_len = 4 + 1 + 2;
     if (memcpy_from_queue(s1, buf, queue_idx, desc_idx, offset, header_len)) {
@@ -2072,6 +2681,9 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
     tag = get_le16(buf + 5);
     offset += header_len;
 
+    if (virtio_9p_must_wait(s, queue_idx, desc_idx, id))
+        return -1;
+
 #ifdef DEBUG_VIRTIO
     if (s1->debug & VIRTIO_DEBUG_9P) {
         const char *name;
@@ -2110,7 +2722,7 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
             uint32_t fid, flags;
             FSFile *f;
             FSQID qid;
-            P9OpenInfo *oi;
+            P9Request *oi;
 
             if (unmarshall(s, queue_idx, desc_idx, &offset,
                            "ww", &fid, &flags))
@@ -2123,11 +2735,13 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
             oi->queue_idx = queue_idx;
             oi->desc_idx = desc_idx;
             oi->tag = tag;
+            oi->fid = fid;
             err = fs->fs_open(fs, &qid, f, flags, virtio_9p_open_cb, oi);
             if (err <= 0) {
                 virtio_9p_open_reply(fs, &qid, err, oi);
             } else {
-                s->req_in_progress = TRUE;
+                /* the next requests are handled meanwhile */
+                p9_req_add(s, oi);
             }
         }
         break;
@@ -2463,6 +3077,8 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
             if (unmarshall(s, queue_idx, desc_idx, &offset,
                            "ws", &msize, &version))
                 goto protocol_error;
+            if (msize > P9_MSIZE_MAX)
+                msize = P9_MSIZE_MAX;
             s->msize = msize;
             //            printf("version: msize=%d version=%s\n", msize, version);
             free(version);
@@ -2548,9 +3164,10 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
         {
             uint32_t fid, count;
             uint64_t offs;
-            uint8_t *buf;
-            int n;
+            uint8_t *buf1;
+            int n, l, i, nb_segs;
             FSFile *f;
+            VIRTIOSegment tab[P9_SEGS_MAX];
 
             if (unmarshall(s, queue_idx, desc_idx, &offset,
                            "wdw", &fid, &offs, &count))
@@ -2558,16 +3175,45 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
             f = fid_find(s, fid);
             if (!f)
                 goto fid_not_found;
-            buf = malloc(count + 4);
-            n = fs->fs_read(fs, f, offs, buf + 4, count);
-            if (n < 0) {
-                err = n;
-                free(buf);
-                goto error;
+            /* the reply must fit in the negotiated message size */
+            l = max_int(s->msize - (7 + 4), 0);
+            if (count > l)
+                count = l;
+            /* read directly into the guest buffers, after the header
+               and the count */
+            nb_segs = get_queue_segments(s1, tab, countof(tab), queue_idx,
+                                         desc_idx, 7 + 4, count, TRUE);
+            if (nb_segs >= 0) {
+                n = 0;
+                for(i = 0; i < nb_segs; i++) {
+                    l = fs->fs_read(fs, f, offs + n, tab[i].ptr, tab[i].len);
+                    if (l < 0) {
+                        if (n == 0) {
+                            err = l;
+                            goto error;
+                        }
+                        break;
+                    }
+                    n += l;
+                    if (l < tab[i].len)
+                        break;
+                }
+                put_le32(buf, n);
+                virtio_9p_send_reply1(s, queue_idx, desc_idx, id, tag,
+                                      buf, 4, n);
+            } else {
+                buf1 = malloc(count + 4);
+                n = fs->fs_read(fs, f, offs, buf1 + 4, count);
+                if (n < 0) {
+                    err = n;
+                    free(buf1);
+                    goto error;
+                }
+                put_le32(buf1, n);
+                virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag,
+                                     buf1, n + 4);
+                free(buf1);
             }
-            put_le32(buf, n);
-            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, n + 4);
-            free(buf);
         }
         break;
     case 118: /* write */
@@ -2575,8 +3221,9 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
             uint32_t fid, count;
             uint64_t offs;
             uint8_t *buf1;
-            int n;
+            int n, l, i, nb_segs;
             FSFile *f;
+            VIRTIOSegment tab[P9_SEGS_MAX];
 
             if (unmarshall(s, queue_idx, desc_idx, &offset,
                            "wdw", &fid, &offs, &count))
@@ -2584,17 +3231,43 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
             f = fid_find(s, fid);
             if (!f)
                 goto fid_not_found;
-            buf1 = malloc(count);
-            if (memcpy_from_queue(s1, buf1, queue_idx, desc_idx, offset,
-                                  count)) {
+            /* the request cannot be larger than the negotiated message
+               size */
+            l = max_int(s->msize - offset, 0);
+            if (count > l)
+                count = l;
+            /* write directly from the guest buffers */
+            nb_segs = get_queue_segments(s1, tab, countof(tab), queue_idx,
+                                         desc_idx, offset, count, FALSE);
+            if (nb_segs >= 0) {
+                n = 0;
+                for(i = 0; i < nb_segs; i++) {
+                    l = fs->fs_write(fs, f, offs + n, tab[i].ptr,
+                                     tab[i].len);
+                    if (l < 0) {
+                        if (n == 0) {
+                            err = l;
+                            goto error;
+                        }
+                        break;
+                    }
+                    n += l;
+                    if (l < tab[i].len)
+                        break;
+                }
+            } else {
+                buf1 = malloc(count);
+                if (memcpy_from_queue(s1, buf1, queue_idx, desc_idx, offset,
+                                      count)) {
+                    free(buf1);
+                    goto protocol_error;
+                }
+                n = fs->fs_write(fs, f, offs, buf1, count);
                 free(buf1);
-                goto protocol_error;
-            }
-            n = fs->fs_write(fs, f, offs, buf1, count);
-            free(buf1);
-            if (n < 0) {
-                err = n;
-                goto error;
+                if (n < 0) {
+                    err = n;
+                    goto error;
+                }
             }
             buf_len = marshall(s, buf, sizeof(buf), "w", n);
             virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
@@ -2630,7 +3303,7 @@ VIRTIODevice *virtio_9p_init(VIRTIOBusDef *bus, FSDevice *fs,
 
 {
     VIRTIO9PDevice *s;
-    int len;
+    int len, i;
     uint8_t *cfg;
 
     len = strlen(mount_tag);
@@ -2648,6 +3321,8 @@ VIRTIODevice *virtio_9p_init(VIRTIOBusDef *bus, FSDevice *fs,
     s->fs = fs;
     s->msize = 8192;
     init_list_head(&s->fid_list);
+    for(i = 0; i < P9_REQ_HASH_SIZE; i++)
+        init_list_head(&s->req_hash[i]);
 
     return (VIRTIODevice *)s;
 }
@@ -136,6 +136,10 @@ int virtio_input_send_mouse_event(VIRTIODevice *s, int dx, int dy, int dz,
 
 VIRTIODevice *virtio_input_init(VIRTIOBusDef *bus, VirtioInputTypeEnum type);
 
+/* persistent memory device */
+
+VIRTIODevice *virtio_pmem_init(VIRTIOBusDef *bus, PhysMemoryRange *pr);
+
 /* 9p filesystem device */
 
 #include "fs.h"